@@ -1,134 +1,432 @@
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
 
 #include "HashMap.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Open addressing with Robin Hood probing: all entries live in one flat
+// array, and every slot remembers how far it is from its home position.
+// A lookup can stop as soon as it meets a slot closer to home than itself.
+
+// Readers may run concurrently with one writer (see hmap_set_release), so
+// readers load every pointer exactly once, and writers publish pairs and
+// tables only after they are fully initialized.
+
+// Capacity of the first table allocated by hmap_insert. Most folders have few
+// children, so it is small; a map which becomes empty frees its table.
+#define MIN_CAPACITY 2
+
+// The table grows when it would become more than 7/8 full.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
 
 typedef struct Pair Pair;
 
+// A key-value pair together with its key, allocated as one block of
+// offsetof(Pair, key) + length + 1 bytes.
 struct Pair {
-    char* key;
     void* value;
-    Pair* next; // Next item in a single-linked list.
+    // High bits of the key's hash; with the low ones in the slot, keys are
+    // compared only if the whole hashes are equal.
+    uint32_t hash;
+    uint32_t length; // Length of the key.
+    char key[]; // Null-terminated copy of the key.
 };
 
-struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
-    size_t size; // total number of entries in map.
+typedef struct Slot Slot;
+
+struct Slot {
+    Pair* pair;
+    uint32_t hash; // Low bits of the key's hash, so probing doesn't touch the pair.
+    uint32_t dist; // Distance from the home slot plus one, 0 if empty.
+};
+
+typedef struct HashMapTable Table;
+
+struct HashMapTable {
+    size_t mask; // Capacity - 1, capacity is a power of two.
+    Slot slots[];
 };
 
-static unsigned int get_hash(const char* key);
+// Per-process seed of hmap_hash, set before main() starts.
+static uint64_t hash_seed;
+
+static Table* table_new(size_t capacity)
+{
+    Table* table = calloc(1, sizeof(Table) + capacity * sizeof(Slot));
+    if (!table)
+        return NULL;
+    table->mask = capacity - 1;
+    return table;
+}
+
+static void slot_store(Slot* slot, Slot value)
+{
+    __atomic_store_n(&slot->hash, value.hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->dist, value.dist, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->pair, value.pair, __ATOMIC_RELEASE);
+}
+
+// Put `slot` into `table`, which must have a free slot and must not
+// contain the key yet. `slot.dist` should be 1.
+static void table_place(Table* table, Slot slot)
+{
+    size_t i = slot.hash & table->mask;
+    while (true) {
+        Slot* cur = &table->slots[i];
+        if (cur->dist == 0) {
+            slot_store(cur, slot);
+            return;
+        }
+        // Take the place of an entry which is closer to its home slot.
+        if (cur->dist < slot.dist) {
+            Slot tmp = *cur;
+            slot_store(cur, slot);
+            slot = tmp;
+        }
+        slot.dist++;
+        i = (i + 1) & table->mask;
+    }
+}
+
+// Move all entries to a new table of given capacity.
+static bool hmap_resize(HashMap* map, size_t capacity)
+{
+    Table* old = map->table;
+    Table* table = table_new(capacity);
+    if (!table)
+        return false;
+    if (old) {
+        for (size_t i = 0; i <= old->mask; ++i) {
+            Slot slot = old->slots[i];
+            if (slot.dist) {
+                slot.dist = 1;
+                table_place(table, slot);
+            }
+        }
+        map->release(old);
+    }
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool hmap_grow(HashMap* map)
+{
+    Table* old = map->table;
+    return hmap_resize(map, old ? (old->mask + 1) * 2 : MIN_CAPACITY);
+}
+
+bool hmap_reserve(HashMap* map, size_t count)
+{
+    size_t capacity = map->table ? map->table->mask + 1 : MIN_CAPACITY;
+    while (count * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM)
+        capacity *= 2;
+    if (map->table && capacity == map->table->mask + 1)
+        return true;
+    return hmap_resize(map, capacity);
+}
 
 HashMap* hmap_new()
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
-    memset(map, 0, sizeof(HashMap));
+    hmap_init(map);
     return map;
 }
 
-void hmap_free(HashMap* map)
+void hmap_init(HashMap* map)
+{
+    map->table = NULL;
+    map->size = 0;
+    map->release = free;
+}
+
+void hmap_clear(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
-            Pair* q = p;
-            p = p->next;
-            free(q->key);
-            free(q);
+    Table* table = map->table;
+    if (table) {
+        for (size_t i = 0; i <= table->mask; ++i) {
+            if (table->slots[i].dist)
+                free(table->slots[i].pair);
         }
+        free(table);
     }
+    map->table = NULL;
+    map->size = 0;
+}
+
+void hmap_set_release(HashMap* map, void (*release)(void*))
+{
+    map->release = release;
+}
+
+void hmap_free(HashMap* map)
+{
+    hmap_clear(map);
     free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+// Return the slot holding `key` and set `*pair` to its pair.
+static Slot* hmap_find(HashMap* map, uint64_t hash, const char* key, size_t length,
+                       Pair** pair)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
-            return p;
+    Table* table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    if (!table)
+        return NULL;
+    uint32_t h = (uint32_t)hash;
+    size_t mask = table->mask;
+    size_t i = h & mask;
+    // The bound on `dist` matters only for concurrent readers.
+    for (uint32_t dist = 1; dist <= mask + 1; ++dist) {
+        Slot* p = &table->slots[i];
+        // An empty slot or an entry closer to its home ends the probe.
+        if (__atomic_load_n(&p->dist, __ATOMIC_RELAXED) < dist)
+            return NULL;
+        if (__atomic_load_n(&p->hash, __ATOMIC_RELAXED) == h) {
+            Pair* q = __atomic_load_n(&p->pair, __ATOMIC_ACQUIRE);
+            if (q && q->hash == (uint32_t)(hash >> 32) && q->length == length
+                && memcmp(key, q->key, length) == 0) {
+                *pair = q;
+                return p;
+            }
+        }
+        i = (i + 1) & mask;
     }
     return NULL;
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    size_t length = strlen(key);
+    return hmap_get_h(map, key, length, hmap_hash(key, length));
+}
+
+void* hmap_get_h(HashMap* map, const char* key, size_t length, uint64_t hash)
+{
+    Pair* pair;
+    Slot* p = hmap_find(map, hash, key, length, &pair);
     if (p)
-        return p->value;
+        return __atomic_load_n(&pair->value, __ATOMIC_ACQUIRE);
     else
         return NULL;
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
+{
+    size_t length = strlen(key);
+    return hmap_insert_h(map, key, length, hmap_hash(key, length), value);
+}
+
+bool hmap_insert_h(HashMap* map, const char* key, size_t length, uint64_t hash,
+                   void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    Pair* pair;
+    Slot* p = hmap_find(map, hash, key, length, &pair);
     if (p)
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
-    new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
-    map->size++;
+    Table* table = map->table;
+    if (!table || (map->size + 1) * MAX_LOAD_DEN > (table->mask + 1) * MAX_LOAD_NUM) {
+        if (!hmap_grow(map))
+            return false;
+    }
+    pair = malloc(offsetof(Pair, key) + length + 1);
+    if (!pair)
+        return false;
+    pair->value = value;
+    pair->hash = (uint32_t)(hash >> 32);
+    pair->length = length;
+    memcpy(pair->key, key, length);
+    pair->key[length] = '\0';
+    Slot slot = { pair, (uint32_t)hash, 1 };
+    table_place(map->table, slot);
+    __atomic_store_n(&map->size, map->size + 1, __ATOMIC_RELAXED);
     return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
-            return true;
+    size_t length = strlen(key);
+    return hmap_remove_h(map, key, length, hmap_hash(key, length));
+}
+
+bool hmap_remove_h(HashMap* map, const char* key, size_t length, uint64_t hash)
+{
+    Pair* pair;
+    Slot* p = hmap_find(map, hash, key, length, &pair);
+    if (!p)
+        return false;
+    // Backward shift deletion: pull the following entries of the probe
+    // sequence one slot closer to home, so no tombstones are needed.
+    Table* table = map->table;
+    size_t i = p - table->slots;
+    while (true) {
+        size_t next = (i + 1) & table->mask;
+        if (table->slots[next].dist <= 1) {
+            __atomic_store_n(&table->slots[i].dist, 0, __ATOMIC_RELAXED);
+            break;
         }
-        pp = &(p->next);
+        Slot moved = table->slots[next];
+        moved.dist--;
+        slot_store(&table->slots[i], moved);
+        i = next;
     }
-    return false;
+    __atomic_store_n(&map->size, map->size - 1, __ATOMIC_RELAXED);
+    if (map->size == 0) {
+        __atomic_store_n(&map->table, NULL, __ATOMIC_RELEASE);
+        map->release(table);
+    }
+    map->release(pair);
+    return true;
+}
+
+bool hmap_replace_h(HashMap* map, const char* key, size_t length, uint64_t hash,
+                    void* expected, void* value)
+{
+    Pair* pair;
+    if (!value || !hmap_find(map, hash, key, length, &pair))
+        return false;
+    return __atomic_compare_exchange_n(&pair->value, &expected, value, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 }
 
 size_t hmap_size(HashMap* map)
 {
-    return map->size;
+    return __atomic_load_n(&map->size, __ATOMIC_RELAXED);
+}
+
+size_t hmap_memory(HashMap* map)
+{
+    Table* table = map->table;
+    if (!table)
+        return 0;
+    size_t bytes = sizeof(Table) + (table->mask + 1) * sizeof(Slot);
+    for (size_t i = 0; i <= table->mask; ++i) {
+        if (table->slots[i].dist)
+            bytes += offsetof(Pair, key) + table->slots[i].pair->length + 1;
+    }
+    return bytes;
 }
 
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    (void)map;
+    HashMapIterator it = { 0 };
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-    Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
-    }
-    if (!p)
+    Table* table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    if (!table)
         return false;
-    *key = p->key;
-    *value = p->value;
-    it->pair = p->next;
-    return true;
+    while (it->slot <= table->mask) {
+        Slot* p = &table->slots[it->slot++];
+        if (__atomic_load_n(&p->dist, __ATOMIC_RELAXED)) {
+            Pair* pair = __atomic_load_n(&p->pair, __ATOMIC_ACQUIRE);
+            if (!pair)
+                continue;
+            *key = pair->key;
+            *value = __atomic_load_n(&pair->value, __ATOMIC_ACQUIRE);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The hash follows the structure of wyhash (public domain): input words are
+// combined with secret constants by 64x64->128 bit multiplications.
+static const uint64_t secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void mum(uint64_t* a, uint64_t* b)
+{
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hmap_hash(const char* key, size_t length)
+{
+    const unsigned char* p = (const unsigned char*)key;
+    uint64_t seed = hash_seed ^ mix(hash_seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t shift = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + shift);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - shift);
+        }
+        else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        size_t i = length;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    mum(&a, &b);
+    return mix(a ^ secret[0] ^ length, b ^ secret[1]);
 }
 
-static unsigned int get_hash(const char* key)
+// Pick a random seed, so directory names can't be chosen to collide.
+__attribute__((constructor)) static void init_hash_seed(void)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
+    if (getrandom(&hash_seed, sizeof(hash_seed), GRND_NONBLOCK) != sizeof(hash_seed)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        hash_seed = mix((uint64_t)ts.tv_nsec ^ secret[2],
+                        (uint64_t)ts.tv_sec ^ (uintptr_t)&ts);
     }
-    return hash % N_BUCKETS;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // A structure representing a mapping from keys to values.
@@ -10,8 +11,25 @@ typedef struct HashMap HashMap;
 // Create a new, empty map.
 HashMap* hmap_new();
 
+// Initialize a map embedded in another structure (see `struct HashMap`).
+// Such a map is released with hmap_clear instead of hmap_free.
+void hmap_init(HashMap* map);
+
+// Remove all entries and release the memory they use, as hmap_free does,
+// but keep the map itself, which stays empty and usable.
+void hmap_clear(HashMap* map);
+
+// Set the function which releases pairs removed by hmap_remove and tables
+// replaced when the map grows (by default it is free). With a function which
+// defers releasing until concurrent readers are done (see epoch.h), hmap_get
+// and hmap_next may run concurrently with one modifying thread. Such readers
+// never crash, but may get inconsistent results, which they have to validate
+// on their own. hmap_clear and hmap_free always release memory immediately.
+void hmap_set_release(HashMap* map, void (*release)(void*));
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
+// Each entry is a single allocation holding the key inline.
 void hmap_free(HashMap* map);
 
 // Get the value stored under `key`, or NULL if not present.
@@ -27,9 +45,36 @@ bool hmap_insert(HashMap* map, const char* key, void* value);
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
 
+// Return the 64-bit hash of the `length` characters at `key`, as used by
+// the map. The hash function is seeded randomly once per process.
+uint64_t hmap_hash(const char* key, size_t length);
+
+// Variants of hmap_get, hmap_insert and hmap_remove for callers which
+// already know the key's length and its `hash` (which must equal
+// hmap_hash(key, length)). `key` doesn't have to be null-terminated.
+void* hmap_get_h(HashMap* map, const char* key, size_t length, uint64_t hash);
+bool hmap_insert_h(HashMap* map, const char* key, size_t length, uint64_t hash,
+                   void* value);
+bool hmap_remove_h(HashMap* map, const char* key, size_t length, uint64_t hash);
+
+// Replace the value under `key` with `value` and return true if it is
+// `expected`, or do nothing and return false otherwise (also if `key` is not
+// present). Unlike other modifications, it may run concurrently with readers
+// and with other calls of hmap_replace_h, but not with other modifications.
+bool hmap_replace_h(HashMap* map, const char* key, size_t length, uint64_t hash,
+                    void* expected, void* value);
+
+// Make room for `count` entries, so inserting them doesn't grow the table.
+// Return false if memory can't be allocated.
+bool hmap_reserve(HashMap* map, size_t count);
+
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Return the number of bytes allocated for the map's table and entries,
+// excluding the map itself. The map cannot be modified meanwhile.
+size_t hmap_memory(HashMap* map);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
@@ -51,7 +96,14 @@ HashMapIterator hmap_iterator(HashMap* map);
 // ```
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
+// The map is defined here only so it can be embedded in other structures;
+// its fields should not be accessed directly.
+struct HashMap {
+    struct HashMapTable* table; // NULL while the map has no entries.
+    size_t size; // total number of entries in map.
+    void (*release)(void*); // See hmap_set_release.
+};
+
 struct HashMapIterator {
-    int bucket;
-    void* pair;
+    size_t slot; // Index of the next slot to inspect.
 };
@@ -0,0 +1,292 @@
+#include "NodePool.h"
+#include "utils.h"
+#include "err.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Number of objects carved out of one slab.
+#define OBJECTS_PER_SLAB 256
+
+// A thread cache holding more free objects than CACHE_CAPACITY gives
+// CACHE_BATCH of them back to the pool. An empty cache takes CACHE_BATCH
+// objects from the pool at once.
+#define CACHE_CAPACITY 64
+#define CACHE_BATCH 32
+
+// Pools with at least PARALLEL_DESTROY_SLABS slabs are destroyed by up to
+// MAX_DESTROY_THREADS threads, which take slabs one by one.
+#define PARALLEL_DESTROY_SLABS 64
+#define MAX_DESTROY_THREADS 8
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+    Chunk *next; // Next free chunk, used only while the chunk is free.
+    alignas(max_align_t) unsigned char object[];
+};
+
+typedef struct Slab Slab;
+
+struct Slab {
+    Slab *next;
+    alignas(max_align_t) unsigned char chunks[];
+};
+
+struct NodePool {
+    size_t chunk_size;
+    void (*construct)(void *);
+    void (*destruct)(void *);
+    uint64_t id; // Unique among all pools ever created in this process.
+    NodePool *next_live; // Next pool in `live_pools`.
+
+    pthread_mutex_t lock; // Protects `free_list` and `slabs`.
+    Chunk *free_list;
+    Slab *slabs;
+};
+
+// Free objects cached by the current thread. All of them belong to the pool
+// with id `pool_id`, which may already be destroyed - so the chunks may be
+// touched only after checking in `live_pools` that the pool still exists.
+typedef struct {
+    uint64_t pool_id;
+    Chunk *head;
+    size_t count;
+    bool registered; // Whether the thread exit destructor is set up.
+} ThreadCache;
+
+static _Thread_local ThreadCache cache;
+
+// Registry of existing pools, used when a thread cache changes its pool.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static NodePool *live_pools;
+static uint64_t next_pool_id = 1;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+
+static Chunk *chunk_of(void *object) {
+    return (Chunk *) ((unsigned char *) object - offsetof(Chunk, object));
+}
+
+
+static Chunk *slab_chunk(NodePool *pool, Slab *slab, size_t i) {
+    return (Chunk *) (slab->chunks + i * pool->chunk_size);
+}
+
+
+// Gives objects from the thread cache back to their pool, if it still exists.
+static void flush_cache(ThreadCache *c) {
+    if (c->count > 0) {
+        safe_lock(&registry_lock);
+        NodePool *pool = live_pools;
+        while (pool && pool->id != c->pool_id)
+            pool = pool->next_live;
+        if (pool) {
+            Chunk *tail = c->head;
+            while (tail->next)
+                tail = tail->next;
+            safe_lock(&pool->lock);
+            tail->next = pool->free_list;
+            pool->free_list = c->head;
+            safe_unlock(&pool->lock);
+        }
+        safe_unlock(&registry_lock);
+    }
+    c->head = NULL;
+    c->count = 0;
+}
+
+
+static void cache_destructor(void *arg) {
+    flush_cache(arg);
+}
+
+
+static void create_cache_key(void) {
+    if (pthread_key_create(&cache_key, cache_destructor) != 0)
+        fatal("Key create failed.");
+}
+
+
+// Makes the thread cache hold objects of `pool`.
+static void use_pool(NodePool *pool) {
+    if (cache.pool_id == pool->id)
+        return;
+    if (!cache.registered) {
+        pthread_once(&cache_key_once, create_cache_key);
+        if (pthread_setspecific(cache_key, &cache) != 0)
+            fatal("Set specific failed.");
+        cache.registered = true;
+    }
+    flush_cache(&cache);
+    cache.pool_id = pool->id;
+}
+
+
+// Puts a newly constructed slab on the shared free list.
+// Pool lock should be held.
+static void add_slab(NodePool *pool) {
+    Slab *slab = safe_malloc(sizeof(Slab) + OBJECTS_PER_SLAB * pool->chunk_size);
+    for (size_t i = 0; i < OBJECTS_PER_SLAB; ++i) {
+        Chunk *chunk = slab_chunk(pool, slab, i);
+        if (pool->construct)
+            pool->construct(chunk->object);
+        chunk->next = pool->free_list;
+        pool->free_list = chunk;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+}
+
+
+NodePool *pool_new(size_t object_size, void (*construct)(void *),
+                   void (*destruct)(void *)) {
+    NodePool *pool = safe_malloc(sizeof(NodePool));
+    size_t align = alignof(max_align_t);
+    pool->chunk_size = (sizeof(Chunk) + object_size + align - 1) / align * align;
+    pool->construct = construct;
+    pool->destruct = destruct;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    safe_mutex_init(&pool->lock);
+
+    safe_lock(&registry_lock);
+    pool->id = next_pool_id++;
+    pool->next_live = live_pools;
+    live_pools = pool;
+    safe_unlock(&registry_lock);
+    return pool;
+}
+
+
+void *pool_alloc(NodePool *pool) {
+    use_pool(pool);
+    if (!cache.head) {
+        safe_lock(&pool->lock);
+        if (!pool->free_list)
+            add_slab(pool);
+        while (pool->free_list && cache.count < CACHE_BATCH) {
+            Chunk *chunk = pool->free_list;
+            pool->free_list = chunk->next;
+            chunk->next = cache.head;
+            cache.head = chunk;
+            cache.count++;
+        }
+        safe_unlock(&pool->lock);
+    }
+    Chunk *chunk = cache.head;
+    cache.head = chunk->next;
+    cache.count--;
+    return chunk->object;
+}
+
+
+void pool_free(NodePool *pool, void *object) {
+    use_pool(pool);
+    Chunk *chunk = chunk_of(object);
+    chunk->next = cache.head;
+    cache.head = chunk;
+    cache.count++;
+    if (cache.count <= CACHE_CAPACITY)
+        return;
+
+    Chunk *first = cache.head;
+    Chunk *last = first;
+    for (size_t i = 1; i < CACHE_BATCH; ++i)
+        last = last->next;
+    cache.head = last->next;
+    cache.count -= CACHE_BATCH;
+    safe_lock(&pool->lock);
+    last->next = pool->free_list;
+    pool->free_list = first;
+    safe_unlock(&pool->lock);
+}
+
+
+size_t pool_memory(NodePool *pool) {
+    size_t slabs = 0;
+    safe_lock(&pool->lock);
+    for (Slab *slab = pool->slabs; slab; slab = slab->next)
+        slabs++;
+    safe_unlock(&pool->lock);
+    return slabs * (sizeof(Slab) + OBJECTS_PER_SLAB * pool->chunk_size);
+}
+
+
+// Slabs of a pool being destroyed, shared by destroying threads.
+typedef struct {
+    NodePool *pool;
+    Slab **slabs;
+    size_t count;
+    size_t next; // Next slab to take.
+} Teardown;
+
+
+static void *destroy_slabs(void *arg) {
+    Teardown *teardown = arg;
+    NodePool *pool = teardown->pool;
+    size_t i;
+    while ((i = __atomic_fetch_add(&teardown->next, 1, __ATOMIC_RELAXED))
+           < teardown->count) {
+        Slab *slab = teardown->slabs[i];
+        if (pool->destruct) {
+            for (size_t j = 0; j < OBJECTS_PER_SLAB; ++j)
+                pool->destruct(slab_chunk(pool, slab, j)->object);
+        }
+        free(slab);
+    }
+    return NULL;
+}
+
+
+void pool_destroy(NodePool *pool) {
+    safe_lock(&registry_lock);
+    NodePool **pp = &live_pools;
+    while (*pp != pool)
+        pp = &(*pp)->next_live;
+    *pp = pool->next_live;
+    safe_unlock(&registry_lock);
+
+    // Cached chunks of this pool are released with their slabs.
+    if (cache.pool_id == pool->id) {
+        cache.head = NULL;
+        cache.count = 0;
+    }
+
+    Teardown teardown = { .pool = pool, .count = 0, .next = 0 };
+    for (Slab *slab = pool->slabs; slab; slab = slab->next)
+        teardown.count++;
+    teardown.slabs = safe_malloc((teardown.count + 1) * sizeof(Slab *));
+    size_t n = 0;
+    for (Slab *slab = pool->slabs; slab; slab = slab->next)
+        teardown.slabs[n++] = slab;
+
+    size_t n_threads = 1;
+    if (pool->destruct && teardown.count >= PARALLEL_DESTROY_SLABS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > MAX_DESTROY_THREADS ? MAX_DESTROY_THREADS
+                    : cpus > 1 ? (size_t) cpus : 1;
+    }
+    pthread_t helpers[MAX_DESTROY_THREADS];
+    size_t n_helpers = 0;
+    while (n_helpers + 1 < n_threads
+           && pthread_create(&helpers[n_helpers], NULL, destroy_slabs,
+                             &teardown) == 0)
+        n_helpers++;
+    destroy_slabs(&teardown);
+    for (size_t i = 0; i < n_helpers; ++i) {
+        if (pthread_join(helpers[i], NULL) != 0)
+            fatal("Thread join failed.");
+    }
+
+    free(teardown.slabs);
+    safe_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+// A pool of fixed-size objects carved out of large slabs.
+// Objects are constructed once, when their slab is created, and keep their
+// constructed state while they sit on free lists, so pool_alloc/pool_free
+// don't have to initialize and destroy them again.
+// Every thread keeps a small cache of free objects of the pool it used last,
+// so in steady state allocation and freeing take no lock at all.
+typedef struct NodePool NodePool;
+
+// Create a pool of objects of `object_size` bytes.
+// `construct` is called on every object when its slab is allocated and
+// `destruct` on every object when the pool is destroyed (either can be NULL).
+NodePool* pool_new(size_t object_size, void (*construct)(void*),
+                   void (*destruct)(void*));
+
+// Return a constructed object. Reports an error and finishes the program
+// if memory is exhausted.
+void* pool_alloc(NodePool* pool);
+
+// Give an object back to its pool. It should be in the constructed state.
+void pool_free(NodePool* pool, void* object);
+
+// Return the number of bytes of all slabs of the pool, including objects
+// which are free.
+size_t pool_memory(NodePool* pool);
+
+// Destruct all objects and release all slabs at once. Objects which were
+// not given back with pool_free are released as well. Large pools are
+// destructed by several threads, so `destruct` should be thread-safe for
+// distinct objects. No other thread may use the pool during or after this
+// call.
+void pool_destroy(NodePool* pool);
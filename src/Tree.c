@@ -2,6 +2,16 @@
 #include "HashMap.h"
 #include "path_utils.h"
 #include "utils.h"
+#include "NodePool.h"
+#include "epoch.h"
+#include "rwlock.h"
+#include "listing.h"
+#include "reclaim.h"
+#include "dcache.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "treefile.h"
+#include "journal.h"
 #include "err.h"
 
 #include <errno.h>
@@ -10,467 +20,2830 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
 
 // Operations on tree which need only read-permission from hashmap are treated
 // like readers in readers and writers problem. Of course operations which
 // modify some things in hashmaps are treated like writers.
 
-// Move() operation perform a lock in LCA of source and target until source
-// and target are writer-locked. Then it unlocks lca lock and wait for all
-// processes in subtree of source to finish (they have to finish their work,
-// so there are no problems with change of path name).
+// Move() operation takes writer permission to parents of source and target,
+// keeping reader permission to all vertices on the way until both are
+// locked, so other moves under the same ancestors can run at the same time.
+// Many moves lock their parents in the order of paths, so they don't
+// deadlock. Then it waits for all processes in subtree of source to finish
+// (they have to finish their work, so there are no problems with change of
+// path name).
 
 // Remove() operation also waits for all processes to finish so removing of a
 // vertex can be performed safely.
 
+// To know which processes are in a subtree, every process increments the
+// `inflight` counter of each vertex it enters (except the root, which is
+// never moved or removed) and decrements all of them when it finishes.
+// So waiting for a subtree costs the same regardless of its size.
+
 // When going through path from parent to son it is important to lock son
-// mutex before unlocking parent mutex (if it is not done then remove() and
-// move() might not see some processes correctly).
+// before unlocking parent (if it is not done then remove() and move() might
+// not see some processes correctly).
+
+// Operations on a folder first try to skip locking its ancestors. They go
+// down the path without locks, like list() does, enter all vertices on it
+// and then check that none of them got detached, like cached paths are used
+// (see below). So a change of a deep folder usually takes one lock, writer
+// permission to its parent; they go hand over hand only if writers get in
+// the way.
+
+// List() operation first tries to go through the tree without any locks.
+// Every vertex has a sequence number which writers make odd for the time
+// they hold writer permission, so a reader which sees the same even number
+// before and after reading knows nobody changed the vertex in between.
+// Removed vertices, maps' tables and keys are freed only after all such
+// readers are done with them (see epoch.h).
+
+// All nodes of one tree come from the tree's own NodePool. Synchronization
+// objects and the map header are initialized once per pool slot, so creating
+// and removing a folder doesn't have to set them up and tear them down again.
+
+// An empty folder gets a vertex only once an operation needs one: creating
+// or moving a child into it, or opening it. Until then it is just a name in
+// the map of its parent, with the value COMPACT, so trees which are mostly
+// leaves take a fraction of the memory. Operations which only read it, like
+// list(), count() or walk(), take it as it is. Only a process holding writer
+// permission to the parent gives the folder its vertex (see inflate()), so
+// a snapshot holding reader permission to the parent sees an empty folder
+// which stays empty until it is done. A change which takes the last child
+// of a folder makes it compact again, unless it has handles (see
+// deflate_folder()).
+
+// Every vertex keeps the last listing of its children, tagged with the
+// version of the map it was made from. Changes of the map bump the version,
+// so list() of an unchanged folder only copies the cached string.
+
+// A tree may keep a cache of paths (see dcache.h), which lets operations
+// starting in the root skip the traversal. Every vertex has a generation,
+// bumped whenever the vertex gets detached from its parent (removed or
+// moved). A cached path is used only if all its vertices still have the
+// generations they had when it was cached. Such a process first enters all
+// the vertices and then checks the generations, while a remover bumps the
+// generation and then waits for processes in the vertex, so either it waits
+// for the process or the process sees the new generation and backs off.
+
+// A tree may spread the children of the root over shards (see TreeOptions).
+// A shard is a vertex of its own, which isn't a folder: it holds the children
+// whose names hash to it, and operations below such a child start in the
+// shard instead of the root, so operations in different shards never touch
+// the same lock or map. Like the root, shards are never moved or removed.
+// Processes locking many vertices lock shards in the order of their indices,
+// and vertices inside each shard in the order of paths.
+
+// State shared by all vertices of one tree.
+typedef struct {
+    NodePool *pool;
+    Tree *root;
+    // Shards holding the children of the root, or NULL if there are none.
+    Tree **shards;
+    size_t n_shards;
+    DCache *dcache; // NULL if paths aren't cached.
+    // Policy of the locks of all vertices.
+    RWLockPolicy lock_policy;
+    unsigned lock_reader_batch;
+    // Taken by snapshots, see tree_snapshot(). Protects `snapshots` and the
+    // `snapshot` nodes of vertices.
+    pthread_mutex_t snapshot_lock;
+    uint64_t snapshots; // Number of snapshots taken so far.
+    SnapNode *compact_snapshot; // Snapshot node of every compact folder.
+    // Journal recording changes, or NULL. It is read in the critical sections
+    // of changes and replaced only while every vertex is locked by a
+    // snapshot, so each change is recorded in exactly one journal.
+    Journal *journal;
+    TreeJournalOptions journal_options;
+    // Number of the next change while there is no journal.
+    uint64_t sequence;
+    // Serializes starting, stopping and replacing journals.
+    pthread_mutex_t journal_lock;
+} TreeShared;
 
 struct Tree {
-    HashMap *map;
-    pthread_mutex_t lock;
-    pthread_cond_t readers, writers;
-    // Condition used when operation need to clear entire subtree
-    // before starting its work. No other process can entry this subtree
-    // while someone waits on clear.
-    pthread_cond_t clear;
-
-    int rcount, wcount, rwait, wwait, change;
-    bool cwait;
+    HashMap map;
+    TreeShared *shared;
+    // Readers and writers protocol of this vertex.
+    RWLock lock;
+
+    // Odd while a writer may be changing the map.
+    unsigned seq;
+
+    // Number of unfinished processes which entered this vertex, and
+    // INFLIGHT_WAITER if someone waits for it to drop to zero.
+    uint32_t inflight;
+
+    // Number of folders below this vertex. Changes add to it on their way,
+    // before they leave the vertex, so it is exact for a vertex which nobody
+    // is in (e.g. one waited for by wait_quiescent()).
+    uint64_t descendants;
+
+    // Number of open handles to this vertex or vertices below it. Such
+    // a vertex can't be moved or removed.
+    uint32_t handles;
+
+    // Odd while the pool slot is free. Grows by two every time the vertex is
+    // detached from its parent, and by one when it is freed or reused.
+    uint32_t generation;
+
+    // Incremented by every change of the map.
+    uint64_t version;
+    // Listing of the map in some version, or NULL. Replaced by readers.
+    Listing *listing;
+
+    // Node made for this vertex by the last snapshot of it, or NULL.
+    SnapNode *snapshot;
+};
+
+
+#define INFLIGHT_WAITER (1u << 31)
+
+// Value in the map of a parent of a folder which has no vertex yet.
+#define COMPACT ((Tree *) 1)
+
+// Alignment of shards, the size of a cache line.
+#define SHARD_ALIGNMENT 64
+
+// Number of vertices a trail holds without allocating memory.
+#define TRAIL_INLINE 32
+
+// Vertices whose `inflight` counters a process has incremented: the first
+// TRAIL_INLINE in `vertices`, the rest in `more`, allocated for deep paths.
+typedef struct {
+    Tree *vertices[TRAIL_INLINE];
+    Tree **more;
+    size_t count;
+    size_t capacity; // Capacity of `more`.
+} Trail;
+
+
+// Returns child of `tree` with name `component` of path `path` or NULL if
+// there is no such child.
+static Tree *find_child(Tree *tree, const char *path,
+                        const PathComponent *component) {
+    return hmap_get_h(&tree->map, path + component->offset, component->length,
+                      component->hash);
+}
+
+
+// Makes cached listing of `tree` outdated. Writer permission should be held.
+static void bump_version(Tree *tree) {
+    __atomic_store_n(&tree->version, tree->version + 1, __ATOMIC_RELEASE);
+}
+
+
+static void add_child(Tree *tree, const char *path,
+                      const PathComponent *component, Tree *child) {
+    if (!hmap_insert_h(&tree->map, path + component->offset, component->length,
+                       component->hash, child))
+        fatal("Map insert failed.");
+    bump_version(tree);
+}
+
+
+static void drop_child(Tree *tree, const char *path,
+                       const PathComponent *component) {
+    hmap_remove_h(&tree->map, path + component->offset, component->length,
+                  component->hash);
+    bump_version(tree);
+}
+
+
+// Same as above, for i-th component of a parsed path.
+static Tree *get_child(Tree *tree, const ParsedPath *path, size_t i) {
+    return find_child(tree, path->path, &path->components[i]);
+}
+
+
+static void insert_child(Tree *tree, const ParsedPath *path, size_t i, Tree *child) {
+    add_child(tree, path->path, &path->components[i], child);
+}
+
+
+static void remove_child(Tree *tree, const ParsedPath *path, size_t i) {
+    drop_child(tree, path->path, &path->components[i]);
+}
+
+
+// Returns whether children of `tree` are kept in shards.
+static bool is_sharded_root(const Tree *tree) {
+    return tree->shared->shards && tree == tree->shared->root;
+}
+
+
+// Index of the shard holding the child of the root whose name has given hash.
+// Maps place keys by the low bits of their hashes, so shards use the high
+// ones.
+static size_t shard_index(const TreeShared *shared, uint64_t hash) {
+    return (hash >> 32) % shared->n_shards;
+}
+
+
+// Returns the vertex in whose map the first component of `path`, starting in
+// `tree`, is: its shard if `tree` is the sharded root, `tree` otherwise.
+static Tree *start_vertex(Tree *tree, const ParsedPath *path) {
+    TreeShared *shared = tree->shared;
+    if (path->count == 0 || !is_sharded_root(tree))
+        return tree;
+    return shared->shards[shard_index(shared, path->components[0].hash)];
+}
+
+
+// Returns child of `tree` with given name, looking in shards of the root.
+static Tree *child_by_name(Tree *tree, const char *name, size_t length) {
+    uint64_t hash = hmap_hash(name, length);
+    if (is_sharded_root(tree))
+        tree = tree->shared->shards[shard_index(tree->shared, hash)];
+    return hmap_get_h(&tree->map, name, length, hash);
+}
+
+
+// Returns whether a child found in a map is a folder without a vertex.
+static bool is_compact(const Tree *child) {
+    return child == COMPACT;
+}
+
+
+// Initializes a pool slot of a node.
+static void node_construct(void *object) {
+    Tree *tree = object;
+    hmap_init(&tree->map);
+    hmap_set_release(&tree->map, epoch_retire_free);
+    rwlock_init(&tree->lock);
+    tree->seq = 0;
+    tree->inflight = 0;
+    tree->descendants = 0;
+    tree->handles = 0;
+    tree->generation = 1;
+    tree->version = 0;
+    tree->listing = NULL;
+    tree->snapshot = NULL;
+}
+
+
+static void node_destruct(void *object) {
+    Tree *tree = object;
+    hmap_clear(&tree->map);
+    listing_unref(tree->listing);
+    snap_node_unref(tree->snapshot);
+}
+
+
+// Creates an empty folder belonging to the tree with state `shared`.
+// The generation grows from the previous use of the pool slot, so cached
+// paths to the previous folder stay invalid.
+static Tree *node_new(TreeShared *shared) {
+    Tree *tree = pool_alloc(shared->pool);
+    tree->shared = shared;
+    __atomic_fetch_add(&tree->generation, 1, __ATOMIC_RELEASE);
+    rwlock_set_policy(&tree->lock, shared->lock_policy, shared->lock_reader_batch);
+    return tree;
+}
+
+
+// Gives back a folder which no other process has seen at once.
+static void node_discard(Tree *tree) {
+    __atomic_fetch_add(&tree->generation, 1, __ATOMIC_RELAXED);
+    pool_free(tree->shared->pool, tree);
+}
+
+
+static void node_release(void *ctx, void *ptr) {
+    Tree *tree = ptr;
+    (void) ctx;
+    hmap_clear(&tree->map);
+    listing_unref(tree->listing);
+    tree->listing = NULL;
+    snap_node_unref(tree->snapshot);
+    tree->snapshot = NULL;
+    // Folders of removed subtrees are freed with their counts.
+    tree->descendants = 0;
+    pool_free(tree->shared->pool, tree);
+}
+
+
+// Gives back an empty folder, which no process uses, to its pool once
+// readers without locks can't see it anymore. The generation becomes odd
+// first, so walks which queued the folder see it is gone (see walk_lock()).
+static void node_free(Tree *tree) {
+    __atomic_fetch_add(&tree->generation, 1, __ATOMIC_RELEASE);
+    epoch_retire(node_release, NULL, tree);
+}
+
+
+static RWLockPolicy lock_policy(TreeLockPolicy policy) {
+    switch (policy) {
+        case TREE_LOCK_PREFER_READERS:
+            return RWLOCK_PREFER_READERS;
+        case TREE_LOCK_PREFER_WRITERS:
+            return RWLOCK_PREFER_WRITERS;
+        default:
+            return RWLOCK_PHASE_FAIR;
+    }
+}
+
+
+// Size of a shard, rounded up to whole cache lines.
+static size_t shard_size(void) {
+    return (sizeof(Tree) + SHARD_ALIGNMENT - 1) / SHARD_ALIGNMENT * SHARD_ALIGNMENT;
+}
+
+
+Tree *tree_new_with(const TreeOptions *options) {
+    TreeShared *shared = safe_malloc(sizeof(TreeShared));
+    shared->pool = pool_new(sizeof(Tree), node_construct, node_destruct);
+    shared->dcache = options && options->path_cache_entries > 0
+                     ? dcache_new(options->path_cache_entries) : NULL;
+    safe_mutex_init(&shared->snapshot_lock);
+    shared->snapshots = 0;
+    listing_ref(listing_empty());
+    shared->compact_snapshot = snap_node_new(listing_empty());
+    shared->journal = NULL;
+    shared->sequence = 0;
+    safe_mutex_init(&shared->journal_lock);
+    shared->lock_policy = options ? lock_policy(options->lock_policy)
+                          : RWLOCK_PHASE_FAIR;
+    shared->lock_reader_batch = options ? options->lock_reader_batch : 0;
+    shared->root = node_new(shared);
+    shared->shards = NULL;
+    shared->n_shards = 0;
+    if (options && options->root_shards > 1) {
+        // Shards don't come from the pool, so each of them has cache lines
+        // of its own.
+        size_t size = shard_size();
+        shared->n_shards = options->root_shards;
+        shared->shards = safe_malloc(shared->n_shards * sizeof(Tree *));
+        for (size_t i = 0; i < shared->n_shards; ++i) {
+            Tree *shard = aligned_alloc(SHARD_ALIGNMENT, size);
+            if (!shard)
+                fatal("Aligned alloc failed.");
+            node_construct(shard);
+            shard->shared = shared;
+            shard->generation = 0;
+            rwlock_set_policy(&shard->lock, shared->lock_policy,
+                              shared->lock_reader_batch);
+            shared->shards[i] = shard;
+        }
+    }
+    return shared->root;
+}
+
+
+// Creates new tree of folders with one empty folder "/".
+Tree *tree_new() {
+    return tree_new_with(NULL);
+}
+
+
+// Frees all memory used by given tree.
+void tree_free(Tree *tree) {
+    TreeShared *shared = tree->shared;
+    if (shared->journal)
+        journal_free(shared->journal);
+    // Removed subtrees may still be given back to the pool.
+    reclaim_wait();
+    // Removed folders waiting for readers still belong to the pool.
+    epoch_barrier();
+    // Maps of the remaining folders are released by node_destruct(), slab
+    // by slab, so the tree isn't traversed at all.
+    pool_destroy(shared->pool);
+    for (size_t i = 0; i < shared->n_shards; ++i) {
+        node_destruct(shared->shards[i]);
+        free(shared->shards[i]);
+    }
+    free(shared->shards);
+    snap_node_unref(shared->compact_snapshot);
+    if (shared->dcache)
+        dcache_free(shared->dcache);
+    safe_mutex_destroy(&shared->snapshot_lock);
+    safe_mutex_destroy(&shared->journal_lock);
+    free(shared);
+}
+
+
+// Marks that calling process entered `tree`. It has to be done before
+// leaving the parent, so anyone locking the parent can see this process.
+static void vertex_enter(Tree *tree) {
+    __atomic_fetch_add(&tree->inflight, 1, __ATOMIC_RELAXED);
+}
+
+
+// Returns the i-th vertex of `trail`.
+static Tree **trail_vertex(Trail *trail, size_t i) {
+    return i < TRAIL_INLINE ? &trail->vertices[i] : &trail->more[i - TRAIL_INLINE];
+}
+
+
+// Same as above, remembering `tree` in `trail`.
+static void trail_enter(Trail *trail, Tree *tree) {
+    vertex_enter(tree);
+    if (trail->count >= TRAIL_INLINE + trail->capacity) {
+        trail->capacity = trail->capacity ? 2 * trail->capacity : TRAIL_INLINE;
+        trail->more = realloc(trail->more, trail->capacity * sizeof(Tree *));
+        if (!trail->more)
+            fatal("Realloc failed.");
+    }
+    *trail_vertex(trail, trail->count++) = tree;
+}
+
+
+// Marks that calling process left `tree`, which it entered before.
+static void vertex_leave(Tree *tree) {
+    uint32_t left = __atomic_sub_fetch(&tree->inflight, 1, __ATOMIC_RELEASE);
+    if (left == INFLIGHT_WAITER)
+        safe_futex_wake(&tree->inflight, INT_MAX, FUTEX_BITSET_MATCH_ANY);
+}
+
+
+// Marks that calling process finished.
+static void trail_release(Trail *trail) {
+    for (size_t i = 0; i < trail->count; ++i)
+        vertex_leave(*trail_vertex(trail, i));
+    trail->count = 0;
+    free(trail->more);
+    trail->more = NULL;
+    trail->capacity = 0;
+}
+
+
+static void add_to_count(Tree *tree, int64_t delta) {
+    __atomic_fetch_add(&tree->descendants, (uint64_t) delta, __ATOMIC_RELAXED);
+}
+
+
+struct TreeHandle {
+    Tree *tree;
+    char *path; // Path of the folder, for the journal.
+    Tree *top; // The root, or the shard of the folder if it is below one.
+    size_t depth;
+    Tree *vertices[]; // Vertices on the path whose `handles` are counted.
 };
 
 
-// Creates new tree of folders with one empty folder "/".
-Tree *tree_new() {
-    Tree *tree = safe_malloc(sizeof(Tree));
+// Adds `delta` to the numbers of descendants of the ancestors of a changed
+// folder: `top`, the root or the shard the folder is in, vertices on the path
+// from there to the folder where the process started (listed by `handle`, if
+// it started from one), and vertices it entered on the way from there.
+// Vertices of a handle are pinned, so they keep their paths.
+static void add_descendants(Tree *top, const TreeHandle *handle,
+                            Trail *trail, int64_t delta) {
+    add_to_count(top, delta);
+    if (handle) {
+        for (size_t i = 0; i < handle->depth; ++i)
+            add_to_count(handle->vertices[i], delta);
+    }
+    for (size_t i = 0; i < trail->count; ++i)
+        add_to_count(*trail_vertex(trail, i), delta);
+}
+
+
+// Returns the vertex whose number of descendants a change of `path`, starting
+// in `tree` or in the folder of `handle`, adds to first (see add_descendants()).
+static Tree *top_vertex(Tree *tree, const TreeHandle *handle, const ParsedPath *path) {
+    return handle && handle->depth > 0 ? handle->top : start_vertex(tree, path);
+}
+
+
+// Same as add_descendants(), for vertices on `path` at depths from `first`
+// up to `last`, all of which the caller has locked. The vertex at depth 0 is
+// the top one.
+static void add_descendants_on_path(Tree *root, const ParsedPath *path,
+                                    size_t first, size_t last, int64_t delta) {
+    Tree *tree = start_vertex(root, path);
+    for (size_t depth = 0; depth <= last; ++depth) {
+        if (depth > 0)
+            tree = get_child(tree, path, depth - 1);
+        if (depth >= first)
+            add_to_count(tree, delta);
+    }
+}
+
+
+// Returns whether there are open handles to `tree` or vertices below it.
+// Caller has to hold writer permission to its parent, so no new handles
+// to the subtree can be opened.
+static bool is_pinned(Tree *tree) {
+    return __atomic_load_n(&tree->handles, __ATOMIC_ACQUIRE) > 0;
+}
+
+
+// Waits for finish of all ongoing processes in subtree of `tree`, which is
+// about to be detached from its parent, and makes cached paths through it
+// invalid. Caller has to hold writer permission to the parent, so no new
+// processes come, except ones using cached paths, which back off.
+static void wait_quiescent(Tree *tree) {
+    STATS_WAIT_BEGIN();
+    // Generations of vertices in use stay even.
+    __atomic_fetch_add(&tree->generation, 2, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t inflight = __atomic_load_n(&tree->inflight, __ATOMIC_ACQUIRE);
+    while (inflight & ~INFLIGHT_WAITER) {
+        if (!(inflight & INFLIGHT_WAITER)) {
+            if (!__atomic_compare_exchange_n(&tree->inflight, &inflight,
+                                             inflight | INFLIGHT_WAITER, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+                continue;
+            inflight |= INFLIGHT_WAITER;
+        }
+        safe_futex_wait(&tree->inflight, inflight, FUTEX_BITSET_MATCH_ANY);
+        inflight = __atomic_load_n(&tree->inflight, __ATOMIC_ACQUIRE);
+    }
+    // Processes backing off from a cached path may still come and go.
+    __atomic_fetch_and(&tree->inflight, ~INFLIGHT_WAITER, __ATOMIC_RELAXED);
+    STATS_WAIT_END(TREE_STATS_QUIESCE_WAIT);
+}
+
+
+void reader_entry_protocol(Tree *tree) {
+    STATS_ENTRY(TREE_STATS_READER_WAIT, rwlock_reader_try_entry(&tree->lock),
+                rwlock_reader_entry(&tree->lock, STATS_QUEUE));
+}
+
+
+void reader_exit_protocol(Tree *tree) {
+    rwlock_reader_exit(&tree->lock);
+}
+
+
+void writer_entry_protocol(Tree *tree) {
+    STATS_ENTRY(TREE_STATS_WRITER_WAIT, rwlock_writer_try_entry(&tree->lock),
+                rwlock_writer_entry(&tree->lock, STATS_QUEUE));
+    __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void writer_exit_protocol(Tree *tree) {
+    __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELEASE);
+    rwlock_writer_exit(&tree->lock);
+}
+
+
+// Gives a vertex to the i-th component of `path`, a compact child of `tree`.
+// Caller holds writer permission to `tree`, so the folder doesn't change
+// while a snapshot holding reader permission to `tree` copies it. The vertex
+// has no children, like the compact folder.
+static void inflate(Tree *tree, const ParsedPath *path, size_t i) {
+    const PathComponent *component = &path->components[i];
+    Tree *child = node_new(tree->shared);
+    if (!hmap_replace_h(&tree->map, path->path + component->offset,
+                        component->length, component->hash, COMPACT, child))
+        fatal("Inflate failed.");
+}
+
+
+// Returns the vertex of the i-th component of `path`, a child of `tree`, to
+// which caller holds reader permission, on the way to the first `depth`
+// components. Returns NULL if there is no such child, or if it is compact
+// and the path goes below it, as it has no children. To inflate the last
+// folder of the path the permission is released for a while and writer
+// permission is taken instead, so `tree` must be entered or be the root or
+// a shard, and caller must hold no other locks.
+static Tree *get_vertex(Tree *tree, const ParsedPath *path, size_t i, size_t depth) {
+    Tree *child = get_child(tree, path, i);
+    while (is_compact(child) && i + 1 == depth) {
+        reader_exit_protocol(tree);
+        writer_entry_protocol(tree);
+        child = get_child(tree, path, i);
+        if (is_compact(child))
+            inflate(tree, path, i);
+        writer_exit_protocol(tree);
+        // The folder may be removed and created again meanwhile.
+        reader_entry_protocol(tree);
+        child = get_child(tree, path, i);
+    }
+    return is_compact(child) ? NULL : child;
+}
+
+
+// Takes reader permission to all shards of the root, in order.
+static void lock_shards(TreeShared *shared) {
+    for (size_t i = 0; i < shared->n_shards; ++i)
+        reader_entry_protocol(shared->shards[i]);
+}
+
+
+static void unlock_shards(TreeShared *shared) {
+    for (size_t i = 0; i < shared->n_shards; ++i)
+        reader_exit_protocol(shared->shards[i]);
+}
+
+
+// Length of the first `depth` components of `path`, with slashes around.
+static size_t prefix_length(const ParsedPath *path, size_t depth) {
+    const PathComponent *last = &path->components[depth - 1];
+    return last->offset + last->length + 1;
+}
+
+
+// Returns whether the first `depth` components of `path`, starting in
+// `tree`, may be looked up in the path cache.
+static bool is_cacheable(Tree *tree, const ParsedPath *path, size_t depth) {
+    return tree->shared->dcache && tree == tree->shared->root
+           && depth > 0 && depth <= DCACHE_MAX_DEPTH
+           && prefix_length(path, depth) <= DCACHE_MAX_PATH;
+}
+
+
+// Hash of the first `depth` components of `path`, made of their hashes.
+static uint64_t prefix_hash(const ParsedPath *path, size_t depth) {
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; ++i) {
+        hash = (hash ^ path->components[i].hash) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+
+// Finds vertices on the first `depth` components of `path` in the path
+// cache, with their generations at the moment they were cached.
+static bool cache_lookup(Tree *tree, const ParsedPath *path, size_t depth,
+                         Tree **vertices, uint32_t *generations) {
+    if (!is_cacheable(tree, path, depth))
+        return false;
+    return dcache_lookup(tree->shared->dcache, path->path,
+                         prefix_length(path, depth), prefix_hash(path, depth),
+                         (void **) vertices, generations) == depth;
+}
+
+
+static void cache_insert(Tree *tree, const ParsedPath *path, size_t depth,
+                         Tree *const *vertices, const uint32_t *generations) {
+    dcache_insert(tree->shared->dcache, path->path, prefix_length(path, depth),
+                  prefix_hash(path, depth), (void *const *) vertices,
+                  generations, depth);
+}
+
+
+static bool generations_match(Tree *const *vertices, const uint32_t *generations,
+                              size_t depth) {
+    for (size_t i = 0; i < depth; ++i) {
+        if (__atomic_load_n(&vertices[i]->generation, __ATOMIC_ACQUIRE)
+            != generations[i])
+            return false;
+    }
+    return true;
+}
+
+
+// Enters `depth` vertices of a path found without locks, which had given
+// generations while they were on the path, and takes writer (or reader, if
+// not `writer`) permission to the last one, which becomes `*tree`. Vertices
+// are added to `trail`. Returns false, with nothing entered, if any of them
+// got detached meanwhile.
+static bool enter_path(Tree **tree, Tree *const *vertices,
+                       const uint32_t *generations, size_t depth, Trail *trail,
+                       bool writer) {
+    size_t first = trail->count;
+    for (size_t i = 0; i < depth; ++i)
+        trail_enter(trail, vertices[i]);
+    // Pairs with the fence in wait_quiescent().
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!generations_match(vertices, generations, depth)) {
+        for (size_t i = first; i < trail->count; ++i)
+            vertex_leave(*trail_vertex(trail, i));
+        trail->count = first;
+        return false;
+    }
+
+    // No vertex on the path can be detached before this process finishes.
+    *tree = vertices[depth - 1];
+    STATS_DEPTH(depth);
+    if (writer)
+        writer_entry_protocol(*tree);
+    else
+        reader_entry_protocol(*tree);
+    return true;
+}
+
+
+// Goes down the first `depth` components of `path` using the path cache,
+// like enter_path() does. Returns false if the path isn't cached or the entry
+// is stale.
+static bool find_node_cached(Tree **tree, const ParsedPath *path, size_t depth,
+                             Trail *trail, bool writer) {
+    Tree *vertices[DCACHE_MAX_DEPTH];
+    uint32_t generations[DCACHE_MAX_DEPTH];
+    return cache_lookup(*tree, path, depth, vertices, generations)
+           && enter_path(tree, vertices, generations, depth, trail, writer);
+}
+
+
+static void release_listing(void *ctx, void *ptr) {
+    (void) ctx;
+    listing_unref(ptr);
+}
+
+
+static Listing *get_listing(Tree *tree, bool *owned);
+
+
+// Makes a listing of the sharded root out of listings of its shards, all of
+// which the caller holds reader permission to.
+static Listing *merge_shards(TreeShared *shared, uint64_t version) {
+    Listing **parts = safe_malloc(shared->n_shards * sizeof(Listing *));
+    bool *owned = safe_malloc(shared->n_shards * sizeof(bool));
+    for (size_t i = 0; i < shared->n_shards; ++i)
+        parts[i] = get_listing(shared->shards[i], &owned[i]);
+    Listing *listing = listing_merge(parts, shared->n_shards, version);
+    for (size_t i = 0; i < shared->n_shards; ++i) {
+        if (owned[i])
+            free(parts[i]);
+    }
+    free(owned);
+    free(parts);
+    return listing;
+}
+
+
+// Returns listing of `tree`, the cached one if it is up to date. Otherwise
+// makes a new listing and tries to cache it; if that fails `*owned` is set
+// and the caller should free the result. Should be called in an epoch
+// critical section, by a process which either holds reader permission to
+// `tree` or checks its sequence number afterwards. For the sharded root,
+// reader permission to all shards has to be held; its version is the sum of
+// theirs, which changes whenever any of them does.
+static Listing *get_listing(Tree *tree, bool *owned) {
+    TreeShared *shared = tree->shared;
+    bool sharded = is_sharded_root(tree);
+    uint64_t version = 0;
+    if (sharded) {
+        for (size_t i = 0; i < shared->n_shards; ++i)
+            version += __atomic_load_n(&shared->shards[i]->version, __ATOMIC_ACQUIRE);
+    }
+    else {
+        version = __atomic_load_n(&tree->version, __ATOMIC_ACQUIRE);
+    }
+    Listing *listing = __atomic_load_n(&tree->listing, __ATOMIC_ACQUIRE);
+    *owned = false;
+    if (listing && listing->version == version)
+        return listing;
+
+    // A listing made while a writer works gets a version which never comes
+    // back, so caching it is harmless.
+    Listing *fresh = sharded ? merge_shards(shared, version)
+                             : listing_new(&tree->map, version);
+    if (__atomic_compare_exchange_n(&tree->listing, &listing, fresh, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (listing)
+            epoch_retire(release_listing, NULL, listing);
+    }
+    else {
+        *owned = true;
+    }
+    return fresh;
+}
+
+
+// Number of tries of list() without locks before it falls back to locking.
+#define OPTIMISTIC_TRIES 4
+
+// Deeper paths are always gone down with locks, so the vertices seen by
+// tries without locks fit in small arrays.
+#define OPTIMISTIC_MAX_DEPTH 64
+
+typedef struct {
+    Tree *tree;
+    unsigned seq;
+} SeenVertex;
+
+
+// Tries to find a listing of a folder, at most OPTIMISTIC_MAX_DEPTH deep,
+// without taking any locks and without writing to shared memory (except the
+// listing cache). Returns false if writers got in the way. Otherwise `*res`
+// is the listing, valid at the moment all vertices on the path were checked,
+// or NULL if there is no such folder. Should be called in an epoch critical
+// section.
+static bool try_listing_optimistic(Tree *tree, const ParsedPath *path,
+                                   Listing **res, bool *owned) {
+    SeenVertex seen[OPTIMISTIC_MAX_DEPTH + 1];
+    size_t n_seen = 0;
+    Tree *root = tree;
+    Tree *vertices[DCACHE_MAX_DEPTH];
+    uint32_t generations[DCACHE_MAX_DEPTH];
+    bool cacheable = is_cacheable(tree, path, path->count);
+    Listing *listing = NULL;
+    bool valid = true;
+    tree = start_vertex(tree, path);
+
+    *owned = false;
+    for (size_t i = 0;; ++i) {
+        unsigned seq = __atomic_load_n(&tree->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            valid = false;
+            break;
+        }
+        seen[n_seen].tree = tree;
+        seen[n_seen].seq = seq;
+        n_seen++;
+
+        if (i == path->count) {
+            listing = get_listing(tree, owned);
+            break;
+        }
+        tree = get_child(tree, path, i);
+        if (is_compact(tree)) {
+            // Nothing is below it, and it has no vertex to cache.
+            if (i + 1 == path->count)
+                listing = listing_empty();
+            cacheable = false;
+            break;
+        }
+        if (!tree)
+            break;
+        // The generation changes only while the parent's number is odd.
+        if (cacheable) {
+            vertices[i] = tree;
+            generations[i] = __atomic_load_n(&tree->generation, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (size_t i = 0; valid && i < n_seen; ++i) {
+        if (__atomic_load_n(&seen[i].tree->seq, __ATOMIC_RELAXED) != seen[i].seq)
+            valid = false;
+    }
+
+    if (!valid) {
+        if (*owned)
+            free(listing);
+        *owned = false;
+        return false;
+    }
+    if (cacheable && listing)
+        cache_insert(root, path, path->count, vertices, generations);
+    *res = listing;
+    return true;
+}
+
+
+// Tries to find a listing of a folder through the path cache, without taking
+// any locks. Should be called in an epoch critical section.
+static bool try_listing_cached(Tree *tree, const ParsedPath *path,
+                               Listing **res, bool *owned) {
+    Tree *vertices[DCACHE_MAX_DEPTH];
+    uint32_t generations[DCACHE_MAX_DEPTH];
+    if (!cache_lookup(tree, path, path->count, vertices, generations))
+        return false;
+
+    tree = vertices[path->count - 1];
+    unsigned seq = __atomic_load_n(&tree->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || !generations_match(vertices, generations, path->count))
+        return false;
+    Listing *listing = get_listing(tree, owned);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&tree->seq, __ATOMIC_RELAXED) != seq
+        || !generations_match(vertices, generations, path->count)) {
+        if (*owned)
+            free(listing);
+        *owned = false;
+        return false;
+    }
+    *res = listing;
+    return true;
+}
+
+
+// Finds a listing of given folder, or NULL if there is no such folder.
+// The listing is valid until the end of the epoch critical section which
+// the caller should be in. If `*owned` is set the caller should free it.
+static Listing *find_listing(Tree *tree, const ParsedPath *path, bool *owned) {
+    Listing *listing = NULL;
+    if (path->count == 0 && is_sharded_root(tree)) {
+        lock_shards(tree->shared);
+        listing = get_listing(tree, owned);
+        unlock_shards(tree->shared);
+        return listing;
+    }
+    if (try_listing_cached(tree, path, &listing, owned))
+        return listing;
+    for (int i = 0; path->count <= OPTIMISTIC_MAX_DEPTH && i < OPTIMISTIC_TRIES; ++i) {
+        if (try_listing_optimistic(tree, path, &listing, owned))
+            return listing;
+    }
+
+    Trail trail = { .count = 0 };
+    *owned = false;
+    tree = start_vertex(tree, path);
+    STATS_DEPTH(0);
+    reader_entry_protocol(tree);
+    for (size_t i = 0;; ++i) {
+        bool finished = false;
+        Tree *new_tree;
+        if (i < path->count) {
+            new_tree = get_child(tree, path, i);
+            if (is_compact(new_tree)) {
+                finished = true;
+                if (i + 1 == path->count)
+                    listing = listing_empty();
+            }
+            else if (!new_tree) {
+                finished = true;
+            }
+            else {
+                trail_enter(&trail, new_tree);
+                STATS_DEPTH(i + 1);
+                reader_entry_protocol(new_tree);
+            }
+        }
+        else {
+            finished = true;
+            listing = get_listing(tree, owned);
+        }
+
+        reader_exit_protocol(tree);
+
+        if (finished)
+            break;
+        else
+            tree = new_tree;
+    }
+    trail_release(&trail);
+    return listing;
+}
+
+
+// Prints content of given folder (only on first level, without recursion).
+char *tree_list(Tree *tree, const char *path_string) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return NULL;
+
+    STATS_OP_BEGIN();
+    bool owned;
+    epoch_enter();
+    Listing *listing = find_listing(tree, &path, &owned);
+    char *res = listing ? listing_string(listing) : NULL;
+    if (owned)
+        free(listing);
+    epoch_exit();
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_LIST);
+    return res;
+}
+
+
+char *tree_list_range(Tree *tree, const char *path_string,
+                      const char *after_name, size_t limit) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return NULL;
+
+    STATS_OP_BEGIN();
+    bool owned;
+    epoch_enter();
+    Listing *listing = find_listing(tree, &path, &owned);
+    char *res = NULL;
+    if (listing) {
+        size_t first = after_name
+                       ? listing_upper_bound(listing, after_name, strlen(after_name))
+                       : 0;
+        res = listing_range_string(listing, first, limit);
+    }
+    if (owned)
+        free(listing);
+    epoch_exit();
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_LIST);
+    return res;
+}
+
+
+int tree_list_into(Tree *tree, const char *path_string, char *buf, size_t cap,
+                   size_t *needed) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+
+    STATS_OP_BEGIN();
+    bool owned;
+    int err = 0;
+    epoch_enter();
+    Listing *listing = find_listing(tree, &path, &owned);
+    if (!listing) {
+        err = ENOENT;
+    }
+    else {
+        if (needed)
+            *needed = listing->length + 1;
+        if (listing->length + 1 <= cap)
+            memcpy(buf, listing->string, listing->length + 1);
+        else
+            err = ERANGE;
+    }
+    if (owned)
+        free(listing);
+    epoch_exit();
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_LIST);
+    return err;
+}
+
+
+int tree_list_foreach(Tree *tree, const char *path_string,
+                      int (*callback)(void *ctx, const char *name, size_t length),
+                      void *ctx) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+
+    STATS_OP_BEGIN();
+    bool owned;
+    int err = 0;
+    epoch_enter();
+    Listing *listing = find_listing(tree, &path, &owned);
+    // A cached listing is retired only after the critical section, so it
+    // can still be referenced, and `callback` runs outside of it.
+    if (listing && !owned)
+        listing_ref(listing);
+    epoch_exit();
+    if (!listing) {
+        err = ENOENT;
+    }
+    else {
+        for (size_t i = 0; err == 0 && i < listing->count; ++i) {
+            err = callback(ctx, listing->string + listing->starts[i],
+                           listing->starts[i + 1] - listing->starts[i] - 1);
+        }
+    }
+    if (owned)
+        free(listing);
+    else
+        listing_unref(listing);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_LIST);
+    return err;
+}
+
+
+// Goes down the first `depth` (1 to OPTIMISTIC_MAX_DEPTH) components of
+// `path` without any locks, checking sequence numbers of the vertices like
+// try_listing_optimistic() does, and then enters the vertices found and
+// locks only the last one (see enter_path()). Returns false if writers got
+// in the way, or with `*err` set to EAGAIN if the last vertex is compact and
+// `inflate`, as only a process holding the lock of its parent may inflate
+// it. Otherwise `*err` is the result of find_node_locked(); on ENOENT or for
+// a compact folder nothing is entered.
+static bool find_node_optimistic(Tree **tree, const ParsedPath *path, size_t depth,
+                                 Trail *trail, bool writer, bool inflate,
+                                 int *err) {
+    Tree *root = *tree;
+    Tree *vertices[OPTIMISTIC_MAX_DEPTH];
+    uint32_t generations[OPTIMISTIC_MAX_DEPTH];
+    unsigned seqs[OPTIMISTIC_MAX_DEPTH];
+    Tree *start = start_vertex(root, path), *vertex = start;
+    bool valid = true;
+    size_t i = 0;
+
+    epoch_enter();
+    for (; i < depth; ++i) {
+        seqs[i] = __atomic_load_n(&vertex->seq, __ATOMIC_ACQUIRE);
+        if (seqs[i] & 1) {
+            valid = false;
+            break;
+        }
+        vertex = get_child(vertex, path, i);
+        if (!vertex || is_compact(vertex))
+            break;
+        // The generation changes only while the parent's number is odd.
+        vertices[i] = vertex;
+        generations[i] = __atomic_load_n(&vertex->generation, __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    size_t n_seen = i < depth ? i + 1 : depth;
+    for (size_t j = 0; valid && j < n_seen; ++j) {
+        Tree *parent = j == 0 ? start : vertices[j - 1];
+        if (__atomic_load_n(&parent->seq, __ATOMIC_RELAXED) != seqs[j])
+            valid = false;
+    }
+    if (valid && i + 1 == depth && is_compact(vertex) && inflate) {
+        *err = EAGAIN;
+        valid = false;
+    }
+    else if (valid && i + 1 == depth && is_compact(vertex)) {
+        *tree = COMPACT;
+        *err = 0;
+    }
+    else if (valid && i < depth) {
+        *err = ENOENT;
+    }
+    else if (valid) {
+        valid = enter_path(tree, vertices, generations, depth, trail, writer);
+        if (valid && is_cacheable(root, path, depth))
+            cache_insert(root, path, depth, vertices, generations);
+        *err = 0;
+    }
+    epoch_exit();
+    return valid;
+}
+
+
+// Traverse tree via first `depth` components of given path. If it doesn't
+// encounter error holds writer (or reader, if not `writer`) entry permission
+// to last vertex on path. Entered vertices are added to `trail` in both cases.
+// If the last folder is compact and not `inflate`, `*tree` becomes COMPACT
+// instead, with nothing locked, so processes which only read it don't give
+// it a vertex.
+static int find_node_locked(Tree **tree, const ParsedPath *path, size_t depth,
+                            Trail *trail, bool writer, bool inflate) {
+    if (find_node_cached(tree, path, depth, trail, writer))
+        return 0;
+    int err = 0;
+    for (int i = 0; depth > 0 && depth <= OPTIMISTIC_MAX_DEPTH && err != EAGAIN
+                    && i < OPTIMISTIC_TRIES; ++i) {
+        if (find_node_optimistic(tree, path, depth, trail, writer, inflate, &err))
+            return err;
+    }
+
+    // Generations are read under the parent's lock, so they match the path.
+    Tree *root = *tree;
+    Tree *vertices[DCACHE_MAX_DEPTH];
+    uint32_t generations[DCACHE_MAX_DEPTH];
+    bool cacheable = is_cacheable(root, path, depth);
+    *tree = start_vertex(*tree, path);
+    STATS_DEPTH(0);
+    if (depth == 0 && writer)
+        writer_entry_protocol(*tree);
+    else
+        reader_entry_protocol(*tree);
+    for (size_t i = 0; i < depth; ++i) {
+        Tree *old_tree = *tree;
+        *tree = inflate ? get_vertex(*tree, path, i, depth)
+                        : get_child(*tree, path, i);
+        if (is_compact(*tree) && i + 1 == depth) {
+            reader_exit_protocol(old_tree);
+            return 0;
+        }
+        if (!(*tree) || is_compact(*tree)) {
+            reader_exit_protocol(old_tree);
+            return ENOENT;
+        }
+        trail_enter(trail, *tree);
+        if (cacheable) {
+            vertices[i] = *tree;
+            generations[i] = __atomic_load_n(&(*tree)->generation, __ATOMIC_RELAXED);
+        }
+        STATS_DEPTH(i + 1);
+        if (i + 1 == depth && writer)
+            writer_entry_protocol(*tree);
+        else
+            reader_entry_protocol(*tree);
+        reader_exit_protocol(old_tree);
+    }
+    if (cacheable)
+        cache_insert(root, path, depth, vertices, generations);
+    return 0;
+}
+
+
+int find_node(Tree **tree, const ParsedPath *path, size_t depth, Trail *trail) {
+    return find_node_locked(tree, path, depth, trail, true, true);
+}
+
+
+// Makes the folder of the first `depth` components of `path`, starting in
+// `tree`, compact again if it is empty and has no handles, after a change
+// emptied it. Other processes in it are waited for like by a remove, so the
+// caller must have left it and hold no locks. The folder keeps its name and
+// place, so its parent and the journal don't change.
+static void deflate_folder(Tree *tree, const ParsedPath *path, size_t depth) {
+    if (depth == 0)
+        return;
+    Trail trail = { .count = 0 };
+    if (find_node(&tree, path, depth - 1, &trail) == 0) {
+        Tree *child = get_child(tree, path, depth - 1);
+        if (child && !is_compact(child) && !is_pinned(child)) {
+            wait_quiescent(child);
+            // Nobody could get in since, but a process which was in could
+            // create a child.
+            const PathComponent *component = &path->components[depth - 1];
+            if (hmap_size(&child->map) == 0) {
+                if (!hmap_replace_h(&tree->map, path->path + component->offset,
+                                    component->length, component->hash, child,
+                                    COMPACT))
+                    fatal("Deflate failed.");
+                node_free(child);
+            }
+        }
+        writer_exit_protocol(tree);
+    }
+    trail_release(&trail);
+}
+
+
+// The number is kept up to date by changes, so nothing below the folder is
+// locked. Shards count the folders in them instead of the root.
+int tree_count(Tree *tree, const char *path_string, size_t *count) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+
+    STATS_OP_BEGIN();
+    Trail trail = { .count = 0 };
+    int err = find_node_locked(&tree, &path, path.count, &trail, false, false);
+    if (err == 0 && is_compact(tree)) {
+        *count = 0;
+    }
+    else if (err == 0) {
+        TreeShared *shared = tree->shared;
+        *count = 0;
+        if (is_sharded_root(tree)) {
+            for (size_t i = 0; i < shared->n_shards; ++i)
+                *count += __atomic_load_n(&shared->shards[i]->descendants, __ATOMIC_RELAXED);
+        }
+        else {
+            *count = __atomic_load_n(&tree->descendants, __ATOMIC_RELAXED);
+        }
+        reader_exit_protocol(tree);
+    }
+    trail_release(&trail);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_COUNT);
+    return err;
+}
+
+
+// Records a successful change in the journal of the tree, if it has one.
+// Called in the critical section of the change, so changes which depend on
+// each other are recorded in the order they happened.
+static void record_change(Tree *tree, JournalOp op, const char *prefix,
+                          const char *path, const char *target) {
+    Journal *journal = tree->shared->journal;
+    if (journal)
+        journal_record(journal, op, prefix, path, target);
+}
+
+
+// Creates subfolder `name` of `parent`, to which caller holds writer
+// permission.
+static int create_in(Tree *parent, const char *path, const PathComponent *name) {
+    if (find_child(parent, path, name))
+        return EEXIST;
+    add_child(parent, path, name, COMPACT);
+    return 0;
+}
+
+
+// Removes subfolder `name` of `parent` if it is empty. Caller holds writer
+// permission to `parent`.
+static int remove_in(Tree *parent, const char *path, const PathComponent *name) {
+    Tree *son = find_child(parent, path, name);
+    if (!son)
+        return ENOENT;
+    if (is_compact(son)) {
+        // Nobody can be inside it.
+        drop_child(parent, path, name);
+        return 0;
+    }
+    if (is_pinned(son))
+        return EBUSY;
+    wait_quiescent(son);
+    if (hmap_size(&son->map) != 0)
+        return ENOTEMPTY;
+    drop_child(parent, path, name);
+    node_free(son);
+    return 0;
+}
+
+
+// Creates new subfolder. If the path is relative to a handle, `tree` is its
+// folder (and `handle` is NULL for the root).
+static int create_from(Tree *tree, const TreeHandle *handle,
+                       const char *path_string) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+    if (path.count == 0)
+        return EEXIST;
+
+    STATS_OP_BEGIN();
+    Tree *top = top_vertex(tree, handle, &path);
+    size_t child = path.count - 1;
+    Trail trail = { .count = 0 };
+    int err = find_node(&tree, &path, child, &trail);
+    if (err == 0) {
+        err = create_in(tree, path.path, &path.components[child]);
+        if (err == 0) {
+            add_descendants(top, handle, &trail, 1);
+            record_change(tree, JOURNAL_CREATE, handle ? handle->path : NULL,
+                          path_string, NULL);
+        }
+        writer_exit_protocol(tree);
+    }
+
+    trail_release(&trail);
+    journal_wait_pending();
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_CREATE);
+    return err;
+}
+
+
+int tree_create(Tree *tree, const char *path) {
+    return create_from(tree, NULL, path);
+}
+
+
+// Removes folder if it is empty.
+static int remove_from(Tree *tree, const TreeHandle *handle,
+                       const char *path_string) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+    if (path.count == 0)
+        return EBUSY;
+
+    STATS_OP_BEGIN();
+    Tree *top = top_vertex(tree, handle, &path), *start = tree;
+    size_t child = path.count - 1;
+    Trail trail = { .count = 0 };
+    // A compact parent has no children to remove.
+    int err = find_node_locked(&tree, &path, child, &trail, true, false);
+    bool emptied = false;
+    if (err == 0 && is_compact(tree)) {
+        err = ENOENT;
+    }
+    else if (err == 0) {
+        err = remove_in(tree, path.path, &path.components[child]);
+        if (err == 0) {
+            add_descendants(top, handle, &trail, -1);
+            record_change(tree, JOURNAL_REMOVE, handle ? handle->path : NULL,
+                          path_string, NULL);
+            emptied = hmap_size(&tree->map) == 0;
+        }
+        writer_exit_protocol(tree);
+    }
+
+    trail_release(&trail);
+    journal_wait_pending();
+    if (emptied)
+        deflate_folder(start, &path, child);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_REMOVE);
+    return err;
+}
+
+
+int tree_remove(Tree *tree, const char *path) {
+    return remove_from(tree, NULL, path);
+}
+
+
+// Gives all folders of a detached subtree, which no process uses, back to
+// their pool. Runs on the reclamation thread.
+static void free_subtree(void *arg) {
+    size_t capacity = 64, count = 1;
+    Tree **stack = safe_malloc(capacity * sizeof(Tree *));
+    stack[0] = arg;
+    while (count > 0) {
+        Tree *tree = stack[--count];
+        const char *key;
+        void *value;
+        HashMapIterator it = hmap_iterator(&tree->map);
+        while (hmap_next(&tree->map, &it, &key, &value)) {
+            if (is_compact(value))
+                continue;
+            if (count == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(Tree *));
+                if (!stack)
+                    fatal("Realloc failed.");
+            }
+            stack[count++] = value;
+        }
+        node_free(tree);
+    }
+    free(stack);
+}
+
+
+// Returns a handle with room for vertices of a path of given depth, which
+// counts none of them yet.
+static TreeHandle *handle_new(size_t depth) {
+    TreeHandle *handle = safe_malloc(sizeof(TreeHandle) + depth * sizeof(Tree *));
+    handle->path = NULL;
+    handle->depth = 0;
+    return handle;
+}
+
+
+// Goes down the first `depth` components of `path`, starting in `tree`,
+// counting handles of vertices on the way in `handle`, and takes reader
+// permission to the last one, which becomes handle->tree. Counting handles
+// while the parent is locked works like entering, so any process which locks
+// the parent as a writer sees the handle. If the last folder is compact and
+// not `inflate`, handle->tree is COMPACT and no permission is held. Returns
+// false if there is no such folder; handles counted so far stay in `handle`.
+static bool open_path(Tree *tree, const ParsedPath *path, size_t depth,
+                      TreeHandle *handle, bool inflate) {
+    Trail trail = { .count = 0 };
+    if (depth > 0)
+        tree = start_vertex(tree, path);
+    handle->top = tree;
+    STATS_DEPTH(0);
+    reader_entry_protocol(tree);
+    for (size_t i = 0; i < depth; ++i) {
+        Tree *child = inflate ? get_vertex(tree, path, i, depth)
+                              : get_child(tree, path, i);
+        if (is_compact(child) && i + 1 == depth) {
+            reader_exit_protocol(tree);
+            trail_release(&trail);
+            handle->tree = COMPACT;
+            return true;
+        }
+        if (!child || is_compact(child)) {
+            reader_exit_protocol(tree);
+            trail_release(&trail);
+            return false;
+        }
+        trail_enter(&trail, child);
+        __atomic_fetch_add(&child->handles, 1, __ATOMIC_RELAXED);
+        handle->vertices[handle->depth++] = child;
+        STATS_DEPTH(i + 1);
+        reader_entry_protocol(child);
+        reader_exit_protocol(tree);
+        tree = child;
+    }
+    trail_release(&trail);
+    handle->tree = tree;
+    return true;
+}
+
+
+TreeHandle *tree_open(Tree *tree, const char *path_string) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return NULL;
+
+    STATS_OP_BEGIN();
+    TreeHandle *handle = handle_new(path.count);
+    if (!open_path(tree, &path, path.count, handle, true)) {
+        tree_close(handle);
+        path_release(&path);
+        STATS_OP_END(TREE_STATS_OPEN);
+        return NULL;
+    }
+    reader_exit_protocol(handle->tree);
+
+    size_t length = strlen(path_string);
+    handle->path = safe_malloc(length + 1);
+    memcpy(handle->path, path_string, length + 1);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_OPEN);
+    return handle;
+}
+
+
+void tree_close(TreeHandle *handle) {
+    for (size_t i = 0; i < handle->depth; ++i)
+        __atomic_fetch_sub(&handle->vertices[i]->handles, 1, __ATOMIC_RELEASE);
+    free(handle->path);
+    free(handle);
+}
+
+
+// Operations relative to a handle start in its folder, which can't be moved
+// or removed, instead of the root.
+char *tree_list_at(TreeHandle *handle, const char *path) {
+    return tree_list(handle->tree, path);
+}
+
+
+int tree_create_at(TreeHandle *handle, const char *path) {
+    return create_from(handle->tree, handle, path);
+}
+
+
+int tree_remove_at(TreeHandle *handle, const char *path) {
+    return remove_from(handle->tree, handle, path);
+}
 
-    tree->map = hmap_new();
-    if (!tree->map)
-        fatal("Map initialization failed.");
-    tree->rcount = tree->wcount = 0;
-    tree->rwait = tree->wwait = 0;
-    tree->change = 0;
-    tree->cwait = false;
 
-    safe_mutex_init(&tree->lock);
-    safe_cond_init(&tree->readers);
-    safe_cond_init(&tree->writers);
-    safe_cond_init(&tree->clear);
+// Removes folder with all its content.
+int tree_remove_recursive(Tree *tree, const char *path_string) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+    if (path.count == 0)
+        return EBUSY;
 
-    return tree;
+    STATS_OP_BEGIN();
+    Tree *top = start_vertex(tree, &path), *start = tree;
+    size_t child = path.count - 1;
+    Trail trail = { .count = 0 };
+    int err = find_node_locked(&tree, &path, child, &trail, true, false);
+    Tree *son = NULL;
+    bool emptied = false;
+    if (err == 0 && is_compact(tree)) {
+        err = ENOENT;
+    }
+    else if (err == 0) {
+        son = get_child(tree, &path, child);
+        if (!son) {
+            err = ENOENT;
+        }
+        else if (!is_compact(son) && is_pinned(son)) {
+            err = EBUSY;
+            son = NULL;
+        }
+        else {
+            int64_t removed = 1;
+            if (is_compact(son)) {
+                son = NULL;
+            }
+            else {
+                wait_quiescent(son);
+                removed += __atomic_load_n(&son->descendants, __ATOMIC_RELAXED);
+            }
+            remove_child(tree, &path, child);
+            add_descendants(top, NULL, &trail, -removed);
+            record_change(tree, JOURNAL_REMOVE_RECURSIVE, NULL, path_string, NULL);
+            emptied = hmap_size(&tree->map) == 0;
+        }
+        writer_exit_protocol(tree);
+    }
+    trail_release(&trail);
+    journal_wait_pending();
+
+    if (son)
+        reclaim_defer(free_subtree, son);
+    if (emptied)
+        deflate_folder(start, &path, child);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_REMOVE_RECURSIVE);
+    return err;
 }
 
 
-// Frees all memory used by given tree.
-void tree_free(Tree *tree) {
-    const char *key;
-    void *value;
-    HashMapIterator it = hmap_iterator(tree->map);
-    while (hmap_next(tree->map, &it, &key, &value)) {
-        tree_free(value);
+// A folder waiting for a visit by tree_walk().
+typedef struct {
+    Tree *tree;
+    uint32_t generation; // Generation of `tree` when it was queued.
+    char *path;
+    size_t depth;
+} WalkEntry;
+
+// Entries are taken from the back in depth-first order, and from the front
+// in breadth-first order.
+typedef struct {
+    WalkEntry *entries;
+    size_t begin, end, capacity;
+} WalkQueue;
+
+
+// Queues `tree`, to whose parent the caller holds reader permission, so it
+// has the generation of the folder with given path.
+static void walk_push(WalkQueue *queue, Tree *tree, char *path, size_t depth) {
+    if (queue->end == queue->capacity) {
+        // Reuse the space of entries already taken from the front.
+        if (queue->begin > 0) {
+            queue->end -= queue->begin;
+            memmove(queue->entries, queue->entries + queue->begin,
+                    queue->end * sizeof(WalkEntry));
+            queue->begin = 0;
+        }
+        if (queue->end == queue->capacity) {
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+            queue->entries = realloc(queue->entries,
+                                     queue->capacity * sizeof(WalkEntry));
+            if (!queue->entries)
+                fatal("Realloc failed.");
+        }
     }
+    uint32_t generation = is_compact(tree)
+                          ? 0 : __atomic_load_n(&tree->generation, __ATOMIC_RELAXED);
+    queue->entries[queue->end++] = (WalkEntry) { tree, generation, path, depth };
+}
 
-    hmap_free(tree->map);
-    safe_cond_destroy(&tree->readers);
-    safe_cond_destroy(&tree->writers);
-    safe_cond_destroy(&tree->clear);
-    safe_mutex_destroy(&tree->lock);
 
-    free(tree);
+// Takes reader permission to a queued folder, in an epoch critical section
+// entered after it was queued. Returns false, taking nothing, if the folder
+// got moved or freed since, or already was being freed then (its generation
+// was odd), as its pool slot may be reused. If the generation is still the
+// same even number, the vertex can't be given back to the pool before the
+// critical section ends.
+static bool walk_lock(const WalkEntry *entry) {
+    uint32_t generation = __atomic_load_n(&entry->tree->generation, __ATOMIC_ACQUIRE);
+    if ((generation & 1) || generation != entry->generation)
+        return false;
+    reader_entry_protocol(entry->tree);
+    return true;
 }
 
 
-void reader_entry_protocol(Tree *tree) {
-    safe_lock(&tree->lock);
-    while ((tree->wcount > 0 || tree->wwait > 0) && tree->change <= 0) {
-        tree->rwait++;
-        safe_wait(&tree->readers, &tree->lock);
-        tree->rwait--;
-    }
+// Returns a new string with the path of child `name` of folder `path`.
+static char *child_path(const char *path, size_t path_length, const char *name,
+                        size_t length) {
+    char *res = safe_malloc(path_length + length + 2);
+    memcpy(res, path, path_length);
+    memcpy(res + path_length, name, length);
+    res[path_length + length] = '/';
+    res[path_length + length + 1] = '\0';
+    return res;
+}
 
-    tree->rcount++;
-    if (tree->change > 0) {
-        tree->change--;
-        if (tree->change > 0)
-            safe_signal(&tree->readers);
+
+// Queues all children of `entry`, to which the caller holds reader
+// permission. In depth-first order they are pushed in reverse, so they are
+// taken in sorted order.
+static void walk_expand(WalkQueue *queue, const WalkEntry *entry, bool depth_first) {
+    bool owned;
+    bool sharded = is_sharded_root(entry->tree);
+    if (sharded)
+        lock_shards(entry->tree->shared);
+    size_t path_length = strlen(entry->path);
+    Listing *listing = get_listing(entry->tree, &owned);
+    for (size_t k = 0; k < listing->count; ++k) {
+        size_t i = depth_first ? listing->count - 1 - k : k;
+        const char *name = listing->string + listing->starts[i];
+        size_t length = listing->starts[i + 1] - listing->starts[i] - 1;
+        Tree *child = child_by_name(entry->tree, name, length);
+        walk_push(queue, child, child_path(entry->path, path_length, name, length),
+                  entry->depth + 1);
     }
-    safe_unlock(&tree->lock);
+    if (owned)
+        free(listing);
+    if (sharded)
+        unlock_shards(entry->tree->shared);
 }
 
 
-void reader_exit_protocol(Tree *tree) {
-    safe_lock(&tree->lock);
-    tree->rcount--;
-    if (tree->rcount == 0 && tree->wwait > 0) {
-        tree->change = -1;
-        safe_signal(&tree->writers);
+int tree_walk(Tree *tree, const char *path_string, TreeWalkOrder order,
+              int (*visit)(void *ctx, const char *path, size_t depth),
+              void *ctx) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+    bool depth_first = order == TREE_WALK_DEPTH_FIRST;
+
+    STATS_OP_BEGIN();
+    // The walked folder is pinned like by a handle, so it can't be moved or
+    // removed meanwhile, but no vertex stays entered, so `visit` may change
+    // the tree and processes moving or removing an ancestor fail with EBUSY
+    // instead of waiting for the walk. The walk can't stay in all folders
+    // below it (that could deadlock with move()), so they may be moved or
+    // removed during the walk. Each one is expanded in an epoch critical
+    // section of its own, so `visit` runs outside of them. A compact folder
+    // is only visited.
+    TreeHandle *handle = handle_new(path.count);
+    if (!open_path(tree, &path, path.count, handle, false)) {
+        tree_close(handle);
+        path_release(&path);
+        STATS_OP_END(TREE_STATS_WALK);
+        return ENOENT;
+    }
+
+    int err = 0;
+    WalkQueue queue = { .entries = NULL, .begin = 0, .end = 0, .capacity = 0 };
+    WalkEntry entry = { handle->tree, 0, safe_malloc(strlen(path_string) + 1), 0 };
+    strcpy(entry.path, path_string);
+    bool first = true; // Reader permission to the first folder is held.
+    while (true) {
+        bool found = true;
+        // Compact folders have no children to queue.
+        if (err == 0 && !is_compact(entry.tree)) {
+            epoch_enter();
+            if (!first) {
+                STATS_DEPTH(path.count + entry.depth);
+                found = walk_lock(&entry);
+            }
+            if (found) {
+                walk_expand(&queue, &entry, depth_first);
+                reader_exit_protocol(entry.tree);
+            }
+            epoch_exit();
+        }
+        first = false;
+        if (err == 0 && found)
+            err = visit(ctx, entry.path, entry.depth);
+        free(entry.path);
+
+        if (queue.begin == queue.end)
+            break;
+        entry = depth_first ? queue.entries[--queue.end]
+                            : queue.entries[queue.begin++];
     }
-    else if (tree->cwait) {
-        safe_signal(&tree->clear);
+
+    free(queue.entries);
+    tree_close(handle);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_WALK);
+    return err;
+}
+
+
+static bool is_wildcard(char c) {
+    return c == '*' || c == '?';
+}
+
+
+static bool has_wildcards(const char *name, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (is_wildcard(name[i]))
+            return true;
     }
-    safe_unlock(&tree->lock);
+    return false;
 }
 
 
-void writer_entry_protocol(Tree *tree) {
-    safe_lock(&tree->lock);
-    while (tree->rcount > 0 || tree->wcount > 0 || tree->change > 0) {
-        tree->wwait++;
-        safe_wait(&tree->writers, &tree->lock);
-        tree->wwait--;
+// Returns whether `name` matches one component of a glob pattern. After
+// a mismatch the last '*' takes one more character and matching resumes.
+static bool glob_match(const char *pattern, size_t pattern_length,
+                       const char *name, size_t length) {
+    size_t p = 0, n = 0, star = SIZE_MAX, resume = 0;
+    while (n < length) {
+        if (p < pattern_length && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        }
+        else if (p < pattern_length && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        }
+        else if (star != SIZE_MAX) {
+            p = star + 1;
+            n = ++resume;
+        }
+        else {
+            return false;
+        }
     }
-    tree->wcount++;
-    tree->change = 0;
-    safe_unlock(&tree->lock);
+    while (p < pattern_length && pattern[p] == '*')
+        p++;
+    return p == pattern_length;
 }
 
 
-void writer_exit_protocol(Tree *tree) {
-    safe_lock(&tree->lock);
-    tree->wcount--;
-    if (tree->rwait > 0) {
-        tree->change = tree->rwait;
-        safe_signal(&tree->readers);
+// Queues the children of `entry`, to which the caller holds reader
+// permission, matching the next component of `pattern`, in reverse order
+// (like walk_expand() in depth-first order). Names starting with the part of
+// the component before its first wildcard are next to each other in the
+// listing, so only they are matched.
+static void glob_expand(WalkQueue *queue, const WalkEntry *entry,
+                        const ParsedPath *pattern) {
+    const char *component = path_component_name(pattern, entry->depth);
+    size_t component_length = pattern->components[entry->depth].length;
+    size_t path_length = strlen(entry->path);
+    if (!has_wildcards(component, component_length)) {
+        Tree *child = child_by_name(entry->tree, component, component_length);
+        if (child)
+            walk_push(queue, child, child_path(entry->path, path_length, component,
+                                               component_length),
+                      entry->depth + 1);
+        return;
     }
-    else if (tree->wwait > 0) {
-        tree->change = -1;
-        safe_signal(&tree->writers);
+
+    bool owned;
+    bool sharded = is_sharded_root(entry->tree);
+    if (sharded)
+        lock_shards(entry->tree->shared);
+    Listing *listing = get_listing(entry->tree, &owned);
+    size_t fixed = 0;
+    while (!is_wildcard(component[fixed]))
+        fixed++;
+    size_t begin = 0, end = listing->count;
+    if (fixed > 0) {
+        begin = listing_upper_bound(listing, component, fixed);
+        if (begin > 0 && listing->starts[begin] - listing->starts[begin - 1] - 1 == fixed
+            && memcmp(listing->string + listing->starts[begin - 1], component,
+                      fixed) == 0)
+            begin--;
+        end = begin;
+        while (end < listing->count
+               && listing->starts[end + 1] - listing->starts[end] - 1 >= fixed
+               && memcmp(listing->string + listing->starts[end], component,
+                         fixed) == 0)
+            end++;
     }
-    else if (tree->cwait) {
-        safe_signal(&tree->clear);
+    for (size_t i = end; i-- > begin;) {
+        const char *name = listing->string + listing->starts[i];
+        size_t length = listing->starts[i + 1] - listing->starts[i] - 1;
+        if (!glob_match(component, component_length, name, length))
+            continue;
+        Tree *child = child_by_name(entry->tree, name, length);
+        walk_push(queue, child, child_path(entry->path, path_length, name, length),
+                  entry->depth + 1);
     }
-    safe_unlock(&tree->lock);
+    if (owned)
+        free(listing);
+    if (sharded)
+        unlock_shards(entry->tree->shared);
 }
 
 
-// Prints content of given folder (only on first level, without recursion).
-char *tree_list(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return NULL;
+// Goes down the components before the first wildcard like tree_walk() goes
+// to its folder, and then walks only through matching folders, in the same
+// way.
+int tree_glob(Tree *tree, const char *pattern,
+              int (*match)(void *ctx, const char *path), void *ctx) {
+    // With wildcards replaced by letters the pattern is a valid path, with
+    // components at the same offsets.
+    size_t pattern_length = strnlen(pattern, MAX_PATH_LENGTH + 1);
+    if (pattern_length > MAX_PATH_LENGTH)
+        return EINVAL;
+    char letters[MAX_PATH_LENGTH + 1];
+    for (size_t i = 0; i <= pattern_length; ++i)
+        letters[i] = is_wildcard(pattern[i]) ? 'a' : pattern[i];
+    ParsedPath path;
+    if (!parse_path(letters, &path))
+        return EINVAL;
+    path.path = pattern;
+    size_t fixed = 0;
+    while (fixed < path.count
+           && !has_wildcards(path_component_name(&path, fixed),
+                             path.components[fixed].length))
+        fixed++;
+
+    STATS_OP_BEGIN();
+    // The folder of the part without wildcards is pinned like the folder of
+    // a walk, so `match` may change the tree.
+    TreeHandle *handle = handle_new(fixed);
+    if (!open_path(tree, &path, fixed, handle, false)) {
+        tree_close(handle);
+        path_release(&path);
+        STATS_OP_END(TREE_STATS_GLOB);
+        return 0;
+    }
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char *res = NULL;
-    reader_entry_protocol(tree);
+    WalkQueue queue = { .entries = NULL, .begin = 0, .end = 0, .capacity = 0 };
+    size_t prefix_length = fixed == 0 ? 1 : path.components[fixed - 1].offset
+                                            + path.components[fixed - 1].length + 1;
+    WalkEntry entry = { handle->tree, 0, safe_malloc(prefix_length + 1), fixed };
+    memcpy(entry.path, pattern, prefix_length);
+    entry.path[prefix_length] = '\0';
+    int err = 0;
+    bool first = true; // Reader permission to the first folder is held.
     while (true) {
-        path = split_path(path, component);
-
-        bool finished = false;
-        Tree *new_tree;
-        if (path) {
-            new_tree = hmap_get(tree->map, component);
-            if (!new_tree)
-                finished = true;
-            else
-                reader_entry_protocol(new_tree);
+        if (err == 0 && entry.depth == path.count) {
+            if (first && !is_compact(entry.tree))
+                reader_exit_protocol(entry.tree);
+            err = match(ctx, entry.path);
         }
-        else {
-            finished = true;
-            res = make_map_contents_string(tree->map);
+        else if (err == 0 && !is_compact(entry.tree)) {
+            // Compact folders have no children to match. Like in tree_walk(),
+            // every folder is expanded in an epoch critical section of its
+            // own, and folders moved or removed since they were queued are
+            // skipped.
+            epoch_enter();
+            bool found = true;
+            if (!first) {
+                STATS_DEPTH(entry.depth);
+                found = walk_lock(&entry);
+            }
+            if (found) {
+                glob_expand(&queue, &entry, &path);
+                reader_exit_protocol(entry.tree);
+            }
+            epoch_exit();
         }
+        first = false;
+        free(entry.path);
 
-        reader_exit_protocol(tree);
-
-        if (finished)
+        if (queue.begin == queue.end)
             break;
-        else
-            tree = new_tree;
+        entry = queue.entries[--queue.end];
     }
-    return res;
+
+    free(queue.entries);
+    tree_close(handle);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_GLOB);
+    return err;
 }
 
 
-// Traverse tree via given path. If it doesn't encounter error holds writer
-// entry permission to last vertex on path.
-int find_node(Tree **tree, const char *path, size_t to_grandparent) {
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    if (to_grandparent == 0)
-        writer_entry_protocol(*tree);
-    else
-        reader_entry_protocol(*tree);
-    while (true) {
-        path = split_path(path, component);
-        if (!path)
-            break;
-        Tree *old_tree = *tree;
-        *tree = hmap_get((*tree)->map, component);
-        if (!(*tree)) {
-            reader_exit_protocol(old_tree);
-            return ENOENT;
+// Goes through vertices like free_subtree() does, locking one at a time, and
+// like the folders of a walk, each in an epoch critical section of its own.
+// The root and shards, queued with depth 0, are never freed before the tree.
+// Shards are vertices, but not folders.
+void tree_memory(Tree *tree, TreeMemory *memory) {
+    TreeShared *shared = tree->shared;
+    memset(memory, 0, sizeof(TreeMemory));
+    memory->folders = 1;
+    memory->node_bytes = pool_memory(shared->pool) + shared->n_shards * shard_size();
+
+    WalkQueue queue = { .entries = NULL, .begin = 0, .end = 0, .capacity = 0 };
+    walk_push(&queue, shared->root, NULL, 0);
+    for (size_t i = 0; i < shared->n_shards; ++i)
+        walk_push(&queue, shared->shards[i], NULL, 0);
+    while (queue.end > 0) {
+        WalkEntry entry = queue.entries[--queue.end];
+        Tree *vertex = entry.tree;
+        epoch_enter();
+        if (entry.depth == 0)
+            reader_entry_protocol(vertex);
+        else if (!walk_lock(&entry)) {
+            epoch_exit();
+            continue;
         }
-        to_grandparent--;
-        if (to_grandparent == 0)
-            writer_entry_protocol(*tree);
-        else
-            reader_entry_protocol(*tree);
-        reader_exit_protocol(old_tree);
+        memory->map_bytes += hmap_memory(&vertex->map);
+        Listing *listing = __atomic_load_n(&vertex->listing, __ATOMIC_ACQUIRE);
+        if (listing)
+            memory->listing_bytes += listing_size(listing);
+        const char *key;
+        void *value;
+        HashMapIterator it = hmap_iterator(&vertex->map);
+        while (hmap_next(&vertex->map, &it, &key, &value)) {
+            memory->folders++;
+            if (is_compact(value))
+                memory->compact_folders++;
+            else
+                walk_push(&queue, value, NULL, 1);
+        }
+        reader_exit_protocol(vertex);
+        epoch_exit();
     }
-    return 0;
+    free(queue.entries);
+    memory->total_bytes = memory->node_bytes + memory->map_bytes
+                          + memory->listing_bytes;
 }
 
 
-// Creates new subfolder.
-int tree_create(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return EINVAL;
-    if (is_root(path))
-        return EEXIST;
+// Vertices locked by a snapshot.
+typedef struct {
+    Tree **vertices;
+    size_t count, capacity;
+} LockedSet;
 
-    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *parent_path = make_path_to_parent(path, child_name);
-    path = parent_path;
 
-    int err = find_node(&tree, path, count_slashes(parent_path) - 1);
-    if (err != 0) {
-        free(parent_path);
-        return err;
+// Takes reader permission to `tree` and adds it to `locked`.
+static void lock_for_snapshot(Tree *tree, LockedSet *locked) {
+    reader_entry_protocol(tree);
+    if (locked->count == locked->capacity) {
+        locked->capacity = locked->capacity ? locked->capacity * 2 : 64;
+        locked->vertices = realloc(locked->vertices,
+                                   locked->capacity * sizeof(Tree *));
+        if (!locked->vertices)
+            fatal("Realloc failed.");
     }
+    locked->vertices[locked->count++] = tree;
+}
 
-    if (hmap_get(tree->map, child_name)) {
-        err = EEXIST;
-    }
-    else {
-        Tree *son = tree_new();
-        hmap_insert(tree->map, child_name, son);
-    }
 
-    writer_exit_protocol(tree);
+static SnapNode *capture(Tree *tree, LockedSet *locked);
 
-    free(parent_path);
-    return err;
+
+// Locks and captures a child of `tree`, which is being captured. All compact
+// folders share one node, which the tree keeps.
+static SnapNode *capture_child(Tree *tree, Tree *child, LockedSet *locked) {
+    if (is_compact(child))
+        return tree->shared->compact_snapshot;
+    lock_for_snapshot(child, locked);
+    return capture(child, locked);
 }
 
 
-// Removes folder if it is empty.
-int tree_remove(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return EINVAL;
-    if (is_root(path))
-        return EBUSY;
+// Makes `node`, with given listing and children, the snapshot node of `tree`,
+// unless the previous one has the same content, and returns the one kept.
+// Takes the reference to the listing.
+static SnapNode *keep_snapshot(Tree *tree, Listing *listing, SnapNode *node) {
+    SnapNode *old = tree->snapshot;
+    bool same = old && old->listing == listing;
+    for (size_t i = 0; same && i < listing->count; ++i)
+        same = old->children[i] == node->children[i];
+    if (same) {
+        // Children aren't referenced by `node` yet.
+        listing_unref(listing);
+        free(node);
+        return old;
+    }
+    for (size_t i = 0; i < listing->count; ++i)
+        snap_node_ref(node->children[i]);
+    tree->snapshot = node;
+    snap_node_unref(old);
+    return node;
+}
 
-    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *parent_path = make_path_to_parent(path, child_name);
-    path = parent_path;
 
-    int err = find_node(&tree, path, count_slashes(parent_path) - 1);
-    if (err != 0) {
-        free(parent_path);
-        return err;
+// Same as capture(), for the sharded root. Shards are locked one by one, each
+// followed by everything in it, like moves lock them. The listing of the
+// root is made once all of them are locked.
+static SnapNode *capture_shards(Tree *tree, LockedSet *locked) {
+    TreeShared *shared = tree->shared;
+    Listing **parts = safe_malloc(shared->n_shards * sizeof(Listing *));
+    bool *owned = safe_malloc(shared->n_shards * sizeof(bool));
+    SnapNode ***children = safe_malloc(shared->n_shards * sizeof(SnapNode **));
+    for (size_t k = 0; k < shared->n_shards; ++k) {
+        Tree *shard = shared->shards[k];
+        lock_for_snapshot(shard, locked);
+        Listing *part = parts[k] = get_listing(shard, &owned[k]);
+        children[k] = safe_malloc(part->count * sizeof(SnapNode *) + 1);
+        for (size_t j = 0; j < part->count; ++j) {
+            const char *name = part->string + part->starts[j];
+            size_t length = part->starts[j + 1] - part->starts[j] - 1;
+            Tree *child = hmap_get_h(&shard->map, name, length, hmap_hash(name, length));
+            children[k][j] = capture_child(shard, child, locked);
+        }
     }
 
-    Tree *son = hmap_get(tree->map, child_name);
-    bool son_destroy = false;
-    if (!son) {
-        err = ENOENT;
+    bool listing_owned;
+    Listing *listing = get_listing(tree, &listing_owned);
+    if (!listing_owned)
+        listing_ref(listing);
+    SnapNode *node = snap_node_new(listing);
+    for (size_t k = 0; k < shared->n_shards; ++k) {
+        Listing *part = parts[k];
+        for (size_t j = 0; j < part->count; ++j) {
+            const char *name = part->string + part->starts[j];
+            size_t length = part->starts[j + 1] - part->starts[j] - 1;
+            node->children[listing_upper_bound(listing, name, length) - 1] = children[k][j];
+        }
+        if (owned[k])
+            free(part);
+        free(children[k]);
     }
-    else {
-        safe_lock(&son->lock);
-        while (son->rcount > 0 || son->wcount > 0 || son->rwait > 0
-        || son->wwait > 0) {
-            son->cwait = true;
-            safe_wait(&son->clear, &son->lock);
-            son->cwait = false;
-        }
-        if (hmap_size(son->map) != 0)
-            err = ENOTEMPTY;
-        else
-            son_destroy = true;
-        safe_unlock(&son->lock);
+    free(children);
+    free(owned);
+    free(parts);
+    return keep_snapshot(tree, listing, node);
+}
+
+
+// Returns a snapshot node of `tree` and everything below it, reusing the
+// nodes made by earlier snapshots of folders which didn't change. The caller
+// holds reader permission to `tree`; vertices below it are locked as readers
+// and added to `locked`, so none of them changes until they are released.
+// The result is referenced by `tree`.
+static SnapNode *capture(Tree *tree, LockedSet *locked) {
+    if (is_sharded_root(tree))
+        return capture_shards(tree, locked);
+
+    bool owned;
+    Listing *listing = get_listing(tree, &owned);
+    if (!owned)
+        listing_ref(listing);
+
+    SnapNode *node = snap_node_new(listing);
+    for (size_t i = 0; i < listing->count; ++i) {
+        const char *name = listing->string + listing->starts[i];
+        size_t length = listing->starts[i + 1] - listing->starts[i] - 1;
+        Tree *child = hmap_get_h(&tree->map, name, length, hmap_hash(name, length));
+        node->children[i] = capture_child(tree, child, locked);
     }
+    return keep_snapshot(tree, listing, node);
+}
+
+
+// A snapshot holds reader permission to every folder in the subtree at once,
+// taken from the top in the order of shards and paths like moves do, so it
+// sees one consistent state. Writers in the subtree wait until it is copied,
+// readers don't. Snapshots of one tree are taken one at a time, so they can
+// reuse the nodes of each other. The snapshot lock is taken before any
+// vertex, so nobody waits for it holding a vertex.
+//
+// If `journal` isn't NULL, `*journal` (started, unless it is NULL) replaces
+// the journal of the tree while everything is locked, and the old journal is
+// stored in `*journal`. No change is in the middle of being made then, so
+// every change is recorded by exactly one of them.
+static TreeSnapshot *take_snapshot(Tree *tree, const char *path_string,
+                                   Journal **journal) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return NULL;
+    STATS_OP_BEGIN();
+
+    Tree *root = tree;
+    Trail trail = { .count = 0 };
+    TreeSnapshot *snapshot = NULL;
+    safe_lock(&root->shared->snapshot_lock);
+    if (find_node_locked(&tree, &path, path.count, &trail, false, false) == 0) {
+        LockedSet locked = { .vertices = NULL, .count = 0, .capacity = 0 };
+        SnapNode *node = is_compact(tree) ? root->shared->compact_snapshot
+                                          : capture(tree, &locked);
+        snap_node_ref(node);
+        TreeShared *shared = root->shared;
+        Journal *old = shared->journal;
+        uint64_t sequence = old ? journal_next(old) : shared->sequence;
+        if (journal) {
+            if (*journal)
+                journal_start(*journal, sequence);
+            shared->journal = *journal;
+            shared->sequence = sequence;
+            *journal = old;
+        }
+        snapshot = snapshot_new(node, ++shared->snapshots, sequence);
 
-    if (son_destroy) {
-        hmap_remove(tree->map, child_name);
-        tree_free(son);
+        while (locked.count > 0)
+            reader_exit_protocol(locked.vertices[--locked.count]);
+        free(locked.vertices);
+        if (!is_compact(tree))
+            reader_exit_protocol(tree);
     }
+    trail_release(&trail);
+    safe_unlock(&root->shared->snapshot_lock);
+    path_release(&path);
+    STATS_OP_END(TREE_STATS_SNAPSHOT);
+    return snapshot;
+}
+
+
+TreeSnapshot *tree_snapshot(Tree *tree, const char *path) {
+    return take_snapshot(tree, path, NULL);
+}
 
-    writer_exit_protocol(tree);
 
-    free(parent_path);
+int tree_journal_start(Tree *tree, int fd, const TreeJournalOptions *options) {
+    TreeShared *shared = tree->shared;
+    int err = 0;
+    safe_lock(&shared->journal_lock);
+    if (shared->journal) {
+        err = EBUSY;
+    }
+    else {
+        Journal *journal = journal_new(fd, options);
+        shared->journal_options = options ? *options : (TreeJournalOptions) { 0 };
+        tree_snapshot_free(take_snapshot(tree, "/", &journal));
+    }
+    safe_unlock(&shared->journal_lock);
     return err;
 }
 
 
-// Waiting for finish of all ongoing processes in the tree.
-void bfs_clear(Tree *tree) {
-    safe_lock(&tree->lock);
-    while (tree->rcount > 0 || tree->wcount > 0 || tree->rwait > 0
-    || tree->wwait > 0) {
-        tree->cwait = true;
-        safe_wait(&tree->clear, &tree->lock);
-        tree->cwait = false;
+int tree_journal_stop(Tree *tree) {
+    TreeShared *shared = tree->shared;
+    int err = 0;
+    safe_lock(&shared->journal_lock);
+    if (shared->journal) {
+        Journal *journal = NULL;
+        tree_snapshot_free(take_snapshot(tree, "/", &journal));
+        err = journal_free(journal);
     }
+    safe_unlock(&shared->journal_lock);
+    return err;
+}
 
-    const char *key;
-    void *value;
-    HashMapIterator it = hmap_iterator(tree->map);
-    while (hmap_next(tree->map, &it, &key, &value))
-        bfs_clear(value);
 
-    safe_unlock(&tree->lock);
+int tree_journal_sync(Tree *tree) {
+    TreeShared *shared = tree->shared;
+    safe_lock(&shared->journal_lock);
+    int err = shared->journal ? journal_sync(shared->journal) : 0;
+    safe_unlock(&shared->journal_lock);
+    return err;
 }
 
 
-// Going down paths below lca in move().
-int move_dfs(Tree **tree, const char *path, char *component,
-             size_t to_grandparent) {
-    int err = 0;
-    bool in_lca = true;
-    while (true) {
-        path = split_path(path, component);
-        if (!path)
+int tree_journal_checkpoint(Tree *tree, int tree_fd, int journal_fd) {
+    TreeShared *shared = tree->shared;
+    int err = EINVAL;
+    safe_lock(&shared->journal_lock);
+    if (shared->journal) {
+        Journal *journal = journal_new(journal_fd, &shared->journal_options);
+        TreeSnapshot *snapshot = take_snapshot(tree, "/", &journal);
+        err = treefile_save(snapshot, tree_fd);
+        tree_snapshot_free(snapshot);
+        if (err == 0 && fsync(tree_fd) != 0)
+            err = errno;
+        int journal_err = journal_free(journal);
+        if (err == 0)
+            err = journal_err;
+    }
+    safe_unlock(&shared->journal_lock);
+    return err;
+}
+
+
+// Applies a change from a journal unless the tree already includes it.
+static int replay_change(void *ctx, uint64_t number, JournalOp op,
+                         const char *path, const char *target) {
+    Tree *tree = ctx;
+    TreeShared *shared = tree->shared;
+    if (number < shared->sequence)
+        return 0;
+    if (number > shared->sequence)
+        return EINVAL; // Changes are missing.
+    int err;
+    switch (op) {
+        case JOURNAL_CREATE:
+            err = tree_create(tree, path);
             break;
-        Tree *old_tree = *tree;
-        *tree = hmap_get((*tree)->map, component);
-        if (!(*tree)) {
-            if (!in_lca)
-                reader_exit_protocol(old_tree);
-            err = ENOENT;
+        case JOURNAL_REMOVE:
+            err = tree_remove(tree, path);
+            break;
+        case JOURNAL_REMOVE_RECURSIVE:
+            err = tree_remove_recursive(tree, path);
+            break;
+        default:
+            err = tree_move(tree, path, target);
             break;
-        }
-        to_grandparent--;
-        if (to_grandparent == 0)
-            writer_entry_protocol(*tree);
-        else
-            reader_entry_protocol(*tree);
-        if (in_lca)
-            in_lca = false;
-        else
-            reader_exit_protocol(old_tree);
     }
+    // Recorded changes succeeded, so they succeed again on the same tree.
+    if (err != 0)
+        return EINVAL;
+    shared->sequence++;
+    return 0;
+}
+
+
+int tree_journal_replay(Tree *tree, int fd) {
+    TreeShared *shared = tree->shared;
+    safe_lock(&shared->journal_lock);
+    int err = shared->journal ? EBUSY : journal_replay(fd, replay_change, tree);
+    safe_unlock(&shared->journal_lock);
     return err;
 }
 
 
-// Traversing to find source in move().
-int source_dfs(Tree *lca_tree, Tree *target_tree, const char *source,
-               char *source_child, char *target_child, char *component,
-               size_t to_grandparent) {
-    Tree *source_tree = lca_tree;
-    int err = move_dfs(&source_tree, source, component, to_grandparent);
-    if (err != 0) {
-        if (lca_tree != target_tree)
-            writer_exit_protocol(target_tree);
-        writer_exit_protocol(lca_tree);
-        return err;
+// Returns whether the `length` characters at `name` are a valid folder name.
+static bool is_name_valid(const char *name, size_t length) {
+    if (length == 0 || length > MAX_FOLDER_NAME_LENGTH)
+        return false;
+    for (size_t i = 0; i < length; ++i) {
+        if (name[i] < 'a' || name[i] > 'z')
+            return false;
     }
+    return true;
+}
 
-    Tree *to_be_moved = hmap_get(source_tree->map, source_child);
-    if (!to_be_moved) {
-        err = ENOENT;
-        if (source_tree != lca_tree)
-            writer_exit_protocol(source_tree);
-        if (target_tree != lca_tree)
-            writer_exit_protocol(target_tree);
-        writer_exit_protocol(lca_tree);
-        return err;
-    }
-
-    // Releasing lca lock, because we are already locked in source and target.
-    if (lca_tree != source_tree && lca_tree != target_tree)
-        writer_exit_protocol(lca_tree);
-
-    bfs_clear(to_be_moved);
-    hmap_remove(source_tree->map, source_child);
-    hmap_insert(target_tree->map, target_child, to_be_moved);
-    if (source_tree != target_tree)
-        writer_exit_protocol(source_tree);
-    writer_exit_protocol(target_tree);
-    return err;
+
+// Builds the children of `tree` saved by tree_save(), and everything below
+// them, straight from the file. Nobody else sees the tree yet, so nothing is
+// locked. The listing read from the file becomes the cached listing of
+// `tree`. Returns false if the data isn't valid.
+static bool load_folder(Tree *tree, TreeFileReader *reader, size_t path_length) {
+    uint64_t count, length;
+    if (!treefile_get_varint(reader, &count))
+        return false;
+    if (count == 0)
+        return true;
+    // Every name takes at least one character and a comma before the next
+    // one, and at least three bytes of the file.
+    if (!treefile_get_varint(reader, &length)
+        || count > (reader->size - reader->position) / 3
+        || length < 2 * count - 1
+        || length > count * (MAX_FOLDER_NAME_LENGTH + 1)
+        || path_length + 2 > MAX_PATH_LENGTH)
+        return false;
+
+    Listing *listing = listing_alloc(count, length, tree->version);
+    tree->listing = listing;
+    char *string = listing->string;
+    char *position = string;
+    const char *previous = NULL;
+    size_t previous_length = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t shared, rest;
+        const unsigned char *bytes;
+        if (!treefile_get_varint(reader, &shared) || !treefile_get_varint(reader, &rest)
+            || shared > previous_length || rest > MAX_FOLDER_NAME_LENGTH
+            || shared + rest > (size_t) (string + length - position)
+            || path_length + shared + rest + 1 > MAX_PATH_LENGTH
+            || !treefile_get_bytes(reader, rest, &bytes))
+            return false;
+        size_t name_length = shared + rest;
+        if (shared > 0)
+            memcpy(position, previous, shared);
+        memcpy(position + shared, bytes, rest);
+        if (!is_name_valid(position, name_length))
+            return false;
+        if (previous) {
+            // Names have to be sorted and distinct.
+            int res = memcmp(previous, position, previous_length < name_length
+                                                 ? previous_length : name_length);
+            if (res > 0 || (res == 0 && previous_length >= name_length))
+                return false;
+        }
+        listing->starts[i] = position - string;
+        previous = position;
+        previous_length = name_length;
+        position += name_length;
+        if (i + 1 < count) {
+            if (position == string + length)
+                return false;
+            *position++ = ',';
+        }
+    }
+    if (position != string + length)
+        return false;
+
+    Tree **children = safe_malloc(count * sizeof(Tree *));
+    if (!hmap_reserve(&tree->map, count))
+        fatal("Map reserve failed.");
+    for (size_t i = 0; i < count; ++i) {
+        const char *name = string + listing->starts[i];
+        size_t name_length = listing->starts[i + 1] - listing->starts[i] - 1;
+        children[i] = node_new(tree->shared);
+        if (!hmap_insert_h(&tree->map, name, name_length,
+                           hmap_hash(name, name_length), children[i]))
+            fatal("Map insert failed.");
+    }
+    bool valid = true;
+    for (size_t i = 0; valid && i < count; ++i) {
+        const char *name = string + listing->starts[i];
+        size_t name_length = listing->starts[i + 1] - listing->starts[i] - 1;
+        valid = load_folder(children[i], reader, path_length + name_length + 1);
+        tree->descendants += children[i]->descendants + 1;
+        // Empty folders are kept compact, as create() makes them.
+        if (valid && hmap_size(&children[i]->map) == 0
+            && hmap_replace_h(&tree->map, name, name_length,
+                              hmap_hash(name, name_length), children[i], COMPACT))
+            node_discard(children[i]);
+    }
+    free(children);
+    return valid;
 }
 
 
-// Traversing to find target in move().
-int target_dfs(Tree *lca_tree, const char *target, char *target_child,
-               const char *source, char *source_child, char *component,
-               size_t to_grandparent, size_t to_grandparent_source) {
-    Tree *target_tree = lca_tree;
-    int err = move_dfs(&target_tree, target, component, to_grandparent);
-    if (err != 0) {
-        writer_exit_protocol(lca_tree);
-        return err;
+Tree *tree_load(int fd) {
+    TreeFileReader reader;
+    if (treefile_reader_open(&reader, fd) != 0)
+        return NULL;
+    Tree *tree = tree_new();
+    const unsigned char *magic;
+    bool valid = treefile_get_bytes(&reader, TREEFILE_MAGIC_LENGTH, &magic)
+                 && memcmp(magic, TREEFILE_MAGIC, TREEFILE_MAGIC_LENGTH) == 0
+                 && treefile_get_varint(&reader, &tree->shared->sequence)
+                 && load_folder(tree, &reader, 1)
+                 && reader.position == reader.size;
+    treefile_reader_close(&reader);
+    if (!valid) {
+        // Folders built so far belong to the pool of the tree.
+        tree_free(tree);
+        return NULL;
     }
+    return tree;
+}
+
 
-    // We hold writer permission to target and start going down to source.
-    // Also, we move critical section of lca node to source_dfs().
-    if (hmap_get(target_tree->map, target_child)) {
-        if (target_tree != lca_tree)
-            writer_exit_protocol(target_tree);
-        writer_exit_protocol(lca_tree);
-        err = EEXIST;
+// An operation of a batch, together with the length of its parent path.
+typedef struct {
+    const TreeOp *op;
+    size_t index;
+    size_t length;
+    size_t parent_length;
+    size_t shard; // Shard of a child of the sharded root, 0 otherwise.
+} BatchEntry;
+
+
+// Orders operations by parent path, and by position in the batch if the
+// parent is the same. Children of the sharded root are in different
+// vertices, so they are grouped by shard.
+static int compare_batch_entries(const void *p1, const void *p2) {
+    const BatchEntry *e1 = p1, *e2 = p2;
+    size_t length = e1->parent_length < e2->parent_length
+                    ? e1->parent_length : e2->parent_length;
+    int res = memcmp(e1->op->path, e2->op->path, length);
+    if (res == 0 && e1->parent_length != e2->parent_length)
+        res = e1->parent_length < e2->parent_length ? -1 : 1;
+    if (res == 0 && e1->shard != e2->shard)
+        res = e1->shard < e2->shard ? -1 : 1;
+    if (res == 0)
+        res = e1->index < e2->index ? -1 : 1;
+    return res;
+}
+
+
+// Applies operations with the same parent, entries [first, last), with
+// one traversal and one writer critical section in the parent.
+static void apply_batch_group(Tree *tree, BatchEntry *first, BatchEntry *last,
+                              int *results) {
+    ParsedPath path;
+    parse_path(first->op->path, &path);
+
+    Tree *top = start_vertex(tree, &path), *start = tree;
+    Trail trail = { .count = 0 };
+    int err = find_node(&tree, &path, path.count - 1, &trail);
+    int64_t delta = 0;
+    bool removed = false;
+    for (BatchEntry *e = first; e != last; ++e) {
+        if (err != 0) {
+            results[e->index] = err;
+            continue;
+        }
+        PathComponent name;
+        name.offset = e->parent_length;
+        name.length = e->length - e->parent_length - 1;
+        name.hash = hmap_hash(e->op->path + name.offset, name.length);
+        bool create = e->op->type == TREE_OP_CREATE;
+        results[e->index] = create ? create_in(tree, e->op->path, &name)
+                                   : remove_in(tree, e->op->path, &name);
+        if (results[e->index] == 0) {
+            delta += create ? 1 : -1;
+            removed |= !create;
+            record_change(tree, create ? JOURNAL_CREATE : JOURNAL_REMOVE, NULL,
+                          e->op->path, NULL);
+        }
     }
-    else {
-        err = source_dfs(lca_tree, target_tree, source, source_child,
-                         target_child, component, to_grandparent_source);
+    if (delta != 0)
+        add_descendants(top, NULL, &trail, delta);
+    bool emptied = err == 0 && removed && hmap_size(&tree->map) == 0;
+    if (err == 0)
+        writer_exit_protocol(tree);
+    trail_release(&trail);
+    if (emptied)
+        deflate_folder(start, &path, path.count - 1);
+    path_release(&path);
+}
+
+
+void tree_batch(Tree *tree, const TreeOp *ops, size_t n, int *results) {
+    STATS_OP_BEGIN();
+    BatchEntry *entries = safe_malloc(n * sizeof(BatchEntry) + 1);
+    size_t n_entries = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const char *path = ops[i].path;
+        if (ops[i].type != TREE_OP_CREATE && ops[i].type != TREE_OP_REMOVE) {
+            results[i] = EINVAL;
+            continue;
+        }
+        if (!is_path_valid(path)) {
+            results[i] = EINVAL;
+            continue;
+        }
+        if (is_root(path)) {
+            results[i] = ops[i].type == TREE_OP_CREATE ? EEXIST : EBUSY;
+            continue;
+        }
+        BatchEntry *e = &entries[n_entries++];
+        e->op = &ops[i];
+        e->index = i;
+        e->length = strlen(path);
+        e->parent_length = e->length - 1;
+        while (path[e->parent_length - 1] != '/')
+            e->parent_length--;
+        e->shard = 0;
+        if (e->parent_length == 1 && is_sharded_root(tree))
+            e->shard = shard_index(tree->shared, hmap_hash(path + 1, e->length - 2));
     }
-    return err;
+
+    qsort(entries, n_entries, sizeof(BatchEntry), compare_batch_entries);
+    for (size_t first = 0; first < n_entries;) {
+        size_t last = first + 1;
+        while (last < n_entries
+               && entries[last].parent_length == entries[first].parent_length
+               && entries[last].shard == entries[first].shard
+               && memcmp(entries[last].op->path, entries[first].op->path,
+                         entries[first].parent_length) == 0)
+            last++;
+        apply_batch_group(tree, entries + first, entries + last, results);
+        first = last;
+    }
+    free(entries);
+    journal_wait_pending();
+    STATS_OP_END(TREE_STATS_BATCH);
 }
 
 
-// Moves folder source with its content to target.
-int tree_move(Tree *tree, const char *source, const char *target) {
-    if (!is_path_valid(source) || !is_path_valid(target))
-        return EINVAL;
-    if (is_root(source))
-        return EBUSY;
-    if (is_root(target))
-        return EEXIST;
+// A move planned by tree_move() or tree_move_many().
+typedef struct {
+    ParsedPath source, target;
+    int result;
+    bool valid; // Whether it got past checking the paths.
+} PlannedMove;
+
+// Parent of a source or a target of a planned move.
+typedef struct {
+    const ParsedPath *path;
+    size_t depth;
+    size_t length; // Length of the path to the parent.
+    Tree *top; // The root, or the shard the path is in.
+    size_t shard; // Index of the shard, 0 if there are none.
+    Tree *tree; // NULL if there is no such folder.
+    bool compact; // Whether the folder exists but has no vertex.
+    bool emptied; // Whether moves took all children of the folder.
+} MoveParent;
+
+// A vertex locked by moves, together with the kind of permission held.
+typedef struct {
+    Tree *tree;
+    bool writer;
+    bool entered; // Whether its `inflight` counter was incremented.
+} LockedVertex;
+
+
+// Checks paths of a move, like tree_move() does.
+// Both paths are parsed anyway, so they can be released by release_move().
+static void plan_move(PlannedMove *move, const char *source, const char *target) {
+    move->valid = false;
+    bool source_valid = parse_path(source, &move->source);
+    bool target_valid = parse_path(target, &move->target);
+    if (!source_valid || !target_valid)
+        move->result = EINVAL;
+    else if (move->source.count == 0)
+        move->result = EBUSY;
+    else if (move->target.count == 0)
+        move->result = EEXIST;
     // Custom error when source is ancestor of target.
-    size_t size = strlen(source);
-    if (size < strlen(target) && strncmp(source, target, size) == 0)
-        return -1;
+    else if (move->source.count < move->target.count
+             && common_components(&move->source, &move->target,
+                                  move->source.count) == move->source.count)
+        move->result = -1;
+    else
+        move->valid = true;
+}
+
 
-    char source_child_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *source_parent_path = make_path_to_parent(source, source_child_name);
-    source = source_parent_path;
+static void release_move(PlannedMove *move) {
+    path_release(&move->source);
+    path_release(&move->target);
+}
 
-    char target_child_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *target_parent_path = make_path_to_parent(target, target_child_name);
-    target = target_parent_path;
 
-    Tree *source_tree = tree;
-    Tree *target_tree = tree;
+// Returns whether `path` is `folder` or is inside it.
+static bool is_inside(const ParsedPath *path, const ParsedPath *folder) {
+    return path->count >= folder->count
+           && common_components(path, folder, folder->count) == folder->count;
+}
 
-    size_t common = common_files(source_parent_path, target_parent_path) - 1;\
-    size_t source_size = count_slashes(source_parent_path) - 1 - common;
-    size_t target_size = count_slashes(target_parent_path) - 1 - common;
-    int err = 0;
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    if (common == 0)
-        writer_entry_protocol(source_tree);
-    else
-        reader_entry_protocol(source_tree);
 
-    while (common > 0) {
-        source = split_path(source, component);
-        target = split_path(target, component);
-        if (!source)
-            break;
-        Tree *old_tree = source_tree;
-        source_tree = hmap_get(source_tree->map, component);
-        target_tree = source_tree;
-        if (!source_tree) {
-            reader_exit_protocol(old_tree);
-            err = ENOENT;
-            break;
+// Returns whether one of the paths is inside the other one or equal to it.
+static bool paths_related(const ParsedPath *path1, const ParsedPath *path2) {
+    return is_inside(path1, path2) || is_inside(path2, path1);
+}
+
+
+// Moves conflict if a source or a target of one of them is related to
+// a source or a target of the other one, so that applying one of them could
+// change the result of the other.
+static bool moves_conflict(const PlannedMove *m1, const PlannedMove *m2) {
+    return paths_related(&m1->source, &m2->source)
+           || paths_related(&m1->source, &m2->target)
+           || paths_related(&m1->target, &m2->source)
+           || paths_related(&m1->target, &m2->target);
+}
+
+
+static void set_move_parent(MoveParent *parent, Tree *root, const ParsedPath *path) {
+    parent->path = path;
+    parent->depth = path->count - 1;
+    parent->length = parent->depth > 0 ? prefix_length(path, parent->depth) : 1;
+    parent->top = start_vertex(root, path);
+    parent->shard = is_sharded_root(root)
+                    ? shard_index(root->shared, path->components[0].hash) : 0;
+    parent->tree = NULL;
+    parent->compact = false;
+    parent->emptied = false;
+}
+
+
+// Orders parents by their shards and then by their paths. It is the lock
+// order of moves: ancestors go before their descendants, and all folders
+// inside a folder go together.
+static int compare_move_parents(const void *p1, const void *p2) {
+    const MoveParent *m1 = *(MoveParent *const *) p1, *m2 = *(MoveParent *const *) p2;
+    if (m1->shard != m2->shard)
+        return m1->shard < m2->shard ? -1 : 1;
+    size_t length = m1->length < m2->length ? m1->length : m2->length;
+    int res = memcmp(m1->path->path, m2->path->path, length);
+    if (res == 0 && m1->length != m2->length)
+        res = m1->length < m2->length ? -1 : 1;
+    return res;
+}
+
+
+// Takes writer permission to all `n` parents (sorted and possibly repeated)
+// and reader permission to all vertices on the way to them, entering all of
+// them except the root and shards. Nothing is released until all parents are
+// reached, as the process waits for locks of later parents. Since every
+// process locking many vertices does it in the order of shards and paths, and
+// never comes back to a folder it already went past, they can't wait for each
+// other in a cycle. For the same reason compact parents aren't inflated, only
+// marked as such.
+static void lock_move_parents(MoveParent **order, size_t n,
+                              LockedVertex *locked, size_t *n_locked) {
+    // Vertices on the path to the last parent, as far as they exist.
+    size_t max_depth = 0;
+    for (size_t k = 0; k < n; ++k) {
+        if (order[k]->depth > max_depth)
+            max_depth = order[k]->depth;
+    }
+    Tree **stack = safe_malloc((max_depth + 1) * sizeof(Tree *));
+    size_t height = 1;
+    const MoveParent *last = NULL;
+
+    for (size_t k = 0; k < n; ++k) {
+        MoveParent *parent = order[k];
+        if (last && compare_move_parents(&last, &parent) == 0) {
+            parent->tree = last->tree;
+            parent->compact = last->compact;
+            continue;
+        }
+        if (!last || last->top != parent->top) {
+            // Parents in the root or a shard come first among parents below
+            // it, so they decide the kind of permission.
+            Tree *top = parent->top;
+            bool writer = parent->depth == 0;
+            STATS_DEPTH(0);
+            if (writer)
+                writer_entry_protocol(top);
+            else
+                reader_entry_protocol(top);
+            locked[(*n_locked)++] = (LockedVertex) { top, writer, false };
+            stack[0] = top;
+            height = 1;
+            last = NULL;
         }
-        common--;
-        if (common == 0)
-            writer_entry_protocol(source_tree);
+        // A parent is never an ancestor of an earlier one, so the common
+        // part is below it.
+        size_t i = 0;
+        if (last)
+            i = common_components(last->path, parent->path,
+                                  last->depth < parent->depth ? last->depth : parent->depth);
+        if (i >= height)
+            i = height - 1;
+
+        Tree *tree = stack[i];
+        parent->compact = false;
+        for (; i < parent->depth; ++i) {
+            Tree *child = get_child(tree, parent->path, i);
+            if (is_compact(child)) {
+                parent->compact = i + 1 == parent->depth;
+                break;
+            }
+            if (!child)
+                break;
+            vertex_enter(child);
+            bool writer = i + 1 == parent->depth;
+            STATS_DEPTH(i + 1);
+            if (writer)
+                writer_entry_protocol(child);
+            else
+                reader_entry_protocol(child);
+            locked[(*n_locked)++] = (LockedVertex) { child, writer, true };
+            stack[i + 1] = child;
+            tree = child;
+        }
+        height = i + 1;
+        parent->tree = i == parent->depth ? tree : NULL;
+        last = parent;
+    }
+    free(stack);
+}
+
+
+// Releases vertices locked by lock_move_parents(), in reverse order.
+static void unlock_vertices(LockedVertex *locked, size_t *n_locked) {
+    while (*n_locked > 0) {
+        LockedVertex *v = &locked[--*n_locked];
+        if (v->writer)
+            writer_exit_protocol(v->tree);
         else
-            reader_entry_protocol(source_tree);
-        reader_exit_protocol(old_tree);
+            reader_exit_protocol(v->tree);
+        if (v->entered)
+            vertex_leave(v->tree);
+    }
+}
+
+
+// Gives a vertex to the folder of the first `depth` components of `path`,
+// if it is compact, like any operation in the folder would do.
+static void inflate_folder(Tree *tree, const ParsedPath *path, size_t depth) {
+    Trail trail = { .count = 0 };
+    if (find_node_locked(&tree, path, depth, &trail, false, true) == 0)
+        reader_exit_protocol(tree);
+    trail_release(&trail);
+}
+
+
+// Applies a move whose parents are locked. Paths of all locked vertices stay
+// the same, as they can't be moved before this process leaves them. Numbers
+// of descendants change only below the lowest common ancestor of the parents.
+static int apply_move(Tree *root, const PlannedMove *move, Tree *source_parent,
+                      Tree *target_parent) {
+    const ParsedPath *source = &move->source, *target = &move->target;
+    if (!target_parent)
+        return ENOENT;
+    if (get_child(target_parent, target, target->count - 1))
+        return EEXIST;
+    if (!source_parent)
+        return ENOENT;
+    Tree *to_be_moved = get_child(source_parent, source, source->count - 1);
+    if (!to_be_moved)
+        return ENOENT;
+    int64_t moved = 1;
+    if (!is_compact(to_be_moved)) {
+        if (is_pinned(to_be_moved))
+            return EBUSY;
+        // No locked vertex is inside the moved folder, so processes there
+        // can finish.
+        wait_quiescent(to_be_moved);
+        moved += __atomic_load_n(&to_be_moved->descendants, __ATOMIC_RELAXED);
+    }
+    remove_child(source_parent, source, source->count - 1);
+    insert_child(target_parent, target, target->count - 1, to_be_moved);
+
+    // Moves between shards change the numbers of the shards too.
+    size_t source_depth = source->count - 1, target_depth = target->count - 1;
+    size_t first = 0;
+    if (start_vertex(root, source) == start_vertex(root, target))
+        first = common_components(source, target, source_depth < target_depth
+                                                  ? source_depth : target_depth) + 1;
+    if (first <= source_depth)
+        add_descendants_on_path(root, source, first, source_depth, -moved);
+    if (first <= target_depth)
+        add_descendants_on_path(root, target, first, target_depth, moved);
+    return 0;
+}
+
+
+// Applies valid moves out of `n` planned ones, which don't conflict, at once.
+static void apply_moves(Tree *tree, PlannedMove *moves, size_t n) {
+    size_t n_parents = 0, capacity = 1;
+    for (size_t i = 0; i < n; ++i) {
+        if (moves[i].valid) {
+            n_parents += 2;
+            capacity += moves[i].source.count + moves[i].target.count;
+        }
+    }
+    if (n_parents == 0)
+        return;
+
+    MoveParent *parents = safe_malloc(n_parents * sizeof(MoveParent));
+    MoveParent **order = safe_malloc(n_parents * sizeof(MoveParent *));
+    LockedVertex *locked = safe_malloc(capacity * sizeof(LockedVertex));
+    size_t k = 0, n_locked = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (moves[i].valid) {
+            set_move_parent(&parents[k++], tree, &moves[i].source);
+            set_move_parent(&parents[k++], tree, &moves[i].target);
+        }
     }
-    if (err != 0) {
-        free(source_parent_path);
-        free(target_parent_path);
-        return err;
+    for (k = 0; k < n_parents; ++k)
+        order[k] = &parents[k];
+    qsort(order, n_parents, sizeof(MoveParent *), compare_move_parents);
+
+    // A target's parent must have a vertex to get the moved folder. Nothing
+    // is locked while it is given one, so the locks are taken again.
+    for (;;) {
+        lock_move_parents(order, n_parents, locked, &n_locked);
+        bool compact = false;
+        for (k = 1; k < n_parents; k += 2)
+            compact |= parents[k].compact;
+        if (!compact)
+            break;
+        unlock_vertices(locked, &n_locked);
+        for (k = 1; k < n_parents; k += 2) {
+            if (parents[k].compact)
+                inflate_folder(tree, parents[k].path, parents[k].depth);
+        }
+    }
+    k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (moves[i].valid) {
+            moves[i].result = apply_move(tree, &moves[i], parents[k].tree,
+                                         parents[k + 1].tree);
+            if (moves[i].result == 0)
+                record_change(tree, JOURNAL_MOVE, NULL, moves[i].source.path,
+                              moves[i].target.path);
+            k += 2;
+        }
     }
+    // Parents of sources may be parents of targets of other moves too.
+    for (k = 0; k < n_parents; k += 2)
+        parents[k].emptied = parents[k].tree && hmap_size(&parents[k].tree->map) == 0;
+
+    unlock_vertices(locked, &n_locked);
+    for (k = 0; k < n_parents; k += 2) {
+        if (parents[k].emptied)
+            deflate_folder(tree, parents[k].path, parents[k].depth);
+    }
+    free(locked);
+    free(order);
+    free(parents);
+}
 
-    // Now we do have writer permission in LCA of source and target.
-    err = target_dfs(target_tree, target, target_child_name, source,
-                     source_child_name, component, target_size, source_size);
 
-    free(source_parent_path);
-    free(target_parent_path);
-    return err;
+// Moves folder source with its content to target.
+int tree_move(Tree *tree, const char *source, const char *target) {
+    PlannedMove move;
+    plan_move(&move, source, target);
+    if (!move.valid) {
+        release_move(&move);
+        return move.result;
+    }
+    STATS_OP_BEGIN();
+    apply_moves(tree, &move, 1);
+    journal_wait_pending();
+    release_move(&move);
+    STATS_OP_END(TREE_STATS_MOVE);
+    return move.result;
+}
+
+
+void tree_move_many(Tree *tree, const TreeMove *moves, size_t n, int *results) {
+    STATS_OP_BEGIN();
+    PlannedMove *planned = safe_malloc(n * sizeof(PlannedMove) + 1);
+    for (size_t i = 0; i < n; ++i) {
+        plan_move(&planned[i], moves[i].source, moves[i].target);
+        for (size_t j = 0; planned[i].valid && j < i; ++j) {
+            if (planned[j].valid && moves_conflict(&planned[i], &planned[j])) {
+                planned[i].valid = false;
+                planned[i].result = EINVAL;
+            }
+        }
+    }
+    apply_moves(tree, planned, n);
+    journal_wait_pending();
+    for (size_t i = 0; i < n; ++i) {
+        results[i] = planned[i].result;
+        release_move(&planned[i]);
+    }
+    free(planned);
+    STATS_OP_END(TREE_STATS_MOVE_MANY);
 }
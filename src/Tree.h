@@ -1,15 +1,387 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
 Tree* tree_new();
 
+// How the lock of a folder hands off between readers and writers.
+typedef enum {
+    // A new reader waits while a writer works or waits, and a leaving writer
+    // lets the readers which waited for it in before the next writer, so
+    // phases of readers and writers alternate (the default).
+    TREE_LOCK_PHASE_FAIR,
+    // A new reader waits only while a writer works. Writers may starve.
+    TREE_LOCK_PREFER_READERS,
+    // A leaving writer lets the next writer in first, and readers wait while
+    // any writer works or waits. Readers may starve.
+    TREE_LOCK_PREFER_WRITERS,
+} TreeLockPolicy;
+
+typedef struct {
+    // Number of paths kept in a cache which lets operations on deep folders
+    // skip going through their ancestors; 0 turns the cache off.
+    size_t path_cache_entries;
+    // Number of shards the children of the root are spread over by the hash
+    // of their names, each with its own lock and map, so operations in
+    // different top-level folders don't touch the same lock. Listing "/"
+    // then merges all shards. 0 or 1 keeps the children in the root.
+    size_t root_shards;
+    TreeLockPolicy lock_policy;
+    // With TREE_LOCK_PHASE_FAIR, the most readers a leaving writer lets in
+    // before a waiting writer; 0 lets in all readers waiting for it.
+    unsigned lock_reader_batch;
+} TreeOptions;
+
+// Same as tree_new(), with given options (defaults if `options` is NULL).
+Tree* tree_new_with(const TreeOptions* options);
+
 void tree_free(Tree*);
 
 char* tree_list(Tree* tree, const char* path);
 
+// Returns at most `limit` child names of given folder which come after
+// `after_name` in sorted order (all of them if `after_name` is NULL),
+// comma-separated like in tree_list(). Returns NULL for an invalid path or if
+// there is no such folder. Passing the last returned name as `after_name`
+// gives the next page.
+char* tree_list_range(Tree* tree, const char* path, const char* after_name,
+                      size_t limit);
+
+// Writes content of given folder, as returned by tree_list(), into `buf` of
+// size `cap`. If `needed` isn't NULL, it receives the size the content needs
+// (including terminating null character). Returns 0, EINVAL for an invalid
+// path, ENOENT if there is no such folder, or ERANGE if `cap` is too small.
+int tree_list_into(Tree* tree, const char* path, char* buf, size_t cap,
+                   size_t* needed);
+
+// Calls `callback` with every child name of given folder, in sorted order.
+// Names aren't null-terminated. All names come from one consistent state of
+// the folder. No lock is held and reclaiming memory of removed folders isn't
+// held up while `callback` runs. Stops when `callback` returns nonzero and
+// returns that value; otherwise returns 0, EINVAL or ENOENT.
+int tree_list_foreach(Tree* tree, const char* path,
+                      int (*callback)(void* ctx, const char* name, size_t length),
+                      void* ctx);
+
+// Stores the number of folders below given folder (not counting itself) in
+// `*count`, in time proportional to the depth of the folder. The number is
+// exact if nothing below the folder changes meanwhile. Returns 0, EINVAL for
+// an invalid path or ENOENT if there is no such folder.
+int tree_count(Tree* tree, const char* path, size_t* count);
+
 int tree_create(Tree* tree, const char* path);
 
 int tree_remove(Tree* tree, const char* path);
 
 int tree_move(Tree* tree, const char* source, const char* target);
+
+typedef struct {
+    const char* source;
+    const char* target;
+} TreeMove;
+
+// Applies `n` moves at once, storing the result of i-th of them in
+// results[i] (the same as tree_move() would return). A move fails with
+// EINVAL if its source or target is equal to, inside or contains the source
+// or target of an earlier move, so the remaining ones are independent and
+// the result is the same as of applying them one by one. Only parents of
+// sources and targets are locked, in the order of their paths, so moves in
+// different folders, also concurrent calls, don't wait for each other.
+void tree_move_many(Tree* tree, const TreeMove* moves, size_t n, int* results);
+
+// Removes folder together with all its content. Returns 0, EINVAL, EBUSY for
+// the root or a folder with open handles in it, or ENOENT. The subtree is
+// detached at once and freed later on a background thread.
+int tree_remove_recursive(Tree* tree, const char* path);
+
+typedef struct TreeHandle TreeHandle;
+
+// Opens a handle to given folder, or returns NULL for an invalid path or if
+// there is no such folder. While the handle is open, the folder and its
+// ancestors can't be moved or removed (EBUSY).
+TreeHandle* tree_open(Tree* tree, const char* path);
+
+// Closes a handle. Should be called before tree_free().
+void tree_close(TreeHandle* handle);
+
+// Same as tree_list(), tree_create() and tree_remove(), but `path` is
+// relative to the folder of `handle` (for example "/" is the folder itself
+// and "/a/" is its child "a"). They go only through the relative path.
+char* tree_list_at(TreeHandle* handle, const char* path);
+
+int tree_create_at(TreeHandle* handle, const char* path);
+
+int tree_remove_at(TreeHandle* handle, const char* path);
+
+typedef enum {
+    TREE_WALK_DEPTH_FIRST,
+    TREE_WALK_BREADTH_FIRST,
+} TreeWalkOrder;
+
+// Calls `visit` for given folder and every folder below it, with its path
+// and depth relative to the given folder, in preorder depth-first or in
+// breadth-first order (children in sorted order). Children of every folder
+// are taken from one consistent state of it. The given folder is pinned like
+// by tree_open(), so during the walk it and its ancestors can't be moved or
+// removed (EBUSY), but folders below it can, in which case they may be
+// skipped together with their content, or visited with their old paths.
+// Nothing else is held while `visit` runs: it may use the tree, and the walk
+// doesn't hold up other processes or reclaiming memory meanwhile. Stops when
+// `visit` returns nonzero and returns that value; otherwise returns 0,
+// EINVAL or ENOENT.
+int tree_walk(Tree* tree, const char* path, TreeWalkOrder order,
+              int (*visit)(void* ctx, const char* path, size_t depth),
+              void* ctx);
+
+// Calls `match` with the path of every folder matching `pattern`, a path
+// whose components may contain '*' (any sequence of characters, also empty)
+// and '?' (any one character), e.g. "/logs/*/errors/". Components without
+// them are looked up directly, so "/a/b/*/" goes down to "/a/b/" like
+// tree_list() does, and only children of matched folders are listed.
+// Matches come in the sorted order of paths, with the same consistency as
+// in tree_walk(): the folder of the components before the first wildcard is
+// pinned like the walked folder, and folders below it moved or removed while
+// the glob runs may be missed together with the matches below them. Nothing
+// else is held while `match` runs, so it may use the tree. Stops when `match`
+// returns nonzero and returns that value; otherwise returns 0 or EINVAL for
+// an invalid pattern.
+int tree_glob(Tree* tree, const char* pattern,
+              int (*match)(void* ctx, const char* path), void* ctx);
+
+// Memory used by a tree, as counted by tree_memory(). Sizes are in bytes.
+typedef struct {
+    size_t folders; // Including the root.
+    // Empty folders which don't have a vertex of their own: they take only
+    // an entry in the map of their parent, until a child is created in them
+    // or they are opened, and again once they have no children or handles.
+    size_t compact_folders;
+    size_t node_bytes; // Vertices, including free ones kept for reuse.
+    size_t map_bytes; // Tables and entries of maps of children.
+    size_t listing_bytes; // Cached listings.
+    size_t total_bytes; // Sum of the above.
+} TreeMemory;
+
+// Counts the memory used by the tree (not by its snapshots). Folders are
+// visited one at a time, so the numbers are exact if the tree doesn't change
+// meanwhile.
+void tree_memory(Tree* tree, TreeMemory* memory);
+
+
+typedef struct TreeSnapshot TreeSnapshot;
+
+// Takes a snapshot of given folder and everything below it: an immutable
+// view of one moment, independent of later changes and of the tree itself
+// (it may be used and freed after tree_free()). Returns NULL for an invalid
+// path or if there is no such folder. Every folder in the subtree is locked
+// at once, so writers anywhere in it wait for time proportional to its size,
+// even if few folders changed; readers don't wait. Folders which didn't
+// change since the last snapshot of them, and the names of children, are
+// shared with earlier snapshots.
+TreeSnapshot* tree_snapshot(Tree* tree, const char* path);
+
+void tree_snapshot_free(TreeSnapshot* snapshot);
+
+// Versions of snapshots of one tree grow with every snapshot taken.
+uint64_t tree_snapshot_version(const TreeSnapshot* snapshot);
+
+// Same as tree_list() and tree_walk(), for paths relative to the folder of
+// the snapshot. They take no locks.
+char* tree_snapshot_list(const TreeSnapshot* snapshot, const char* path);
+
+int tree_snapshot_walk(const TreeSnapshot* snapshot, const char* path,
+                       TreeWalkOrder order,
+                       int (*visit)(void* ctx, const char* path, size_t depth),
+                       void* ctx);
+
+// Writes the whole tree to `fd` in a compact binary format (see treefile.h).
+// The tree may be changed meanwhile, what is saved is a snapshot of it, so
+// writers wait like for tree_snapshot() of the root, but not for the writes.
+// Returns 0 or the errno value of a failed write.
+int tree_save(Tree* tree, int fd);
+
+// Makes a tree saved by tree_save(), read from the current offset of `fd` to
+// the end (regular files are mapped into memory instead of being read).
+// Folders are built directly, without paths or locks. Returns NULL if the
+// data can't be read or isn't a valid saved tree.
+Tree* tree_load(int fd);
+
+typedef struct {
+    // Changes are written out and synced in batches at least this often, in
+    // microseconds; with 0, a batch is written as soon as the previous one is
+    // synced.
+    unsigned sync_interval_us;
+    // Whether changes return only once their records are synced. Otherwise
+    // changes of the last interval may be lost in a crash.
+    bool wait_durable;
+} TreeJournalOptions;
+
+// Starts recording every successful change of the tree (creations, removals
+// and moves, also in batches and through handles) in a journal appended to
+// `fd` (see journal.h). Changes are recorded in their critical sections and
+// written out by a background thread, one sync for a whole batch of them.
+// Returns EBUSY if the tree already has a journal.
+int tree_journal_start(Tree* tree, int fd, const TreeJournalOptions* options);
+
+// Stops recording, after writing out all records. Returns 0 or the first
+// error of writing or syncing the journal.
+int tree_journal_stop(Tree* tree);
+
+// Waits until every change made so far is synced. Returns 0 or the first
+// error of writing or syncing the journal.
+int tree_journal_sync(Tree* tree);
+
+// Saves the tree to `tree_fd` like tree_save(), syncs it, and continues the
+// journal in `journal_fd` from the moment of the save. Once it returns 0, the
+// saved tree and the new journal are enough to recover, and the old journal
+// is written out completely. Writers wait like for tree_save(). Returns
+// EINVAL if the tree has no journal.
+int tree_journal_checkpoint(Tree* tree, int tree_fd, int journal_fd);
+
+// Applies changes recorded in a journal read from `fd` which aren't included
+// in the tree yet, e.g. to a tree loaded with tree_load(). A batch of records
+// cut short by a crash ends the journal. Returns 0, an errno value if `fd`
+// can't be read, EINVAL if the journal doesn't continue the tree, or EBUSY
+// if the tree records its own journal.
+int tree_journal_replay(Tree* tree, int fd);
+
+
+typedef enum {
+    TREE_OP_CREATE,
+    TREE_OP_REMOVE,
+} TreeOpType;
+
+typedef struct {
+    TreeOpType type;
+    const char* path;
+} TreeOp;
+
+// Applies `n` operations, storing the result of i-th of them in results[i]
+// (the same as tree_create() or tree_remove() would return).
+// Operations with the same parent folder are applied in their order, in one
+// critical section of the parent. Groups with different parents are applied
+// in the lexicographic order of parent paths (so a parent goes before its
+// subfolders), as if they were separate concurrent calls.
+void tree_batch(Tree* tree, const TreeOp* ops, size_t n, int* results);
+
+
+// Queues of operations executed by a pool of worker threads, for callers
+// which must not wait on folder locks (e.g. event loops). Operations are
+// submitted with tree_submit(), and their results are reaped with
+// tree_reap() once they complete. Operations in the ring at the same time
+// may run in any order and concurrently: workers take several at once and
+// apply creations and removals among them with tree_batch(), which reorders
+// them by parent. An operation reaped before another is submitted runs
+// before it.
+typedef struct TreeRing TreeRing;
+
+typedef enum {
+    TREE_RING_LIST,
+    TREE_RING_CREATE,
+    TREE_RING_REMOVE,
+    TREE_RING_REMOVE_RECURSIVE,
+    TREE_RING_MOVE,
+} TreeRingOpType;
+
+typedef struct {
+    TreeRingOpType type;
+    const char* path;
+    const char* target; // Target of a move, unused for other operations.
+    uint64_t user_data; // Passed back in the completion.
+} TreeRingOp;
+
+typedef struct {
+    uint64_t user_data;
+    // What the function doing the operation returns; for lists 0, EINVAL or
+    // ENOENT.
+    int result;
+    // For lists, the content like tree_list() returns it (to be freed by
+    // the caller), NULL otherwise.
+    char* listing;
+} TreeCompletion;
+
+// Makes a ring for operations on `tree`, executed by `workers` threads, with
+// at most `entries` operations submitted and not reaped yet. Returns NULL if
+// `entries` or `workers` is 0.
+TreeRing* tree_ring_new(Tree* tree, size_t entries, size_t workers);
+
+// Waits for all submitted operations, frees contents of completions which
+// aren't reaped and the ring. The tree must outlive the ring.
+void tree_ring_free(TreeRing* ring);
+
+// Queues an operation, copying its paths. Never waits for the tree. Returns
+// 0, or EAGAIN if `entries` operations are already submitted and not reaped.
+int tree_submit(TreeRing* ring, const TreeRingOp* op);
+
+// Moves at most `n` completions into `completions`, oldest first, and
+// returns their number. Doesn't wait for operations.
+size_t tree_reap(TreeRing* ring, TreeCompletion* completions, size_t n);
+
+// Returns a descriptor which is readable exactly while the ring has
+// completions to reap, for poll() or epoll. It is owned by the ring.
+int tree_ring_fd(TreeRing* ring);
+
+
+// Statistics of lock waits and operation latencies, collected only if the
+// library is built with TREE_STATS (see CMakeLists.txt). Every thread counts
+// in its own shard, which tree_stats_snapshot() sums up, for all trees.
+#define TREE_STATS_BUCKETS 32
+#define TREE_STATS_DEPTHS 32
+#define TREE_STATS_QUEUES 16
+
+typedef enum {
+    TREE_STATS_READER_WAIT, // Reader entries to a folder.
+    TREE_STATS_WRITER_WAIT, // Writer entries to a folder.
+    TREE_STATS_QUIESCE_WAIT, // Waits for processes below a removed or moved folder.
+    TREE_STATS_WAIT_KINDS,
+} TreeStatsWait;
+
+typedef enum {
+    TREE_STATS_LIST, // All variants of tree_list().
+    TREE_STATS_CREATE,
+    TREE_STATS_REMOVE,
+    TREE_STATS_MOVE,
+    TREE_STATS_MOVE_MANY,
+    TREE_STATS_REMOVE_RECURSIVE,
+    TREE_STATS_WALK, // Including the time spent in `visit`.
+    TREE_STATS_BATCH,
+    TREE_STATS_OPEN,
+    TREE_STATS_SNAPSHOT,
+    TREE_STATS_COUNT,
+    TREE_STATS_GLOB, // Including the time spent in `match`.
+    TREE_STATS_OP_KINDS,
+} TreeStatsOp;
+
+// Times in nanoseconds. Bucket i counts times in [2^i, 2^(i+1)), the first
+// one also shorter times and the last one also longer times.
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t buckets[TREE_STATS_BUCKETS];
+} TreeStatsHistogram;
+
+typedef struct {
+    // For lock entries: all of them, those which had to wait, and the time
+    // they waited. Quiesce waits count every wait, even those which end
+    // at once.
+    uint64_t acquired[TREE_STATS_WAIT_KINDS];
+    uint64_t contended[TREE_STATS_WAIT_KINDS];
+    TreeStatsHistogram waits[TREE_STATS_WAIT_KINDS];
+    // Lock entries which had to wait, by depth of the folder (the root has
+    // depth 0, deeper ones are counted in the last entry).
+    uint64_t contended_at_depth[TREE_STATS_DEPTHS];
+    // For reader and writer entries which had to sleep, how many readers and
+    // writers already slept on the folder then. Entry i counts queues of i
+    // threads, the last one also longer queues. Quiesce waits aren't counted.
+    uint64_t queued_readers[TREE_STATS_WAIT_KINDS][TREE_STATS_QUEUES];
+    uint64_t queued_writers[TREE_STATS_WAIT_KINDS][TREE_STATS_QUEUES];
+    // Latencies of operations which got past checking their arguments.
+    TreeStatsHistogram ops[TREE_STATS_OP_KINDS];
+} TreeStats;
+
+// Fills `stats` with statistics collected since the start of the process.
+// Returns 0, or ENOTSUP (leaving `stats` zeroed) if they aren't collected.
+int tree_stats_snapshot(TreeStats* stats);
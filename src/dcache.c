@@ -0,0 +1,105 @@
+#include "dcache.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_WORDS (DCACHE_MAX_PATH / sizeof(uint64_t))
+
+// Slots are read without locks, so every field is accessed atomically and
+// a slot is valid only if `seq` was the same even number before and after.
+typedef struct {
+    uint32_t seq; // Odd while a writer changes the slot.
+    uint32_t depth; // 0 for an empty slot.
+    uint64_t hash;
+    uint64_t length;
+    uint64_t words[PATH_WORDS]; // The path, padded with zeros.
+    void *vertices[DCACHE_MAX_DEPTH];
+    uint32_t generations[DCACHE_MAX_DEPTH];
+} Slot;
+
+struct DCache {
+    size_t mask;
+    Slot slots[];
+};
+
+
+DCache *dcache_new(size_t entries) {
+    size_t n = 1;
+    while (n < entries)
+        n *= 2;
+    DCache *cache = safe_malloc(sizeof(DCache) + n * sizeof(Slot));
+    memset(cache, 0, sizeof(DCache) + n * sizeof(Slot));
+    cache->mask = n - 1;
+    return cache;
+}
+
+
+void dcache_free(DCache *cache) {
+    free(cache);
+}
+
+
+static void path_to_words(const char *path, size_t length, uint64_t *words) {
+    memset(words, 0, PATH_WORDS * sizeof(uint64_t));
+    memcpy(words, path, length);
+}
+
+
+size_t dcache_lookup(DCache *cache, const char *path, size_t length, uint64_t hash,
+                     void **vertices, uint32_t *generations) {
+    if (length > DCACHE_MAX_PATH)
+        return 0;
+    Slot *slot = &cache->slots[hash & cache->mask];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return 0;
+    size_t depth = __atomic_load_n(&slot->depth, __ATOMIC_RELAXED);
+    if (depth == 0 || depth > DCACHE_MAX_DEPTH
+        || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash
+        || __atomic_load_n(&slot->length, __ATOMIC_RELAXED) != length)
+        return 0;
+
+    uint64_t words[PATH_WORDS];
+    path_to_words(path, length, words);
+    for (size_t i = 0; i < (length + sizeof(uint64_t) - 1) / sizeof(uint64_t); ++i) {
+        if (__atomic_load_n(&slot->words[i], __ATOMIC_RELAXED) != words[i])
+            return 0;
+    }
+    for (size_t i = 0; i < depth; ++i) {
+        vertices[i] = __atomic_load_n(&slot->vertices[i], __ATOMIC_RELAXED);
+        generations[i] = __atomic_load_n(&slot->generations[i], __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        return 0;
+    return depth;
+}
+
+
+void dcache_insert(DCache *cache, const char *path, size_t length, uint64_t hash,
+                   void *const *vertices, const uint32_t *generations, size_t depth) {
+    if (length > DCACHE_MAX_PATH || depth == 0 || depth > DCACHE_MAX_DEPTH)
+        return;
+    Slot *slot = &cache->slots[hash & cache->mask];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    uint64_t words[PATH_WORDS];
+    path_to_words(path, length, words);
+    __atomic_store_n(&slot->depth, depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->length, length, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < PATH_WORDS; ++i)
+        __atomic_store_n(&slot->words[i], words[i], __ATOMIC_RELAXED);
+    for (size_t i = 0; i < depth; ++i) {
+        __atomic_store_n(&slot->vertices[i], vertices[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->generations[i], generations[i], __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Concurrent cache from paths to the vertices on them, in the spirit of the
+// Linux dentry cache. An entry keeps every vertex on the path together with
+// the generation the vertex had when the entry was made; the user checks
+// those generations to know whether the entry still holds.
+// Every slot holds one entry, a new entry simply replaces an old one.
+typedef struct DCache DCache;
+
+// Longest path (in bytes) and deepest path (in components) which is cached.
+#define DCACHE_MAX_PATH 256
+#define DCACHE_MAX_DEPTH 32
+
+// Creates a cache with at least `entries` slots.
+DCache *dcache_new(size_t entries);
+
+void dcache_free(DCache *cache);
+
+// Looks up a path of given length and hash (see `hmap_hash`). On success
+// copies its vertices and their generations and returns their number.
+// Returns 0 if the path isn't cached.
+size_t dcache_lookup(DCache *cache, const char *path, size_t length, uint64_t hash,
+                     void **vertices, uint32_t *generations);
+
+// Caches a path with `depth` vertices, at most DCACHE_MAX_DEPTH, and length
+// at most DCACHE_MAX_PATH. Gives up if another thread changes the slot.
+void dcache_insert(DCache *cache, const char *path, size_t length, uint64_t hash,
+                   void *const *vertices, const uint32_t *generations, size_t depth);
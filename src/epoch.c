@@ -0,0 +1,246 @@
+#include "epoch.h"
+#include "utils.h"
+#include "err.h"
+#include "reclaim.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Memory retired in epoch `e` may be used only by readers which entered
+// their critical sections in epoch `e` or earlier. The global epoch can move
+// from `e` to `e + 1` only when every reader inside a critical section has
+// seen `e`, so once it reaches `e + 2` all those readers are gone.
+
+// A thread tries to advance the epoch every RETIRE_BATCH retired objects.
+// Retired objects are released in batches of that size.
+#define RETIRE_BATCH 64
+
+typedef struct {
+    void (*release)(void *, void *);
+    void *ctx;
+    void *ptr;
+    uint64_t epoch; // Global epoch at the moment `ptr` was retired.
+} Retired;
+
+typedef struct Record Record;
+
+// Per-thread state. Records are never freed, a record of a finished thread
+// is reused by the next new thread (together with its retired objects).
+struct Record {
+    // Epoch seen by the thread in its critical section, 0 outside of one.
+    // Kept on its own cache line, as it is written on every epoch_enter().
+    _Alignas(64) uint64_t active;
+    unsigned nesting;
+    unsigned since_poll;
+    bool in_use;
+    Record *next;
+
+    // Protects the retired objects, which other threads may release too.
+    pthread_mutex_t lock;
+    Retired *retired;
+    size_t head, count, capacity;
+    // Batches taken out of `retired` and not released yet.
+    unsigned releasing;
+    // Whether the reclamation thread is asked to release objects.
+    bool poll_queued;
+};
+
+static uint64_t global_epoch = 1;
+static Record *records;
+
+static _Thread_local Record *my_record;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+
+static void release_safe(Record *record);
+
+
+static void record_destructor(void *arg) {
+    Record *record = arg;
+    record->nesting = 0;
+    __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+    release_safe(record);
+    __atomic_store_n(&record->in_use, false, __ATOMIC_RELEASE);
+}
+
+
+static void create_record_key(void) {
+    if (pthread_key_create(&record_key, record_destructor) != 0)
+        fatal("Key create failed.");
+}
+
+
+static Record *get_record(void) {
+    if (my_record)
+        return my_record;
+
+    Record *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; record; record = record->next) {
+        bool expected = false;
+        if (!__atomic_load_n(&record->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&record->in_use, &expected, true, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!record) {
+        record = aligned_alloc(_Alignof(Record), sizeof(Record));
+        if (!record)
+            fatal("Malloc failed.");
+        memset(record, 0, sizeof(Record));
+        record->in_use = true;
+        safe_mutex_init(&record->lock);
+        record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &record->next, record, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_once(&record_key_once, create_record_key);
+    if (pthread_setspecific(record_key, record) != 0)
+        fatal("Set specific failed.");
+    my_record = record;
+    return record;
+}
+
+
+void epoch_enter(void) {
+    Record *record = get_record();
+    if (record->nesting++ > 0)
+        return;
+    // Announce the current epoch. If it changes before the announcement is
+    // visible, announce the newer one, so we don't hold back reclamation.
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    while (true) {
+        __atomic_store_n(&record->active, epoch, __ATOMIC_SEQ_CST);
+        uint64_t current = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        if (current == epoch)
+            break;
+        epoch = current;
+    }
+}
+
+
+void epoch_exit(void) {
+    Record *record = my_record;
+    if (--record->nesting == 0)
+        __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+}
+
+
+static bool try_advance(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (Record *r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t active = __atomic_load_n(&r->active, __ATOMIC_SEQ_CST);
+        if (active != 0 && active != epoch)
+            return false;
+    }
+    return __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+
+// Releases retired objects of `record` which no reader can use anymore.
+static void release_safe(Record *record) {
+    Retired batch[RETIRE_BATCH];
+    size_t n;
+    do {
+        uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        n = 0;
+        safe_lock(&record->lock);
+        while (record->head < record->count && n < RETIRE_BATCH
+               && record->retired[record->head].epoch + 2 <= epoch)
+            batch[n++] = record->retired[record->head++];
+        if (record->head == record->count)
+            record->head = record->count = 0;
+        if (n > 0)
+            __atomic_fetch_add(&record->releasing, 1, __ATOMIC_RELAXED);
+        safe_unlock(&record->lock);
+
+        // Release outside of the lock, as releasing may retire more memory.
+        for (size_t i = 0; i < n; ++i)
+            batch[i].release(batch[i].ctx, batch[i].ptr);
+        if (n > 0)
+            __atomic_fetch_sub(&record->releasing, 1, __ATOMIC_RELEASE);
+    } while (n == RETIRE_BATCH);
+}
+
+
+static void poll_record(void *arg) {
+    Record *record = arg;
+    __atomic_store_n(&record->poll_queued, false, __ATOMIC_RELEASE);
+    try_advance();
+    release_safe(record);
+}
+
+
+void epoch_retire(void (*release)(void *ctx, void *ptr), void *ctx, void *ptr) {
+    Record *record = get_record();
+    safe_lock(&record->lock);
+    if (record->count == record->capacity) {
+        if (record->head > 0) {
+            record->count -= record->head;
+            memmove(record->retired, record->retired + record->head,
+                    record->count * sizeof(Retired));
+            record->head = 0;
+        }
+        else {
+            record->capacity = record->capacity ? record->capacity * 2 : RETIRE_BATCH;
+            record->retired = realloc(record->retired, record->capacity * sizeof(Retired));
+            if (!record->retired)
+                fatal("Realloc failed.");
+        }
+    }
+    Retired *retired = &record->retired[record->count++];
+    retired->release = release;
+    retired->ctx = ctx;
+    retired->ptr = ptr;
+    retired->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    safe_unlock(&record->lock);
+
+    // Releasing is left to the reclamation thread, as the caller might hold
+    // locks.
+    if (++record->since_poll >= RETIRE_BATCH) {
+        record->since_poll = 0;
+        if (!__atomic_exchange_n(&record->poll_queued, true, __ATOMIC_ACQ_REL))
+            reclaim_defer(poll_record, record);
+    }
+}
+
+
+static void release_with_free(void *ctx, void *ptr) {
+    (void) ctx;
+    free(ptr);
+}
+
+
+void epoch_retire_free(void *ptr) {
+    epoch_retire(release_with_free, NULL, ptr);
+}
+
+
+void epoch_poll(void) {
+    try_advance();
+    release_safe(get_record());
+}
+
+
+void epoch_barrier(void) {
+    uint64_t target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+    while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) < target) {
+        if (!try_advance())
+            sched_yield();
+    }
+    Record *first = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (Record *r = first; r; r = r->next)
+        release_safe(r);
+    // Other threads may still be releasing batches they took out.
+    for (Record *r = first; r; r = r->next) {
+        while (__atomic_load_n(&r->releasing, __ATOMIC_ACQUIRE) > 0)
+            sched_yield();
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Epoch based reclamation.
+// Threads which read shared structures without locks do it between
+// epoch_enter() and epoch_exit(). Memory which such readers may still see is
+// given to epoch_retire() instead of being freed, and is released only when
+// every reader which could have seen it has left its critical section.
+// Readers only write to their own per-thread record.
+
+// Starts a read-side critical section. Sections can be nested.
+void epoch_enter(void);
+
+// Finishes a read-side critical section.
+void epoch_exit(void);
+
+// Calls `release(ctx, ptr)` once no reader can use `ptr` anymore. Retired
+// objects are released by the background reclamation thread (see
+// reclaim.h), or by epoch_poll() and epoch_barrier().
+void epoch_retire(void (*release)(void *ctx, void *ptr), void *ctx, void *ptr);
+
+// Retires memory allocated with malloc, which is then released with free.
+void epoch_retire_free(void *ptr);
+
+// Releases retired memory which is already safe to release.
+void epoch_poll(void);
+
+// Waits until everything retired before the call is released.
+// Must not be called inside a read-side critical section.
+void epoch_barrier(void);
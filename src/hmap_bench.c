@@ -0,0 +1,76 @@
+#include "HashMap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Measures hmap_get throughput against the number of entries in the map,
+// i.e. against the fan-out of a directory.
+
+#define NAME_LENGTH 12
+#define LOOKUPS 4000000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void random_name(char* name)
+{
+    for (int i = 0; i < NAME_LENGTH; ++i)
+        name[i] = 'a' + rand() % 26;
+    name[NAME_LENGTH] = '\0';
+}
+
+// Returns lookups per second when querying `n_lookups` keys from `keys`.
+static double bench_lookups(HashMap* map, char (*keys)[NAME_LENGTH + 1],
+                            size_t n_keys, size_t n_lookups, size_t* found)
+{
+    double start = now();
+    size_t hits = 0;
+    size_t k = 0;
+    for (size_t i = 0; i < n_lookups; ++i) {
+        if (hmap_get(map, keys[k]))
+            hits++;
+        k = (k + 7919) % n_keys; // Visit keys in a scattered order.
+    }
+    *found = hits;
+    return n_lookups / (now() - start);
+}
+
+int main(void)
+{
+    static const size_t fan_outs[] = { 8, 64, 512, 4096, 32768, 131072 };
+    srand(42);
+    printf("%10s %16s %16s\n", "fan-out", "hits/s", "misses/s");
+    for (size_t f = 0; f < sizeof(fan_outs) / sizeof(fan_outs[0]); ++f) {
+        size_t n = fan_outs[f];
+        char (*keys)[NAME_LENGTH + 1] = malloc(n * sizeof(*keys));
+        char (*absent)[NAME_LENGTH + 1] = malloc(n * sizeof(*absent));
+        HashMap* map = hmap_new();
+        for (size_t i = 0; i < n; ++i) {
+            do
+                random_name(keys[i]);
+            while (!hmap_insert(map, keys[i], keys[i]));
+        }
+        for (size_t i = 0; i < n; ++i) {
+            do
+                random_name(absent[i]);
+            while (hmap_get(map, absent[i]));
+        }
+
+        size_t found_hits, found_misses;
+        double hits = bench_lookups(map, keys, n, LOOKUPS, &found_hits);
+        double misses = bench_lookups(map, absent, n, LOOKUPS, &found_misses);
+        if (found_hits != LOOKUPS || found_misses != 0)
+            fprintf(stderr, "Unexpected lookup results for fan-out %zu.\n", n);
+        printf("%10zu %16.0f %16.0f\n", n, hits, misses);
+
+        hmap_free(map);
+        free(keys);
+        free(absent);
+    }
+    return 0;
+}
@@ -0,0 +1,453 @@
+#include "journal.h"
+#include "treefile.h"
+#include "utils.h"
+#include "err.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Records are kept in one of JOURNAL_STRIPES buffers, picked by thread, so
+// recording threads rarely wait for each other.
+#define JOURNAL_STRIPES 16
+
+typedef struct {
+    unsigned char *data;
+    size_t used, capacity;
+} Buffer;
+
+// A record kept in a stripe, followed by its paths. Entries are aligned
+// for uint64_t.
+typedef struct {
+    uint64_t number;
+    uint32_t length;        // Length of the path.
+    uint32_t target_length; // Length of the target path of a move.
+    uint8_t op;
+    char paths[];
+} Entry;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    Buffer records;
+} Stripe;
+
+struct Journal {
+    int fd;
+    TreeJournalOptions options;
+    // Number of the next record, taken in the lock of the record's stripe,
+    // so every record with a lower number is already in its stripe.
+    uint64_t next;
+    Stripe stripes[JOURNAL_STRIPES];
+
+    pthread_mutex_t lock; // Protects the fields below, except `idle`.
+    pthread_cond_t wake;   // Wakes the flusher.
+    pthread_cond_t synced; // Signalled when `durable` grows.
+    bool idle; // Whether the flusher sleeps until something is recorded.
+    bool stopping;
+    uint64_t durable; // Records with lower numbers are synced (or dropped).
+    int error;        // First error of writing or syncing.
+    size_t waiters;   // Threads which will wait for their records.
+    pthread_t flusher;
+
+    // Used only by the flusher.
+    uint64_t written; // Records with lower numbers are written out.
+    Buffer taken;     // Entries taken from the stripes and not written yet.
+    Buffer order;     // Entries of the batch, sorted.
+    Buffer payload;
+    TreeFileWriter *writer;
+};
+
+// Changes recorded by this thread which it will wait for.
+static _Thread_local struct {
+    Journal *journal;
+    uint64_t number;
+} pending;
+
+static _Thread_local unsigned my_stripe;
+static unsigned next_stripe;
+
+
+static void reserve(Buffer *buffer, size_t size) {
+    if (buffer->capacity - buffer->used >= size)
+        return;
+    while (buffer->capacity - buffer->used < size)
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    if (!buffer->data)
+        fatal("Realloc failed.");
+}
+
+
+static void put_bytes(Buffer *buffer, const void *bytes, size_t length) {
+    reserve(buffer, length);
+    memcpy(buffer->data + buffer->used, bytes, length);
+    buffer->used += length;
+}
+
+
+static void put_varint(Buffer *buffer, uint64_t value) {
+    reserve(buffer, 10);
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        buffer->data[buffer->used++] = value ? byte | 0x80 : byte;
+    } while (value);
+}
+
+
+static uint64_t fnv1a(const unsigned char *bytes, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static size_t entry_size(const Entry *entry) {
+    size_t size = sizeof(Entry) + entry->length + entry->target_length;
+    return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+
+static void broadcast(pthread_cond_t *cond) {
+    if (pthread_cond_broadcast(cond) != 0)
+        fatal("Cond broadcast failed.");
+}
+
+
+static int compare_entries(const void *p1, const void *p2) {
+    const Entry *e1 = *(Entry *const *) p1;
+    const Entry *e2 = *(Entry *const *) p2;
+    return (e1->number > e2->number) - (e1->number < e2->number);
+}
+
+
+// Writes out and syncs one batch of all records numbered below `next`.
+static void flush(Journal *journal) {
+    uint64_t target = __atomic_load_n(&journal->next, __ATOMIC_SEQ_CST);
+    if (target == journal->written)
+        return;
+
+    Buffer *taken = &journal->taken;
+    for (size_t i = 0; i < JOURNAL_STRIPES; ++i) {
+        Stripe *stripe = &journal->stripes[i];
+        safe_lock(&stripe->lock);
+        if (stripe->records.used > 0)
+            put_bytes(taken, stripe->records.data, stripe->records.used);
+        stripe->records.used = 0;
+        safe_unlock(&stripe->lock);
+    }
+
+    // Records numbered `target` or more may still miss earlier ones, so
+    // they wait for the next batch.
+    Buffer *order = &journal->order;
+    order->used = 0;
+    for (size_t offset = 0; offset < taken->used; ) {
+        Entry *entry = (Entry *) (taken->data + offset);
+        if (entry->number < target)
+            put_bytes(order, &entry, sizeof(Entry *));
+        offset += entry_size(entry);
+    }
+    Entry **entries = (Entry **) order->data;
+    size_t count = order->used / sizeof(Entry *);
+    if (count != target - journal->written)
+        fatal("Journal records missing.");
+    qsort(entries, count, sizeof(Entry *), compare_entries);
+
+    Buffer *payload = &journal->payload;
+    payload->used = 0;
+    put_varint(payload, journal->written);
+    put_varint(payload, count);
+    for (size_t i = 0; i < count; ++i) {
+        Entry *entry = entries[i];
+        put_bytes(payload, &entry->op, 1);
+        put_varint(payload, entry->length);
+        put_bytes(payload, entry->paths, entry->length);
+        if (entry->op == JOURNAL_MOVE) {
+            put_varint(payload, entry->target_length);
+            put_bytes(payload, entry->paths + entry->length, entry->target_length);
+        }
+    }
+
+    // The error is read without the lock, as only the flusher sets it.
+    int error = journal->error;
+    if (!error) {
+        unsigned char hash[8];
+        uint64_t value = fnv1a(payload->data, payload->used);
+        for (size_t i = 0; i < 8; ++i)
+            hash[i] = value >> (8 * i);
+        treefile_put_varint(journal->writer, payload->used);
+        treefile_put_bytes(journal->writer, hash, sizeof(hash));
+        treefile_put_bytes(journal->writer, payload->data, payload->used);
+        error = treefile_writer_finish(journal->writer);
+        if (!error && fdatasync(journal->fd) != 0)
+            error = errno;
+    }
+
+    size_t kept = 0;
+    for (size_t offset = 0; offset < taken->used; ) {
+        Entry *entry = (Entry *) (taken->data + offset);
+        size_t size = entry_size(entry);
+        if (entry->number >= target) {
+            memmove(taken->data + kept, entry, size);
+            kept += size;
+        }
+        offset += size;
+    }
+    taken->used = kept;
+    journal->written = target;
+
+    safe_lock(&journal->lock);
+    journal->durable = target;
+    if (!journal->error)
+        journal->error = error;
+    broadcast(&journal->synced);
+    safe_unlock(&journal->lock);
+}
+
+
+static void *flusher_thread(void *arg) {
+    Journal *journal = arg;
+    safe_lock(&journal->lock);
+    while (!journal->stopping) {
+        unsigned interval = journal->options.sync_interval_us;
+        if (interval > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += interval / 1000000;
+            deadline.tv_nsec += (long) (interval % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            int res = pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+            if (res != 0 && res != ETIMEDOUT)
+                fatal("Cond timed wait failed.");
+        }
+        else {
+            // Recording threads read `idle` after taking a number, and the
+            // flusher reads the number after setting `idle`, so one of them
+            // sees the other.
+            __atomic_store_n(&journal->idle, true, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&journal->next, __ATOMIC_SEQ_CST) == journal->written
+                && !journal->stopping)
+                safe_wait(&journal->wake, &journal->lock);
+            __atomic_store_n(&journal->idle, false, __ATOMIC_RELAXED);
+        }
+        safe_unlock(&journal->lock);
+        flush(journal);
+        safe_lock(&journal->lock);
+    }
+    safe_unlock(&journal->lock);
+    flush(journal);
+    return NULL;
+}
+
+
+Journal *journal_new(int fd, const TreeJournalOptions *options) {
+    Journal *journal = aligned_alloc(_Alignof(Journal), sizeof(Journal));
+    if (!journal)
+        fatal("Malloc failed.");
+    memset(journal, 0, sizeof(Journal));
+    journal->fd = fd;
+    if (options)
+        journal->options = *options;
+    for (size_t i = 0; i < JOURNAL_STRIPES; ++i)
+        safe_mutex_init(&journal->stripes[i].lock);
+    safe_mutex_init(&journal->lock);
+    safe_cond_init(&journal->wake);
+    safe_cond_init(&journal->synced);
+    journal->writer = safe_malloc(sizeof(TreeFileWriter));
+    treefile_writer_init(journal->writer, fd);
+    return journal;
+}
+
+
+void journal_start(Journal *journal, uint64_t next) {
+    journal->next = next;
+    journal->durable = next;
+    journal->written = next;
+    if (pthread_create(&journal->flusher, NULL, flusher_thread, journal) != 0)
+        fatal("Thread create failed.");
+}
+
+
+int journal_free(Journal *journal) {
+    safe_lock(&journal->lock);
+    journal->stopping = true;
+    safe_signal(&journal->wake);
+    safe_unlock(&journal->lock);
+    if (pthread_join(journal->flusher, NULL) != 0)
+        fatal("Thread join failed.");
+
+    safe_lock(&journal->lock);
+    while (journal->waiters > 0)
+        safe_wait(&journal->synced, &journal->lock);
+    int error = journal->error;
+    safe_unlock(&journal->lock);
+
+    for (size_t i = 0; i < JOURNAL_STRIPES; ++i) {
+        safe_mutex_destroy(&journal->stripes[i].lock);
+        free(journal->stripes[i].records.data);
+    }
+    safe_mutex_destroy(&journal->lock);
+    safe_cond_destroy(&journal->wake);
+    safe_cond_destroy(&journal->synced);
+    free(journal->taken.data);
+    free(journal->order.data);
+    free(journal->payload.data);
+    free(journal->writer);
+    free(journal);
+    return error;
+}
+
+
+uint64_t journal_next(const Journal *journal) {
+    return __atomic_load_n(&journal->next, __ATOMIC_SEQ_CST);
+}
+
+
+
+void journal_record(Journal *journal, JournalOp op, const char *prefix,
+                    const char *path, const char *target) {
+    // A prefix ends with '/' and a path starts with it, one of them is left.
+    size_t prefix_length = prefix ? strlen(prefix) - 1 : 0;
+    size_t path_length = strlen(path);
+    Entry header = {
+        .length = prefix_length + path_length,
+        .target_length = target ? strlen(target) : 0,
+        .op = op,
+    };
+    size_t size = entry_size(&header);
+
+    if (my_stripe == 0)
+        my_stripe = __atomic_add_fetch(&next_stripe, 1, __ATOMIC_RELAXED);
+    Stripe *stripe = &journal->stripes[my_stripe % JOURNAL_STRIPES];
+    safe_lock(&stripe->lock);
+    reserve(&stripe->records, size);
+    Entry *entry = (Entry *) (stripe->records.data + stripe->records.used);
+    *entry = header;
+    entry->number = __atomic_fetch_add(&journal->next, 1, __ATOMIC_SEQ_CST);
+    if (prefix)
+        memcpy(entry->paths, prefix, prefix_length);
+    memcpy(entry->paths + prefix_length, path, path_length);
+    if (target)
+        memcpy(entry->paths + header.length, target, header.target_length);
+    stripe->records.used += size;
+    safe_unlock(&stripe->lock);
+
+    if (__atomic_load_n(&journal->idle, __ATOMIC_SEQ_CST)) {
+        safe_lock(&journal->lock);
+        safe_signal(&journal->wake);
+        safe_unlock(&journal->lock);
+    }
+
+    if (journal->options.wait_durable) {
+        // Rarely, the journal is replaced in the middle of a batch of
+        // changes. The flusher doesn't need any locks of the tree, so waiting
+        // for the old journal here is safe.
+        if (pending.journal && pending.journal != journal)
+            journal_wait_pending();
+        if (!pending.journal) {
+            safe_lock(&journal->lock);
+            journal->waiters++;
+            safe_unlock(&journal->lock);
+            pending.journal = journal;
+        }
+        pending.number = entry->number;
+    }
+}
+
+
+void journal_wait_pending(void) {
+    Journal *journal = pending.journal;
+    if (!journal)
+        return;
+    pending.journal = NULL;
+    safe_lock(&journal->lock);
+    while (journal->durable <= pending.number)
+        safe_wait(&journal->synced, &journal->lock);
+    if (--journal->waiters == 0 && journal->stopping)
+        broadcast(&journal->synced);
+    safe_unlock(&journal->lock);
+}
+
+
+int journal_sync(Journal *journal) {
+    uint64_t target = __atomic_load_n(&journal->next, __ATOMIC_SEQ_CST);
+    safe_lock(&journal->lock);
+    // Don't wait for the next interval.
+    safe_signal(&journal->wake);
+    while (journal->durable < target)
+        safe_wait(&journal->synced, &journal->lock);
+    int error = journal->error;
+    safe_unlock(&journal->lock);
+    return error;
+}
+
+
+// Reads a path of a record into `buffer`, as a null-terminated string.
+static bool read_path(TreeFileReader *reader, Buffer *buffer) {
+    uint64_t length;
+    const unsigned char *bytes;
+    if (!treefile_get_varint(reader, &length) || !treefile_get_bytes(reader, length, &bytes))
+        return false;
+    buffer->used = 0;
+    put_bytes(buffer, bytes, length);
+    put_bytes(buffer, "", 1);
+    return true;
+}
+
+
+int journal_replay(int fd,
+                   int (*apply)(void *ctx, uint64_t number, JournalOp op,
+                                const char *path, const char *target),
+                   void *ctx) {
+    TreeFileReader reader;
+    int err = treefile_reader_open(&reader, fd);
+    if (err)
+        return err;
+
+    Buffer path = { .data = NULL, .used = 0, .capacity = 0 };
+    Buffer target = path;
+    while (err == 0) {
+        uint64_t length;
+        const unsigned char *hash, *payload;
+        if (!treefile_get_varint(&reader, &length)
+            || !treefile_get_bytes(&reader, 8, &hash)
+            || !treefile_get_bytes(&reader, length, &payload))
+            break;
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; ++i)
+            value |= (uint64_t) hash[i] << (8 * i);
+        if (value != fnv1a(payload, length))
+            break;
+
+        TreeFileReader batch = { .data = payload, .size = length, .position = 0,
+                                 .mapping = NULL };
+        uint64_t first, count;
+        if (!treefile_get_varint(&batch, &first) || !treefile_get_varint(&batch, &count))
+            break;
+        for (uint64_t i = 0; err == 0 && i < count; ++i) {
+            const unsigned char *op;
+            if (!treefile_get_bytes(&batch, 1, &op) || *op > JOURNAL_MOVE
+                || !read_path(&batch, &path)
+                || (*op == JOURNAL_MOVE && !read_path(&batch, &target))) {
+                err = EINVAL;
+                break;
+            }
+            err = apply(ctx, first + i, *op, (const char *) path.data,
+                        *op == JOURNAL_MOVE ? (const char *) target.data : NULL);
+        }
+    }
+    free(path.data);
+    free(target.data);
+    treefile_reader_close(&reader);
+    return err;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Tree.h"
+
+#include <stdint.h>
+
+// Append-only journal of changes of a tree (see tree_journal_start()).
+// Changes are recorded in the critical sections which make them, so the
+// order of their numbers agrees with the order in which they happened, and a
+// background thread writes them out in batches, each followed by one sync.
+//
+// A journal is a sequence of batches. A batch is the length of its payload,
+// an FNV-1a hash of the payload (8 bytes, little endian) and the payload: the
+// number of its first record, the number of records and the records. A record
+// is its type (one byte) and its path, followed by the target path for moves;
+// a path is its length and its characters. Numbers are unsigned LEB128
+// varints. A batch cut short or damaged by a crash ends the journal.
+
+typedef enum {
+    JOURNAL_CREATE,
+    JOURNAL_REMOVE,
+    JOURNAL_REMOVE_RECURSIVE,
+    JOURNAL_MOVE,
+} JournalOp;
+
+typedef struct Journal Journal;
+
+// Makes a journal appending to `fd`.
+Journal *journal_new(int fd, const TreeJournalOptions *options);
+
+// Starts writing out records of the journal, the first of which has number
+// `next`. Nothing may be recorded before.
+void journal_start(Journal *journal, uint64_t next);
+
+// Writes out all records, stops a started journal and frees it. Returns 0
+// or the first error of writing or syncing the journal.
+int journal_free(Journal *journal);
+
+// Number of the next record. May be used only while nothing is recorded.
+uint64_t journal_next(const Journal *journal);
+
+// Records a change of `path`, which is relative to `prefix` if it isn't NULL.
+// `target` is the target of a move (and NULL for other changes).
+void journal_record(Journal *journal, JournalOp op, const char *prefix,
+                    const char *path, const char *target);
+
+// For journals which wait for durability, waits until the changes recorded
+// by the calling thread are synced.
+void journal_wait_pending(void);
+
+// Waits until everything recorded so far is synced. Returns 0 or the first
+// error of writing or syncing the journal.
+int journal_sync(Journal *journal);
+
+// Calls `apply` for every record of the journal read from `fd`, in order,
+// with its number. Stops at the end or at a batch cut short or damaged.
+// Returns 0, an errno value if `fd` can't be read, or the first non-zero
+// result of `apply`.
+int journal_replay(int fd,
+                   int (*apply)(void *ctx, uint64_t number, JournalOp op,
+                                const char *path, const char *target),
+                   void *ctx);
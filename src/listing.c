@@ -0,0 +1,158 @@
+#include "listing.h"
+#include "path_utils.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Made before main() starts, and holding its one reference forever.
+static Listing *empty_listing;
+
+// Offset of `starts` in a listing with given length, right after the string,
+// aligned for uint32_t.
+static size_t starts_offset(size_t length) {
+    return (sizeof(Listing) + length + 1 + sizeof(uint32_t) - 1)
+           / sizeof(uint32_t) * sizeof(uint32_t);
+}
+
+Listing *listing_alloc(size_t count, size_t length, uint64_t version) {
+    size_t offset = starts_offset(length);
+    Listing *listing = safe_malloc(offset + (count + 1) * sizeof(uint32_t));
+    listing->version = version;
+    listing->refs = 1;
+    listing->count = count;
+    listing->length = length;
+    listing->starts = (uint32_t *) ((char *) listing + offset);
+    listing->starts[count] = length + 1;
+    listing->string[length] = '\0';
+    return listing;
+}
+
+Listing *listing_new(HashMap *map, uint64_t version) {
+    const char **keys = make_map_contents_array(map);
+    size_t count = 0, length = 0;
+    for (const char **key = keys; *key; ++key) {
+        length += strlen(*key) + 1;
+        count++;
+    }
+    if (length > 0)
+        length--; // No comma after the last name.
+
+    Listing *listing = listing_alloc(count, length, version);
+    char *position = listing->string;
+    for (size_t i = 0; i < count; ++i) {
+        size_t key_length = strlen(keys[i]);
+        listing->starts[i] = position - listing->string;
+        memcpy(position, keys[i], key_length);
+        position += key_length;
+        *position++ = ',';
+    }
+    listing->string[length] = '\0'; // Overwrites the last comma.
+    free(keys);
+    return listing;
+}
+
+typedef struct {
+    const char *name;
+    size_t length;
+} Name;
+
+static int compare_names(const void *p1, const void *p2) {
+    const Name *n1 = p1, *n2 = p2;
+    int res = memcmp(n1->name, n2->name, n1->length < n2->length ? n1->length : n2->length);
+    if (res == 0 && n1->length != n2->length)
+        res = n1->length < n2->length ? -1 : 1;
+    return res;
+}
+
+Listing *listing_merge(Listing *const *parts, size_t n, uint64_t version) {
+    size_t count = 0, length = 0;
+    for (size_t k = 0; k < n; ++k) {
+        count += parts[k]->count;
+        length += parts[k]->count > 0 ? parts[k]->length + 1 : 0;
+    }
+    if (length > 0)
+        length--;
+
+    Name *names = safe_malloc(count * sizeof(Name) + 1);
+    size_t i = 0;
+    for (size_t k = 0; k < n; ++k) {
+        for (size_t j = 0; j < parts[k]->count; ++j) {
+            names[i].name = parts[k]->string + parts[k]->starts[j];
+            names[i].length = parts[k]->starts[j + 1] - parts[k]->starts[j] - 1;
+            i++;
+        }
+    }
+    qsort(names, count, sizeof(Name), compare_names);
+
+    Listing *listing = listing_alloc(count, length, version);
+    char *position = listing->string;
+    for (i = 0; i < count; ++i) {
+        listing->starts[i] = position - listing->string;
+        memcpy(position, names[i].name, names[i].length);
+        position += names[i].length;
+        if (i + 1 < count)
+            *position++ = ',';
+    }
+    free(names);
+    return listing;
+}
+
+__attribute__((constructor)) static void init_empty_listing(void) {
+    empty_listing = listing_alloc(0, 0, 0);
+}
+
+Listing *listing_empty(void) {
+    return empty_listing;
+}
+
+size_t listing_size(const Listing *listing) {
+    return starts_offset(listing->length) + (listing->count + 1) * sizeof(uint32_t);
+}
+
+void listing_ref(Listing *listing) {
+    __atomic_fetch_add(&listing->refs, 1, __ATOMIC_RELAXED);
+}
+
+void listing_unref(Listing *listing) {
+    if (listing && __atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(listing);
+}
+
+char *listing_string(const Listing *listing) {
+    char *result = safe_malloc(listing->length + 1);
+    memcpy(result, listing->string, listing->length + 1);
+    return result;
+}
+
+// Compares i-th name of the listing with `name`, like strcmp() would.
+static int compare_name(const Listing *listing, size_t i, const char *name,
+                        size_t length) {
+    size_t own_length = listing->starts[i + 1] - listing->starts[i] - 1;
+    int res = memcmp(listing->string + listing->starts[i], name,
+                     own_length < length ? own_length : length);
+    if (res == 0 && own_length != length)
+        res = own_length < length ? -1 : 1;
+    return res;
+}
+
+size_t listing_upper_bound(const Listing *listing, const char *name, size_t length) {
+    size_t begin = 0, end = listing->count;
+    while (begin < end) {
+        size_t middle = begin + (end - begin) / 2;
+        if (compare_name(listing, middle, name, length) <= 0)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+    return begin;
+}
+
+char *listing_range_string(const Listing *listing, size_t first, size_t limit) {
+    size_t last = first + (limit < listing->count - first ? limit : listing->count - first);
+    size_t length = first < last ? listing->starts[last] - listing->starts[first] - 1 : 0;
+    char *result = safe_malloc(length + 1);
+    memcpy(result, listing->string + (first < last ? listing->starts[first] : 0), length);
+    result[length] = '\0';
+    return result;
+}
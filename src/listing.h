@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "HashMap.h"
+
+// Sorted, comma-separated names of a folder's children, made once and then
+// shared by all lists of the folder until its map changes. A listing is never
+// modified after it is made. Snapshots keep listings after their folder
+// changes, so a listing is freed when its last reference is dropped.
+typedef struct {
+    uint64_t version; // Version of the map it was made from.
+    uint32_t refs;
+    size_t count;     // Number of names.
+    size_t length;    // Length of `string`, excluding terminating null character.
+    // Offsets of names in `string`, with `starts[count]` equal to length + 1.
+    uint32_t *starts;
+    char string[];
+} Listing;
+
+// Makes a listing of keys in map, with one reference. Until it is shared,
+// the caller may also simply free it.
+Listing *listing_new(HashMap *map, uint64_t version);
+
+// Allocates a listing of `count` names, which take `length` characters of
+// `string` together with commas, with one reference. The caller should fill
+// `string` and `starts[0..count - 1]`.
+Listing *listing_alloc(size_t count, size_t length, uint64_t version);
+
+// Makes a listing of all names of `n` listings, which have no names in common,
+// with one reference.
+Listing *listing_merge(Listing *const *parts, size_t n, uint64_t version);
+
+// Returns a listing without names, shared by the whole process and never
+// freed, so references to it may be taken and dropped as usual.
+Listing *listing_empty(void);
+
+// Returns the number of bytes allocated for the listing.
+size_t listing_size(const Listing *listing);
+
+void listing_ref(Listing *listing);
+
+// Drops a reference, freeing the listing if it was the last one.
+void listing_unref(Listing *listing);
+
+// Returns a copy of the listing's string. The caller should free the result.
+char *listing_string(const Listing *listing);
+
+// Returns index of the first name greater than `name` (of given length),
+// or `count` if there is no such name.
+size_t listing_upper_bound(const Listing *listing, const char *name, size_t length);
+
+// Returns a string of at most `limit` names starting with the `first` one,
+// comma-separated. The caller should free the result.
+char *listing_range_string(const Listing *listing, size_t first, size_t limit);
@@ -1,29 +1,156 @@
 #include "path_utils.h"
+#include "utils.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-bool is_path_valid(const char *path) {
+// Paths are scanned in blocks of SCAN_BLOCK bytes with vector instructions,
+// if the target has any. The scalar code handles the tail shorter than
+// a block and whole paths on other targets.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_BLOCK 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_BLOCK 16
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCAN_BLOCK 16
+#endif
+
+// Maximal number of bytes scanned at once by the scalar code.
+#define SCALAR_BLOCK 32
+
+#ifdef SCAN_BLOCK
+// Sets bit i of `*slashes` iff p[i] is '/'. Returns false if any of
+// SCAN_BLOCK bytes at `p` is neither '/' nor a letter 'a'-'z'.
+static inline bool scan_block(const char *p, uint32_t *slashes) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+    // Signed comparison is enough, bytes above 127 are negative.
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+    *slashes = (uint32_t) _mm256_movemask_epi8(slash);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(slash, letter)) == UINT32_MAX;
+#elif defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+    *slashes = (uint32_t) _mm_movemask_epi8(slash);
+    return _mm_movemask_epi8(_mm_or_si128(slash, letter)) == 0xFFFF;
+#else
+    static const uint8_t bit[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                     1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t v = vld1q_u8((const uint8_t *) p);
+    uint8x16_t slash = vceqq_u8(v, vdupq_n_u8('/'));
+    uint8x16_t letter = vcleq_u8(vsubq_u8(v, vdupq_n_u8('a')), vdupq_n_u8('z' - 'a'));
+    uint8x16_t bits = vandq_u8(slash, vld1q_u8(bit));
+    *slashes = vaddv_u8(vget_low_u8(bits)) | (uint32_t) vaddv_u8(vget_high_u8(bits)) << 8;
+    return vminvq_u8(vorrq_u8(slash, letter)) != 0;
+#endif
+}
+#endif
+
+// Same as scan_block(), but for `n` bytes, at most SCALAR_BLOCK.
+static inline bool scan_bytes(const char *p, size_t n, uint32_t *slashes) {
+    *slashes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (p[i] == '/')
+            *slashes |= 1u << i;
+        else if (p[i] < 'a' || p[i] > 'z')
+            return false;
+    }
+    return true;
+}
+
+// Checks whether a path is valid and, if `parsed` isn't NULL, records its
+// components there. Vector instructions are used only if `vectorized`.
+static bool scan_path(const char *path, ParsedPath *parsed, bool vectorized) {
+    if (parsed) {
+        parsed->path = path;
+        parsed->count = 0;
+        parsed->components = parsed->inline_components;
+    }
     size_t len = strlen(path);
     if (len == 0 || len > MAX_PATH_LENGTH)
         return false;
     if (path[0] != '/' || path[len - 1] != '/')
         return false;
-    const char *name_start = path + 1; // Start of current path component, just after '/'.
-    while (name_start < path + len) {
-        char *name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-        if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
+    // Every component takes at least two characters.
+    if (parsed && len / 2 > PATH_INLINE_COMPONENTS)
+        parsed->components = safe_malloc(len / 2 * sizeof(PathComponent));
+
+    size_t name_start = 1; // Start of current path component, just after '/'.
+    for (size_t pos = 1; pos < len;) {
+        size_t n = len - pos;
+        uint32_t slashes;
+        bool valid;
+#ifdef SCAN_BLOCK
+        if (vectorized && n >= SCAN_BLOCK) {
+            n = SCAN_BLOCK;
+            valid = scan_block(path + pos, &slashes);
+        }
+        else
+#endif
+        {
+            (void) vectorized;
+            if (n > SCALAR_BLOCK)
+                n = SCALAR_BLOCK;
+            valid = scan_bytes(path + pos, n, &slashes);
+        }
+        if (!valid)
             return false;
-        for (const char *p = name_start; p != name_end; ++p)
-            if (*p < 'a' || *p > 'z')
+
+        // Every slash ends a component. The last byte is '/', so the length
+        // of every component gets checked.
+        while (slashes) {
+            size_t name_end = pos + __builtin_ctz(slashes);
+            slashes &= slashes - 1;
+            size_t length = name_end - name_start;
+            if (length == 0 || length > MAX_FOLDER_NAME_LENGTH)
                 return false;
-        name_start = name_end + 1;
+            if (parsed) {
+                PathComponent *component = &parsed->components[parsed->count++];
+                component->offset = name_start;
+                component->length = length;
+                component->hash = hmap_hash(path + name_start, length);
+            }
+            name_start = name_end + 1;
+        }
+        pos += n;
     }
     return true;
 }
 
+bool is_path_valid(const char *path) {
+    return scan_path(path, NULL, true);
+}
+
+bool is_path_valid_scalar(const char *path) {
+    return scan_path(path, NULL, false);
+}
+
+// Parses a path, leaving nothing to release if it isn't valid.
+static bool scan_parsed_path(const char *path, ParsedPath *parsed, bool vectorized) {
+    if (scan_path(path, parsed, vectorized))
+        return true;
+    path_release(parsed);
+    parsed->components = parsed->inline_components;
+    return false;
+}
+
+bool parse_path(const char *path, ParsedPath *parsed) {
+    return scan_parsed_path(path, parsed, true);
+}
+
+bool parse_path_scalar(const char *path, ParsedPath *parsed) {
+    return scan_parsed_path(path, parsed, false);
+}
+
 const char *split_path(const char *path, char *component) {
     const char *subpath = strchr(path + 1, '/'); // Pointer to second '/' character.
     if (!subpath) // Path is "/".
@@ -61,6 +188,19 @@ char *make_path_to_parent(const char *path, char *component) {
     return result;
 }
 
+size_t common_components(const ParsedPath *path1, const ParsedPath *path2, size_t limit) {
+    size_t i = 0;
+    while (i < limit && i < path1->count && i < path2->count) {
+        const PathComponent *c1 = &path1->components[i];
+        const PathComponent *c2 = &path2->components[i];
+        if (c1->hash != c2->hash || c1->length != c2->length
+            || memcmp(path_component_name(path1, i), path_component_name(path2, i), c1->length) != 0)
+            break;
+        i++;
+    }
+    return i;
+}
+
 // A wrapper for using strcmp in qsort.
 // The arguments here are actually pointers to (const char*).
 static int compare_string_pointers(const void *p1, const void *p2) {
@@ -73,11 +213,13 @@ const char **make_map_contents_array(HashMap *map) {
     HashMapIterator it = hmap_iterator(map);
     const char **key = result;
     void *value = NULL;
-    while (hmap_next(map, &it, key, &value)) {
+    // The bound matters only for readers racing with a writer, which may
+    // see more keys than hmap_size() reported.
+    while (key < result + n_keys && hmap_next(map, &it, key, &value)) {
         key++;
     }
     *key = NULL; // Set last array element to NULL.
-    qsort(result, n_keys, sizeof(char *), compare_string_pointers);
+    qsort(result, key - result, sizeof(char *), compare_string_pointers);
     return result;
 }
 
@@ -124,11 +266,18 @@ size_t common_files(const char *path1, const char *path2) {
 }
 
 size_t count_slashes(const char *path) {
-    size_t i = 0, res = 0;
-    while (path[i] != '\0') {
+    size_t len = strlen(path), i = 0, res = 0;
+#ifdef SCAN_BLOCK
+    // Invalid characters don't matter here, only the slash mask is used.
+    for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+        uint32_t slashes;
+        scan_block(path + i, &slashes);
+        res += __builtin_popcount(slashes);
+    }
+#endif
+    for (; i < len; ++i) {
         if (path[i] == '/')
             res++;
-        i++;
     }
     return res;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include "HashMap.h"
 
 // Max length of path (excluding terminating null character).
@@ -9,12 +11,18 @@
 // Max length of folder name (excluding terminating null character).
 #define MAX_FOLDER_NAME_LENGTH 255
 
+// Max number of folder names in a valid path.
+#define MAX_PATH_COMPONENTS (MAX_PATH_LENGTH / 2)
+
 // Return whether a path is valid.
 // Valid paths are '/'-separated sequences of folder names, always starting and ending with '/'.
 // Valid paths have length at most MAX_PATH_LENGTH (and at least 1). Valid folder names are are
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char *path);
 
+// Same as `is_path_valid`, but never uses vector instructions.
+bool is_path_valid_scalar(const char *path);
+
 // Return the subpath obtained by removing the first component.
 // Args:
 // - `path`: should be a valid path (see `is_path_valid`).
@@ -40,6 +48,52 @@ const char *split_path(const char *path, char *component);
 // Otherwise the result is a valid path.
 char *make_path_to_parent(const char *path, char *component);
 
+// A folder name inside a parsed path, together with its hash (see
+// `hmap_hash`), so that it is hashed only once however many maps it is
+// looked up in. The name starts at `path + offset` and isn't null-terminated.
+typedef struct {
+    uint64_t hash;
+    uint16_t offset;
+    uint16_t length;
+} PathComponent;
+
+// Number of components a parsed path holds without allocating memory.
+#define PATH_INLINE_COMPONENTS 32
+
+// A valid path split into its components, with no copies of the names.
+// `path` has to outlive the structure, which can't be copied, as
+// `components` may point into it.
+typedef struct {
+    const char *path;
+    size_t count;
+    // `inline_components`, or an array allocated for a longer path.
+    PathComponent *components;
+    PathComponent inline_components[PATH_INLINE_COMPONENTS];
+} ParsedPath;
+
+// Checks whether a path is valid (see `is_path_valid`) and, if it is, fills
+// `parsed` with its components, found while validating it. Then
+// `path_release` should be called once the path is no longer needed.
+bool parse_path(const char *path, ParsedPath *parsed);
+
+// Same as `parse_path`, but never uses vector instructions.
+bool parse_path_scalar(const char *path, ParsedPath *parsed);
+
+// Frees memory allocated by `parse_path` for a long path.
+static inline void path_release(ParsedPath *parsed) {
+    if (parsed->components != parsed->inline_components)
+        free(parsed->components);
+}
+
+// Return the name of i-th component of a parsed path.
+static inline const char *path_component_name(const ParsedPath *parsed, size_t i) {
+    return parsed->path + parsed->components[i].offset;
+}
+
+// Return the number of leading components (at most `limit`) which are the
+// same in both paths.
+size_t common_components(const ParsedPath *path1, const ParsedPath *path2, size_t limit);
+
 // Return an array containing all keys, lexicographically sorted.
 // The result is null-terminated.
 // Keys are not copied, they are only valid as long as the map.
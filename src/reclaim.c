@@ -0,0 +1,87 @@
+#include "reclaim.h"
+#include "epoch.h"
+#include "utils.h"
+#include "err.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct Job Job;
+
+struct Job {
+    void (*work)(void *);
+    void *arg;
+    Job *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER; // A job came.
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;   // A job finished.
+static Job *head, *tail;
+static uint64_t submitted, finished;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+
+static void *reclaim_thread(void *arg) {
+    (void) arg;
+    safe_lock(&lock);
+    while (true) {
+        while (!head)
+            safe_wait(&queued, &lock);
+        Job *job = head;
+        head = job->next;
+        if (!head)
+            tail = NULL;
+        safe_unlock(&lock);
+
+        job->work(job->arg);
+        free(job);
+        // Memory retired by the job is released by this thread's polls.
+        epoch_poll();
+
+        safe_lock(&lock);
+        finished++;
+        if (pthread_cond_broadcast(&done) != 0)
+            fatal("Cond broadcast failed.");
+    }
+    return NULL;
+}
+
+
+static void start_thread(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reclaim_thread, NULL) != 0)
+        fatal("Thread create failed.");
+    if (pthread_detach(thread) != 0)
+        fatal("Thread detach failed.");
+}
+
+
+void reclaim_defer(void (*work)(void *), void *arg) {
+    pthread_once(&start_once, start_thread);
+    Job *job = safe_malloc(sizeof(Job));
+    job->work = work;
+    job->arg = arg;
+    job->next = NULL;
+
+    safe_lock(&lock);
+    if (tail)
+        tail->next = job;
+    else
+        head = job;
+    tail = job;
+    submitted++;
+    safe_signal(&queued);
+    safe_unlock(&lock);
+}
+
+
+void reclaim_wait(void) {
+    safe_lock(&lock);
+    uint64_t target = submitted;
+    while (finished < target)
+        safe_wait(&done, &lock);
+    safe_unlock(&lock);
+}
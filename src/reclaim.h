@@ -0,0 +1,10 @@
+#pragma once
+
+// Background reclamation thread. Work which only frees memory is given to
+// it, so that the callers, often holding locks, don't have to wait for it.
+
+// Runs `work(arg)` later on the reclamation thread.
+void reclaim_defer(void (*work)(void *), void *arg);
+
+// Waits until all work deferred before the call is done.
+void reclaim_wait(void);
@@ -0,0 +1,243 @@
+#include "Tree.h"
+#include "path_utils.h"
+#include "utils.h"
+#include "err.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Most operations a worker takes from the queue at once.
+#define RING_BATCH 64
+
+// A submitted operation, with its own copies of the paths.
+typedef struct {
+    TreeRingOpType type;
+    uint64_t user_data;
+    char *path;
+    char *target;
+} Submission;
+
+struct TreeRing {
+    Tree *tree;
+    size_t entries;
+    size_t n_workers;
+    pthread_t *workers;
+    int fd; // Eventfd with a nonzero counter while there are completions.
+
+    pthread_mutex_t lock; // Protects the fields below.
+    pthread_cond_t submitted; // Wakes the workers.
+    bool stopping;
+    size_t in_flight; // Operations submitted and not reaped.
+    // Circular queues, each with room for `entries` elements.
+    Submission *queue;
+    size_t queue_head, queue_count;
+    TreeCompletion *done;
+    size_t done_head, done_count;
+};
+
+
+static void broadcast(pthread_cond_t *cond) {
+    if (pthread_cond_broadcast(cond) != 0)
+        fatal("Cond broadcast failed.");
+}
+
+
+static void run_list(Tree *tree, const Submission *op, TreeCompletion *completion) {
+    completion->listing = tree_list(tree, op->path);
+    if (completion->listing)
+        completion->result = 0;
+    else
+        completion->result = is_path_valid(op->path) ? ENOENT : EINVAL;
+}
+
+
+// Runs operations taken from the queue. Creations and removals go to one
+// batch, which applies those with the same parent in one critical section.
+static void run(Tree *tree, const Submission *ops, size_t n,
+                TreeCompletion *completions) {
+    TreeOp batch[RING_BATCH];
+    int results[RING_BATCH];
+    size_t in_batch[RING_BATCH];
+    size_t batched = 0;
+    for (size_t i = 0; i < n; ++i) {
+        TreeCompletion *completion = &completions[i];
+        completion->user_data = ops[i].user_data;
+        completion->listing = NULL;
+        switch (ops[i].type) {
+            case TREE_RING_CREATE:
+            case TREE_RING_REMOVE:
+                batch[batched].type = ops[i].type == TREE_RING_CREATE
+                                      ? TREE_OP_CREATE : TREE_OP_REMOVE;
+                batch[batched].path = ops[i].path;
+                in_batch[batched++] = i;
+                break;
+            case TREE_RING_LIST:
+                run_list(tree, &ops[i], completion);
+                break;
+            case TREE_RING_REMOVE_RECURSIVE:
+                completion->result = tree_remove_recursive(tree, ops[i].path);
+                break;
+            case TREE_RING_MOVE:
+                completion->result = tree_move(tree, ops[i].path, ops[i].target);
+                break;
+        }
+    }
+    if (batched == 1)
+        completions[in_batch[0]].result = batch[0].type == TREE_OP_CREATE
+                                          ? tree_create(tree, batch[0].path)
+                                          : tree_remove(tree, batch[0].path);
+    else if (batched > 1) {
+        tree_batch(tree, batch, batched, results);
+        for (size_t i = 0; i < batched; ++i)
+            completions[in_batch[i]].result = results[i];
+    }
+}
+
+
+// Each round takes a share of the queued operations, so that a burst is
+// spread over all workers, but at most RING_BATCH of them. Once the ring is
+// stopping, workers still empty the queue.
+static void *worker_thread(void *arg) {
+    TreeRing *ring = arg;
+    Submission ops[RING_BATCH];
+    TreeCompletion completions[RING_BATCH];
+    safe_lock(&ring->lock);
+    while (true) {
+        while (!ring->stopping && ring->queue_count == 0)
+            safe_wait(&ring->submitted, &ring->lock);
+        if (ring->queue_count == 0)
+            break;
+        size_t n = (ring->queue_count + ring->n_workers - 1) / ring->n_workers;
+        if (n > RING_BATCH)
+            n = RING_BATCH;
+        for (size_t i = 0; i < n; ++i) {
+            ops[i] = ring->queue[ring->queue_head];
+            ring->queue_head = (ring->queue_head + 1) % ring->entries;
+        }
+        ring->queue_count -= n;
+        safe_unlock(&ring->lock);
+
+        run(ring->tree, ops, n, completions);
+        for (size_t i = 0; i < n; ++i)
+            free(ops[i].path);
+
+        safe_lock(&ring->lock);
+        if (ring->done_count == 0) {
+            uint64_t one = 1;
+            if (write(ring->fd, &one, sizeof(one)) != sizeof(one))
+                syserr("Eventfd write failed.");
+        }
+        for (size_t i = 0; i < n; ++i) {
+            size_t tail = (ring->done_head + ring->done_count) % ring->entries;
+            ring->done[tail] = completions[i];
+            ring->done_count++;
+        }
+    }
+    safe_unlock(&ring->lock);
+    return NULL;
+}
+
+
+TreeRing *tree_ring_new(Tree *tree, size_t entries, size_t workers) {
+    if (entries == 0 || workers == 0)
+        return NULL;
+    TreeRing *ring = safe_malloc(sizeof(TreeRing));
+    ring->tree = tree;
+    ring->entries = entries;
+    ring->n_workers = workers;
+    ring->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->fd < 0)
+        syserr("Eventfd failed.");
+    safe_mutex_init(&ring->lock);
+    safe_cond_init(&ring->submitted);
+    ring->stopping = false;
+    ring->in_flight = 0;
+    ring->queue = safe_malloc(entries * sizeof(Submission));
+    ring->queue_head = ring->queue_count = 0;
+    ring->done = safe_malloc(entries * sizeof(TreeCompletion));
+    ring->done_head = ring->done_count = 0;
+    ring->workers = safe_malloc(workers * sizeof(pthread_t));
+    for (size_t i = 0; i < workers; ++i)
+        if (pthread_create(&ring->workers[i], NULL, worker_thread, ring) != 0)
+            fatal("Thread create failed.");
+    return ring;
+}
+
+
+void tree_ring_free(TreeRing *ring) {
+    safe_lock(&ring->lock);
+    ring->stopping = true;
+    broadcast(&ring->submitted);
+    safe_unlock(&ring->lock);
+    for (size_t i = 0; i < ring->n_workers; ++i)
+        if (pthread_join(ring->workers[i], NULL) != 0)
+            fatal("Thread join failed.");
+
+    for (size_t i = 0; i < ring->done_count; ++i)
+        free(ring->done[(ring->done_head + i) % ring->entries].listing);
+    close(ring->fd);
+    safe_mutex_destroy(&ring->lock);
+    safe_cond_destroy(&ring->submitted);
+    free(ring->queue);
+    free(ring->done);
+    free(ring->workers);
+    free(ring);
+}
+
+
+int tree_submit(TreeRing *ring, const TreeRingOp *op) {
+    // Paths are copied before taking the lock, into one allocation.
+    size_t length = strlen(op->path) + 1;
+    size_t target_length = op->type == TREE_RING_MOVE ? strlen(op->target) + 1 : 0;
+    Submission submission = {op->type, op->user_data, NULL, NULL};
+    submission.path = safe_malloc(length + target_length);
+    memcpy(submission.path, op->path, length);
+    if (target_length > 0) {
+        submission.target = submission.path + length;
+        memcpy(submission.target, op->target, target_length);
+    }
+
+    safe_lock(&ring->lock);
+    if (ring->in_flight == ring->entries) {
+        safe_unlock(&ring->lock);
+        free(submission.path);
+        return EAGAIN;
+    }
+    ring->in_flight++;
+    size_t tail = (ring->queue_head + ring->queue_count) % ring->entries;
+    ring->queue[tail] = submission;
+    ring->queue_count++;
+    safe_signal(&ring->submitted);
+    safe_unlock(&ring->lock);
+    return 0;
+}
+
+
+size_t tree_reap(TreeRing *ring, TreeCompletion *completions, size_t n) {
+    safe_lock(&ring->lock);
+    if (n > ring->done_count)
+        n = ring->done_count;
+    for (size_t i = 0; i < n; ++i) {
+        completions[i] = ring->done[ring->done_head];
+        ring->done_head = (ring->done_head + 1) % ring->entries;
+    }
+    ring->done_count -= n;
+    ring->in_flight -= n;
+    if (n > 0 && ring->done_count == 0) {
+        uint64_t counter;
+        if (read(ring->fd, &counter, sizeof(counter)) != sizeof(counter))
+            syserr("Eventfd read failed.");
+    }
+    safe_unlock(&ring->lock);
+    return n;
+}
+
+
+int tree_ring_fd(TreeRing *ring) {
+    return ring->fd;
+}
@@ -0,0 +1,234 @@
+#include "rwlock.h"
+#include "utils.h"
+
+#include <limits.h>
+#include <stdbool.h>
+
+// Layout of the state word. Every counter has COUNTER_BITS bits.
+//  rcount - readers inside,
+//  rwait  - readers sleeping until they can come in,
+//  wwait  - writers sleeping until they can come in,
+//  change - readers which a leaving writer let in before other writers,
+//  WRITER - a writer is inside.
+#define COUNTER_BITS 14
+#define COUNTER_MASK ((1ull << COUNTER_BITS) - 1)
+#define RCOUNT_SHIFT 0
+#define RWAIT_SHIFT (1 * COUNTER_BITS)
+#define WWAIT_SHIFT (2 * COUNTER_BITS)
+#define CHANGE_SHIFT (3 * COUNTER_BITS)
+#define WRITER_BIT (1ull << (4 * COUNTER_BITS))
+
+#define RCOUNT(s) (((s) >> RCOUNT_SHIFT) & COUNTER_MASK)
+#define RWAIT(s) (((s) >> RWAIT_SHIFT) & COUNTER_MASK)
+#define WWAIT(s) (((s) >> WWAIT_SHIFT) & COUNTER_MASK)
+#define CHANGE(s) (((s) >> CHANGE_SHIFT) & COUNTER_MASK)
+#define ONE(shift) (1ull << (shift))
+#define SET_CHANGE(s, n) (((s) & ~(COUNTER_MASK << CHANGE_SHIFT)) \
+                          | ((uint64_t) (n) << CHANGE_SHIFT))
+
+// Bits selecting who is woken up on the futex.
+#define WAKE_READERS 1u
+#define WAKE_WRITERS 2u
+
+// Number of checks of the state before a thread goes to sleep.
+#define SPIN_LIMIT 100
+
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+
+static void futex_wake(RWLock *lock, uint32_t who, int count) {
+    __atomic_fetch_add(&lock->futex, 1, __ATOMIC_SEQ_CST);
+    safe_futex_wake(&lock->futex, count, who);
+}
+
+
+static inline bool cas(RWLock *lock, uint64_t *s, uint64_t new_state) {
+    return __atomic_compare_exchange_n(&lock->state, s, new_state, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+
+void rwlock_init(RWLock *lock) {
+    lock->state = 0;
+    lock->futex = 0;
+    lock->reader_batch = 0;
+    lock->policy = RWLOCK_PHASE_FAIR;
+}
+
+
+void rwlock_set_policy(RWLock *lock, RWLockPolicy policy, unsigned reader_batch) {
+    lock->policy = policy;
+    lock->reader_batch = reader_batch < COUNTER_MASK ? reader_batch : 0;
+}
+
+
+static inline bool reader_may_enter(uint64_t s) {
+    return !((s & WRITER_BIT) || WWAIT(s) > 0) || CHANGE(s) > 0;
+}
+
+
+// Same as above for RWLOCK_PREFER_READERS.
+static inline bool reader_may_enter_first(uint64_t s) {
+    return !(s & WRITER_BIT);
+}
+
+
+static inline uint64_t reader_entered(uint64_t s) {
+    s += ONE(RCOUNT_SHIFT);
+    if (CHANGE(s) > 0)
+        s -= ONE(CHANGE_SHIFT);
+    return s;
+}
+
+
+static inline bool writer_may_enter(uint64_t s) {
+    return RCOUNT(s) == 0 && !(s & WRITER_BIT) && CHANGE(s) == 0;
+}
+
+
+// Waits until `may_enter` holds and then applies `entered` to the state.
+// `wait_shift` selects the counter of sleeping threads of this kind.
+static void entry(RWLock *lock, bool (*may_enter)(uint64_t),
+                  uint64_t (*entered)(uint64_t), int wait_shift, uint32_t who,
+                  RWLockQueue *queue) {
+    uint64_t s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    for (int spin = 0; spin < SPIN_LIMIT; ++spin) {
+        if (may_enter(s)) {
+            if (cas(lock, &s, entered(s)))
+                return;
+        }
+        else {
+            cpu_relax();
+            s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Count ourselves as waiting, unless we can come in right now.
+    while (true) {
+        if (may_enter(s)) {
+            if (cas(lock, &s, entered(s)))
+                return;
+        }
+        else if (cas(lock, &s, s + ONE(wait_shift))) {
+            if (queue) {
+                queue->readers = RWAIT(s);
+                queue->writers = WWAIT(s);
+            }
+            break;
+        }
+    }
+
+    while (true) {
+        // Reading the futex before the state means no wake up can be missed.
+        uint32_t futex = __atomic_load_n(&lock->futex, __ATOMIC_SEQ_CST);
+        s = __atomic_load_n(&lock->state, __ATOMIC_SEQ_CST);
+        while (may_enter(s)) {
+            if (cas(lock, &s, entered(s) - ONE(wait_shift)))
+                return;
+        }
+        safe_futex_wait(&lock->futex, futex, who);
+    }
+}
+
+
+static uint64_t writer_entered(uint64_t s) {
+    return s | WRITER_BIT;
+}
+
+
+void rwlock_reader_entry(RWLock *lock, RWLockQueue *queue) {
+    if (lock->policy == RWLOCK_PREFER_READERS)
+        entry(lock, reader_may_enter_first, reader_entered, RWAIT_SHIFT,
+              WAKE_READERS, queue);
+    else
+        entry(lock, reader_may_enter, reader_entered, RWAIT_SHIFT,
+              WAKE_READERS, queue);
+}
+
+
+void rwlock_writer_entry(RWLock *lock, RWLockQueue *queue) {
+    entry(lock, writer_may_enter, writer_entered, WWAIT_SHIFT, WAKE_WRITERS,
+          queue);
+}
+
+
+static bool try_entry(RWLock *lock, bool (*may_enter)(uint64_t),
+                      uint64_t (*entered)(uint64_t)) {
+    uint64_t s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    while (may_enter(s)) {
+        if (cas(lock, &s, entered(s)))
+            return true;
+    }
+    return false;
+}
+
+
+bool rwlock_reader_try_entry(RWLock *lock) {
+    if (lock->policy == RWLOCK_PREFER_READERS)
+        return try_entry(lock, reader_may_enter_first, reader_entered);
+    return try_entry(lock, reader_may_enter, reader_entered);
+}
+
+
+bool rwlock_writer_try_entry(RWLock *lock) {
+    return try_entry(lock, writer_may_enter, writer_entered);
+}
+
+
+void rwlock_reader_exit(RWLock *lock) {
+    uint64_t s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    uint64_t new_state;
+    uint32_t who;
+    do {
+        new_state = s - ONE(RCOUNT_SHIFT);
+        who = 0;
+        if (RCOUNT(new_state) == 0 && WWAIT(new_state) > 0) {
+            new_state = SET_CHANGE(new_state, 0);
+            who = WAKE_WRITERS;
+        }
+    } while (!__atomic_compare_exchange_n(&lock->state, &s, new_state, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (who)
+        futex_wake(lock, who, 1);
+}
+
+
+// Readers let in are woken all at once; those beyond `change` go back to
+// sleep if a writer waits.
+void rwlock_writer_exit(RWLock *lock) {
+    bool writers_first = lock->policy == RWLOCK_PREFER_WRITERS;
+    uint64_t batch = lock->policy == RWLOCK_PHASE_FAIR ? lock->reader_batch : 0;
+    uint64_t s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    uint64_t new_state;
+    uint32_t who;
+    do {
+        new_state = s & ~WRITER_BIT;
+        who = 0;
+        if (writers_first && WWAIT(new_state) > 0) {
+            who = WAKE_WRITERS;
+        }
+        else if (RWAIT(new_state) > 0) {
+            uint64_t change = RWAIT(new_state);
+            if (batch > 0 && change > batch)
+                change = batch;
+            // With no writer waiting readers come in anyway, and `change`
+            // would only hold back writers coming later.
+            if (!writers_first)
+                new_state = SET_CHANGE(new_state, change);
+            who = WAKE_READERS;
+        }
+        else if (WWAIT(new_state) > 0) {
+            who = WAKE_WRITERS;
+        }
+    } while (!__atomic_compare_exchange_n(&lock->state, &s, new_state, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (who)
+        futex_wake(lock, who, who == WAKE_WRITERS ? 1 : INT_MAX);
+}
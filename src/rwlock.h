@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Readers-writers lock kept in one atomic word, with a futex to sleep on.
+// Waiting threads spin for a moment before they go to sleep.
+//
+// Fairness is chosen by the policy of the lock.
+typedef enum {
+    // The classic monitor solution: a new reader waits while a writer works
+    // or waits, and a leaving writer lets readers which waited for it in
+    // (`change` passes) before the next writer, at most `reader_batch` of
+    // them if it isn't 0.
+    RWLOCK_PHASE_FAIR,
+    // A new reader waits only while a writer works, and a leaving writer lets
+    // waiting readers in first. Writers may starve.
+    RWLOCK_PREFER_READERS,
+    // A leaving writer lets the next writer in first, and readers wait while
+    // any writer works or waits. Readers may starve.
+    RWLOCK_PREFER_WRITERS,
+} RWLockPolicy;
+
+typedef struct {
+    uint64_t state; // Counters and flags, see rwlock.c.
+    uint32_t futex; // Changed on every wake up, threads sleep on it.
+    // Set by rwlock_set_policy(), they fit in the padding.
+    uint16_t reader_batch;
+    uint8_t policy;
+} RWLock;
+
+// Numbers of threads sleeping on a lock.
+typedef struct {
+    unsigned readers, writers;
+} RWLockQueue;
+
+// Makes a lock with the RWLOCK_PHASE_FAIR policy and no limit of readers.
+void rwlock_init(RWLock *lock);
+
+// Changes the policy of a lock which nobody uses.
+void rwlock_set_policy(RWLock *lock, RWLockPolicy policy, unsigned reader_batch);
+
+// Entries which have to sleep store in `queue`, if it isn't NULL, how many
+// threads slept on the lock when they started to sleep, and leave it as it is
+// otherwise.
+void rwlock_reader_entry(RWLock *lock, RWLockQueue *queue);
+
+void rwlock_reader_exit(RWLock *lock);
+
+// Same as the entries above, but return false instead of waiting.
+bool rwlock_reader_try_entry(RWLock *lock);
+
+bool rwlock_writer_try_entry(RWLock *lock);
+
+void rwlock_writer_entry(RWLock *lock, RWLockQueue *queue);
+
+void rwlock_writer_exit(RWLock *lock);
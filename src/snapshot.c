@@ -0,0 +1,186 @@
+#include "snapshot.h"
+#include "path_utils.h"
+#include "utils.h"
+#include "err.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct TreeSnapshot {
+    uint64_t version;
+    uint64_t sequence;
+    SnapNode *root;
+};
+
+
+SnapNode *snap_node_new(Listing *listing) {
+    SnapNode *node = safe_malloc(sizeof(SnapNode) + listing->count * sizeof(SnapNode *));
+    node->refs = 1;
+    node->listing = listing;
+    return node;
+}
+
+
+void snap_node_ref(SnapNode *node) {
+    __atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void snap_node_unref(SnapNode *node) {
+    if (!node || __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    // Nodes which lost their last reference, freed without recursion.
+    size_t capacity = 64, count = 1;
+    SnapNode **stack = safe_malloc(capacity * sizeof(SnapNode *));
+    stack[0] = node;
+    while (count > 0) {
+        node = stack[--count];
+        for (size_t i = 0; i < node->listing->count; ++i) {
+            SnapNode *child = node->children[i];
+            if (__atomic_sub_fetch(&child->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                continue;
+            if (count == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(SnapNode *));
+                if (!stack)
+                    fatal("Realloc failed.");
+            }
+            stack[count++] = child;
+        }
+        listing_unref(node->listing);
+        free(node);
+    }
+    free(stack);
+}
+
+
+TreeSnapshot *snapshot_new(SnapNode *root, uint64_t version, uint64_t sequence) {
+    TreeSnapshot *snapshot = safe_malloc(sizeof(TreeSnapshot));
+    snapshot->version = version;
+    snapshot->sequence = sequence;
+    snapshot->root = root;
+    return snapshot;
+}
+
+
+SnapNode *snapshot_root(const TreeSnapshot *snapshot) {
+    return snapshot->root;
+}
+
+
+uint64_t snapshot_sequence(const TreeSnapshot *snapshot) {
+    return snapshot->sequence;
+}
+
+
+void tree_snapshot_free(TreeSnapshot *snapshot) {
+    snap_node_unref(snapshot->root);
+    free(snapshot);
+}
+
+
+uint64_t tree_snapshot_version(const TreeSnapshot *snapshot) {
+    return snapshot->version;
+}
+
+
+// Returns child of `node` with given name, or NULL if there is no such child.
+static SnapNode *find_child(const SnapNode *node, const char *name, size_t length) {
+    const Listing *listing = node->listing;
+    size_t i = listing_upper_bound(listing, name, length);
+    if (i == 0)
+        return NULL;
+    i--;
+    size_t own_length = listing->starts[i + 1] - listing->starts[i] - 1;
+    if (own_length != length || memcmp(listing->string + listing->starts[i], name, length) != 0)
+        return NULL;
+    return node->children[i];
+}
+
+
+// Returns node of the folder at `path`, relative to the snapshot's root.
+static SnapNode *find_node(const TreeSnapshot *snapshot, const ParsedPath *path) {
+    SnapNode *node = snapshot->root;
+    for (size_t i = 0; node && i < path->count; ++i)
+        node = find_child(node, path_component_name(path, i), path->components[i].length);
+    return node;
+}
+
+
+char *tree_snapshot_list(const TreeSnapshot *snapshot, const char *path_string) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return NULL;
+    SnapNode *node = find_node(snapshot, &path);
+    path_release(&path);
+    return node ? listing_string(node->listing) : NULL;
+}
+
+
+// A folder waiting for a visit by tree_snapshot_walk().
+typedef struct {
+    const SnapNode *node;
+    char *path;
+    size_t depth;
+} WalkEntry;
+
+
+int tree_snapshot_walk(const TreeSnapshot *snapshot, const char *path_string,
+                       TreeWalkOrder order,
+                       int (*visit)(void *ctx, const char *path, size_t depth),
+                       void *ctx) {
+    ParsedPath path;
+    if (!parse_path(path_string, &path))
+        return EINVAL;
+    SnapNode *node = find_node(snapshot, &path);
+    path_release(&path);
+    if (!node)
+        return ENOENT;
+    bool depth_first = order == TREE_WALK_DEPTH_FIRST;
+
+    // Entries are taken from the back in depth-first order, and from the
+    // front in breadth-first order.
+    size_t begin = 0, end = 1, capacity = 64;
+    WalkEntry *entries = safe_malloc(capacity * sizeof(WalkEntry));
+    entries[0] = (WalkEntry) { node, safe_malloc(strlen(path_string) + 1), 0 };
+    strcpy(entries[0].path, path_string);
+    int err = 0;
+    while (begin < end) {
+        WalkEntry entry = depth_first ? entries[--end] : entries[begin++];
+        if (err == 0)
+            err = visit(ctx, entry.path, entry.depth);
+        const Listing *listing = entry.node->listing;
+        size_t path_length = strlen(entry.path);
+        for (size_t k = 0; err == 0 && k < listing->count; ++k) {
+            // In depth-first order children are pushed in reverse, so they
+            // are taken in sorted order.
+            size_t i = depth_first ? listing->count - 1 - k : k;
+            const char *name = listing->string + listing->starts[i];
+            size_t length = listing->starts[i + 1] - listing->starts[i] - 1;
+            if (end == capacity && begin > 0) {
+                end -= begin;
+                memmove(entries, entries + begin, end * sizeof(WalkEntry));
+                begin = 0;
+            }
+            if (end == capacity) {
+                capacity *= 2;
+                entries = realloc(entries, capacity * sizeof(WalkEntry));
+                if (!entries)
+                    fatal("Realloc failed.");
+            }
+            char *child_path = safe_malloc(path_length + length + 2);
+            memcpy(child_path, entry.path, path_length);
+            memcpy(child_path + path_length, name, length);
+            child_path[path_length + length] = '/';
+            child_path[path_length + length + 1] = '\0';
+            entries[end++] = (WalkEntry) { entry.node->children[i], child_path, entry.depth + 1 };
+        }
+        free(entry.path);
+    }
+    for (size_t i = begin; i < end; ++i)
+        free(entries[i].path);
+    free(entries);
+    return err;
+}
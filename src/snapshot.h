@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Tree.h"
+#include "listing.h"
+
+#include <stdint.h>
+
+// Immutable folders of snapshots. A node keeps the listing of its folder and
+// its children in the order of names in the listing. Nodes, like listings,
+// are shared through reference counts: by snapshots, other nodes, and live
+// folders, each of which keeps the node made for it by the last snapshot, so
+// the next snapshot can reuse it if the folder didn't change.
+typedef struct SnapNode SnapNode;
+
+struct SnapNode {
+    uint32_t refs;
+    Listing *listing;
+    SnapNode *children[];
+};
+
+// Makes a node with one reference, taking over a reference to `listing`.
+// The caller should fill `children`, giving each child one reference.
+SnapNode *snap_node_new(Listing *listing);
+
+void snap_node_ref(SnapNode *node);
+
+// Drops a reference, freeing the node and its children which aren't used
+// anymore.
+void snap_node_unref(SnapNode *node);
+
+// Makes a snapshot of given version, taking over a reference to `root`.
+// `sequence` is the number of the first change of the tree not included in
+// the snapshot (see journal.h).
+TreeSnapshot *snapshot_new(SnapNode *root, uint64_t version, uint64_t sequence);
+
+uint64_t snapshot_sequence(const TreeSnapshot *snapshot);
+
+// Returns the node of the snapshot's folder.
+SnapNode *snapshot_root(const TreeSnapshot *snapshot);
@@ -0,0 +1,162 @@
+#include "stats.h"
+#include "utils.h"
+#include "err.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef TREE_STATS
+
+#include <time.h>
+
+typedef struct Shard Shard;
+
+// Statistics of one thread. Only the owner writes them, other threads read
+// them in tree_stats_snapshot(). Shards are never freed, a shard of a
+// finished thread is reused by the next new thread.
+struct Shard {
+    TreeStats stats;
+    bool in_use;
+    Shard *next;
+};
+
+static Shard *shards;
+
+static _Thread_local Shard *my_shard;
+_Thread_local size_t stats_depth;
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+
+static void shard_destructor(void *arg) {
+    Shard *shard = arg;
+    __atomic_store_n(&shard->in_use, false, __ATOMIC_RELEASE);
+}
+
+
+static void create_shard_key(void) {
+    if (pthread_key_create(&shard_key, shard_destructor) != 0)
+        fatal("Key create failed.");
+}
+
+
+static TreeStats *get_stats(void) {
+    if (my_shard)
+        return &my_shard->stats;
+
+    Shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+    for (; shard; shard = shard->next) {
+        bool expected = false;
+        if (!__atomic_load_n(&shard->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&shard->in_use, &expected, true, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!shard) {
+        shard = safe_malloc(sizeof(Shard));
+        memset(shard, 0, sizeof(Shard));
+        shard->in_use = true;
+        shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_once(&shard_key_once, create_shard_key);
+    if (pthread_setspecific(shard_key, shard) != 0)
+        fatal("Set specific failed.");
+    my_shard = shard;
+    return &shard->stats;
+}
+
+
+// Counters are changed only by their owner, so a plain load and store is
+// enough; they are atomic only so that snapshots can read them.
+static inline void bump(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+
+static void record(TreeStatsHistogram *histogram, uint64_t ns) {
+    size_t bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= TREE_STATS_BUCKETS)
+        bucket = TREE_STATS_BUCKETS - 1;
+    bump(&histogram->count, 1);
+    bump(&histogram->total_ns, ns);
+    bump(&histogram->buckets[bucket], 1);
+}
+
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+void stats_acquired(TreeStatsWait kind) {
+    bump(&get_stats()->acquired[kind], 1);
+}
+
+
+void stats_waited(TreeStatsWait kind, uint64_t start) {
+    uint64_t ns = stats_now() - start;
+    TreeStats *stats = get_stats();
+    bump(&stats->acquired[kind], 1);
+    bump(&stats->contended[kind], 1);
+    record(&stats->waits[kind], ns);
+    if (kind != TREE_STATS_QUIESCE_WAIT) {
+        size_t depth = stats_depth < TREE_STATS_DEPTHS ? stats_depth
+                       : TREE_STATS_DEPTHS - 1;
+        bump(&stats->contended_at_depth[depth], 1);
+    }
+}
+
+
+static inline size_t queue_bucket(unsigned length) {
+    return length < TREE_STATS_QUEUES ? length : TREE_STATS_QUEUES - 1;
+}
+
+
+void stats_queued(TreeStatsWait kind, const RWLockQueue *queue) {
+    if (queue->readers == UINT_MAX)
+        return;
+    TreeStats *stats = get_stats();
+    bump(&stats->queued_readers[kind][queue_bucket(queue->readers)], 1);
+    bump(&stats->queued_writers[kind][queue_bucket(queue->writers)], 1);
+}
+
+
+void stats_op(TreeStatsOp op, uint64_t start) {
+    record(&get_stats()->ops[op], stats_now() - start);
+}
+
+
+static void add_counters(uint64_t *sum, const uint64_t *counters, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+}
+
+
+int tree_stats_snapshot(TreeStats *stats) {
+    // TreeStats consists of counters only, so it is summed up as an array.
+    memset(stats, 0, sizeof(TreeStats));
+    for (Shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard;
+         shard = shard->next)
+        add_counters((uint64_t *) stats, (const uint64_t *) &shard->stats,
+                     sizeof(TreeStats) / sizeof(uint64_t));
+    return 0;
+}
+
+#else
+
+int tree_stats_snapshot(TreeStats *stats) {
+    memset(stats, 0, sizeof(TreeStats));
+    return ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Tree.h"
+#include "rwlock.h"
+
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+
+// Collecting of the statistics returned by tree_stats_snapshot(). Without
+// TREE_STATS all the macros below expand to nothing (or to the bare lock
+// entry), so they cost nothing.
+
+#ifdef TREE_STATS
+
+// Depth of the folder which the calling thread enters next.
+extern _Thread_local size_t stats_depth;
+
+uint64_t stats_now(void);
+
+void stats_acquired(TreeStatsWait kind);
+
+// Counts a wait of given kind which started at `start`.
+void stats_waited(TreeStatsWait kind, uint64_t start);
+
+// Counts the queue a lock entry of given kind found, if it had to sleep.
+void stats_queued(TreeStatsWait kind, const RWLockQueue *queue);
+
+void stats_op(TreeStatsOp op, uint64_t start);
+
+#define STATS_DEPTH(depth) (stats_depth = (depth))
+
+// Runs `try_entry`, and if it fails `entry`, measuring how long it waits.
+// `entry` may pass STATS_QUEUE to an rwlock entry to count its queue.
+#define STATS_ENTRY(kind, try_entry, entry) do {             \
+        if (try_entry) {                                     \
+            stats_acquired(kind);                            \
+        }                                                    \
+        else {                                               \
+            RWLockQueue stats_queue_ = {UINT_MAX, UINT_MAX}; \
+            uint64_t stats_start_ = stats_now();             \
+            entry;                                           \
+            stats_waited(kind, stats_start_);                \
+            stats_queued(kind, &stats_queue_);               \
+        }                                                    \
+    } while (0)
+
+#define STATS_QUEUE (&stats_queue_)
+
+#define STATS_WAIT_BEGIN() uint64_t stats_wait_start_ = stats_now()
+#define STATS_WAIT_END(kind) stats_waited(kind, stats_wait_start_)
+
+#define STATS_OP_BEGIN() uint64_t stats_op_start_ = stats_now()
+#define STATS_OP_END(op) stats_op(op, stats_op_start_)
+
+#else
+
+#define STATS_DEPTH(depth) ((void) 0)
+#define STATS_ENTRY(kind, try_entry, entry) entry
+#define STATS_QUEUE NULL
+#define STATS_WAIT_BEGIN() ((void) 0)
+#define STATS_WAIT_END(kind) ((void) 0)
+#define STATS_OP_BEGIN() ((void) 0)
+#define STATS_OP_END(op) ((void) 0)
+
+#endif
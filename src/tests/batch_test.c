@@ -0,0 +1,97 @@
+#include "check.h"
+
+#include <errno.h>
+#include <string.h>
+
+// Batches give every operation the result tree_create() or tree_remove()
+// would, apply operations with the same parent in their order, and parents
+// before their subfolders.
+
+static void check_list(Tree *tree, const char *path, const char *expected) {
+    char *listing = tree_list(tree, path);
+    CHECK(listing && strcmp(listing, expected) == 0);
+    free(listing);
+}
+
+
+int main(void) {
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        int results[8];
+
+        // Nothing to do.
+        tree_batch(tree, NULL, 0, results);
+        check_list(tree, "/", "");
+
+        // A child comes after its parent, even if it is given first, and
+        // children of the root may be in different shards.
+        TreeOp create[] = {
+            { TREE_OP_CREATE, "/a/b/" },
+            { TREE_OP_CREATE, "/a/" },
+            { TREE_OP_CREATE, "/c/" },
+            { TREE_OP_CREATE, "/a/b/d/" },
+            { TREE_OP_CREATE, "/c/" },
+        };
+        tree_batch(tree, create, 5, results);
+        CHECK(results[0] == 0 && results[1] == 0 && results[2] == 0);
+        CHECK(results[3] == 0);
+        CHECK(results[4] == EEXIST);
+        check_list(tree, "/", "a,c");
+        check_list(tree, "/a/", "b");
+        check_list(tree, "/a/b/", "d");
+        size_t count;
+        CHECK(tree_count(tree, "/", &count) == 0 && count == 4);
+
+        // Invalid operations, paths and the root fail on their own.
+        TreeOp invalid[] = {
+            { TREE_OP_CREATE, "a/" },
+            { TREE_OP_REMOVE, "/a1/" },
+            { TREE_OP_CREATE, "/" },
+            { TREE_OP_REMOVE, "/" },
+            { (TreeOpType) 7, "/e/" },
+            { TREE_OP_CREATE, "/e/" },
+        };
+        tree_batch(tree, invalid, 6, results);
+        CHECK(results[0] == EINVAL && results[1] == EINVAL);
+        CHECK(results[2] == EEXIST && results[3] == EBUSY);
+        CHECK(results[4] == EINVAL && results[5] == 0);
+        check_list(tree, "/", "a,c,e");
+
+        // Operations under one parent see each other in order.
+        TreeOp same_parent[] = {
+            { TREE_OP_CREATE, "/c/f/" },
+            { TREE_OP_REMOVE, "/c/f/" },
+            { TREE_OP_REMOVE, "/c/f/" },
+            { TREE_OP_CREATE, "/c/g/" },
+            { TREE_OP_REMOVE, "/a/b/" },
+            { TREE_OP_REMOVE, "/x/y/" },
+            { TREE_OP_CREATE, "/x/y/" },
+        };
+        tree_batch(tree, same_parent, 7, results);
+        CHECK(results[0] == 0 && results[1] == 0 && results[2] == ENOENT);
+        CHECK(results[3] == 0);
+        CHECK(results[4] == ENOTEMPTY);
+        CHECK(results[5] == ENOENT && results[6] == ENOENT);
+        check_list(tree, "/c/", "g");
+        check_list(tree, "/a/b/", "d");
+        CHECK(tree_count(tree, "/", &count) == 0 && count == 6);
+
+        // Parents go first, so a folder whose children the same batch
+        // removes isn't empty yet.
+        TreeOp remove[] = {
+            { TREE_OP_REMOVE, "/a/b/d/" },
+            { TREE_OP_REMOVE, "/a/b/" },
+            { TREE_OP_REMOVE, "/c/g/" },
+            { TREE_OP_CREATE, "/a/b/h/" },
+        };
+        tree_batch(tree, remove, 4, results);
+        CHECK(results[0] == 0 && results[2] == 0);
+        CHECK(results[1] == ENOTEMPTY);
+        CHECK(results[3] == 0);
+        check_list(tree, "/a/b/", "h");
+        check_list(tree, "/c/", "");
+        CHECK(tree_count(tree, "/", &count) == 0 && count == 5);
+        tree_free(tree);
+    }
+    return 0;
+}
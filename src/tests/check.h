@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Tree.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Helpers shared by the tests run by ctest. A failed check reports where it
+// failed and aborts, which fails the test.
+
+#define CHECK(condition)                                                      \
+    do {                                                                      \
+        if (!(condition)) {                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,  \
+                    #condition);                                              \
+            abort();                                                          \
+        }                                                                     \
+    } while (0)
+
+// Options every concurrent test runs with: the defaults, the path cache,
+// shards of the root, and the other lock policies.
+#define TEST_CONFIGS 4
+
+static const TreeOptions test_configs[TEST_CONFIGS] = {
+    { 0, 0, TREE_LOCK_PHASE_FAIR, 0 },
+    { 64, 0, TREE_LOCK_PHASE_FAIR, 2 },
+    { 0, 4, TREE_LOCK_PREFER_READERS, 0 },
+    { 64, 3, TREE_LOCK_PREFER_WRITERS, 0 },
+};
+
+// Xorshift generator, one state per thread. The state must not be 0.
+static inline uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Runs `thread` in `n` threads, the i-th with `args + i * size`, and waits
+// for all of them.
+static inline void run_threads(size_t n, void *(*thread)(void *), void *args,
+                               size_t size) {
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    CHECK(threads);
+    for (size_t i = 0; i < n; ++i)
+        CHECK(pthread_create(&threads[i], NULL, thread, (char *) args + i * size) == 0);
+    for (size_t i = 0; i < n; ++i)
+        CHECK(pthread_join(threads[i], NULL) == 0);
+    free(threads);
+}
@@ -0,0 +1,185 @@
+#include "check.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+// Processes create, remove and move folders, mostly inside empty ones, while
+// the journal is checkpointed again and again. Every saved tree with the
+// journal continuing it must give the next saved tree, and the last one must
+// give the tree itself, so no change is lost or recorded twice at a cut.
+
+#define WRITERS 4
+#define CHECKPOINTS 20
+
+typedef struct {
+    Tree *tree;
+    uint64_t seed;
+    char base[8];
+    bool *done;
+} Thread;
+
+typedef struct {
+    char **paths;
+    size_t count, capacity;
+} Paths;
+
+
+// Makes a random path of depth 1 to 3 below `base`, with letters "a" to "c".
+static void random_path(uint64_t *seed, const char *base, char *buf) {
+    uint64_t r = next_random(seed);
+    char *p = buf + sprintf(buf, "%s", base);
+    int depth = 1 + r % 3;
+    for (int i = 0; i < depth; ++i) {
+        *p++ = 'a' + (r >> (2 + 2 * i)) % 3;
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+
+static void *writer(void *arg) {
+    Thread *t = arg;
+    char path[32], other[32];
+    while (!__atomic_load_n(t->done, __ATOMIC_ACQUIRE)) {
+        random_path(&t->seed, t->base, path);
+        random_path(&t->seed, t->base, other);
+        int err;
+        switch (next_random(&t->seed) % 4) {
+            case 0:
+            case 1:
+                err = tree_create(t->tree, path);
+                CHECK(err == 0 || err == EEXIST || err == ENOENT);
+                break;
+            case 2:
+                err = tree_move(t->tree, path, other);
+                CHECK(err == 0 || err == EEXIST || err == ENOENT || err == -1);
+                break;
+            default:
+                err = tree_remove(t->tree, path);
+                CHECK(err == 0 || err == ENOENT || err == ENOTEMPTY);
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+static int collect(void *ctx, const char *path, size_t depth) {
+    (void) depth;
+    Paths *paths = ctx;
+    if (paths->count == paths->capacity) {
+        paths->capacity = paths->capacity ? 2 * paths->capacity : 64;
+        paths->paths = realloc(paths->paths, paths->capacity * sizeof(char *));
+        CHECK(paths->paths);
+    }
+    paths->paths[paths->count] = strdup(path);
+    CHECK(paths->paths[paths->count]);
+    paths->count++;
+    return 0;
+}
+
+
+static int compare_paths(const void *p1, const void *p2) {
+    return strcmp(*(char *const *) p1, *(char *const *) p2);
+}
+
+
+// Returns the sorted paths of all folders of `tree`.
+static Paths folders(Tree *tree) {
+    Paths paths = { NULL, 0, 0 };
+    CHECK(tree_walk(tree, "/", TREE_WALK_DEPTH_FIRST, collect, &paths) == 0);
+    qsort(paths.paths, paths.count, sizeof(char *), compare_paths);
+    return paths;
+}
+
+
+static void free_paths(Paths *paths) {
+    for (size_t i = 0; i < paths->count; ++i)
+        free(paths->paths[i]);
+    free(paths->paths);
+}
+
+
+static void check_same(Tree *tree1, Tree *tree2) {
+    Paths paths1 = folders(tree1), paths2 = folders(tree2);
+    CHECK(paths1.count == paths2.count);
+    for (size_t i = 0; i < paths1.count; ++i)
+        CHECK(strcmp(paths1.paths[i], paths2.paths[i]) == 0);
+    free_paths(&paths1);
+    free_paths(&paths2);
+}
+
+
+static int temporary_file(void) {
+    FILE *file = tmpfile();
+    CHECK(file);
+    int fd = dup(fileno(file));
+    CHECK(fd >= 0);
+    fclose(file);
+    return fd;
+}
+
+
+// Loads the tree saved in `tree_fd` and applies the journal in `journal_fd`.
+static Tree *recover(int tree_fd, int journal_fd) {
+    CHECK(lseek(tree_fd, 0, SEEK_SET) == 0);
+    Tree *tree = tree_load(tree_fd);
+    CHECK(tree);
+    CHECK(lseek(journal_fd, 0, SEEK_SET) == 0);
+    CHECK(tree_journal_replay(tree, journal_fd) == 0);
+    return tree;
+}
+
+
+int main(void) {
+    TreeJournalOptions options = { 0, false };
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        int tree_fds[CHECKPOINTS], journal_fds[CHECKPOINTS + 1];
+        journal_fds[0] = temporary_file();
+        CHECK(tree_journal_start(tree, journal_fds[0], &options) == 0);
+
+        bool done = false;
+        Thread threads[WRITERS];
+        pthread_t ids[WRITERS];
+        for (int i = 0; i < WRITERS; ++i) {
+            threads[i] = (Thread) { .tree = tree, .seed = (uint64_t) c * 100 + i + 1,
+                                    .done = &done };
+            sprintf(threads[i].base, "/w%c/", 'a' + i);
+            CHECK(tree_create(tree, threads[i].base) == 0);
+            CHECK(pthread_create(&ids[i], NULL, writer, &threads[i]) == 0);
+        }
+        for (int i = 0; i < CHECKPOINTS; ++i) {
+            usleep(2000);
+            tree_fds[i] = temporary_file();
+            journal_fds[i + 1] = temporary_file();
+            CHECK(tree_journal_checkpoint(tree, tree_fds[i], journal_fds[i + 1]) == 0);
+        }
+        __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+        for (int i = 0; i < WRITERS; ++i)
+            CHECK(pthread_join(ids[i], NULL) == 0);
+        CHECK(tree_journal_stop(tree) == 0);
+
+        for (int i = 0; i + 1 < CHECKPOINTS; ++i) {
+            Tree *recovered = recover(tree_fds[i], journal_fds[i + 1]);
+            CHECK(lseek(tree_fds[i + 1], 0, SEEK_SET) == 0);
+            Tree *next = tree_load(tree_fds[i + 1]);
+            CHECK(next);
+            check_same(recovered, next);
+            tree_free(next);
+            tree_free(recovered);
+        }
+        Tree *recovered = recover(tree_fds[CHECKPOINTS - 1], journal_fds[CHECKPOINTS]);
+        check_same(recovered, tree);
+        tree_free(recovered);
+
+        for (int i = 0; i < CHECKPOINTS; ++i)
+            close(tree_fds[i]);
+        for (int i = 0; i <= CHECKPOINTS; ++i)
+            close(journal_fds[i]);
+        tree_free(tree);
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "check.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Empty folders stay compact, without vertices of their own, through
+// operations which only read them, and become compact again once changes
+// take their last child, so the memory of a tree of leaves doesn't grow
+// with use. Folders with handles keep their vertices.
+
+#define FOLDERS 10000
+
+// Makes the path of the i-th folder, a child of the root with three letters.
+static void folder_path(size_t i, char *buf) {
+    sprintf(buf, "/%c%c%c/", 'a' + (int) (i / 676), 'a' + (int) (i / 26 % 26),
+            'a' + (int) (i % 26));
+}
+
+
+// Makes the path `path` followed by `name`.
+static void join(char *buf, const char *path, const char *name) {
+    strcpy(buf, path);
+    strcat(buf, name);
+}
+
+
+static int count_visit(void *ctx, const char *path, size_t depth) {
+    (void) path;
+    (void) depth;
+    ++*(size_t *) ctx;
+    return 0;
+}
+
+
+static int count_match(void *ctx, const char *path) {
+    (void) path;
+    ++*(size_t *) ctx;
+    return 0;
+}
+
+
+// Checks that the tree takes as much memory as it did when all folders were
+// compact. Vertices given back to the pool stay in its slabs, so only the
+// numbers of folders, maps and listings are compared.
+static void check_compact(Tree *tree, const TreeMemory *before, size_t compact) {
+    TreeMemory memory;
+    tree_memory(tree, &memory);
+    CHECK(memory.folders == before->folders);
+    CHECK(memory.compact_folders == compact);
+    if (compact == before->compact_folders) {
+        CHECK(memory.map_bytes == before->map_bytes);
+        CHECK(memory.listing_bytes == before->listing_bytes);
+    }
+}
+
+
+int main(void) {
+    char path[32], child[32], other[32];
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        for (size_t i = 0; i < FOLDERS; ++i) {
+            folder_path(i, path);
+            CHECK(tree_create(tree, path) == 0);
+        }
+        TreeMemory before;
+        tree_memory(tree, &before);
+        CHECK(before.folders == FOLDERS + 1);
+        CHECK(before.compact_folders == FOLDERS);
+
+        // Reading empty folders doesn't give them vertices.
+        for (size_t i = 0; i < FOLDERS; ++i) {
+            folder_path(i, path);
+            size_t count = 1, visited = 0, matched = 0;
+            CHECK(tree_count(tree, path, &count) == 0 && count == 0);
+            char *listing = tree_list(tree, path);
+            CHECK(listing && strcmp(listing, "") == 0);
+            free(listing);
+            CHECK(tree_walk(tree, path, TREE_WALK_DEPTH_FIRST, count_visit,
+                            &visited) == 0);
+            CHECK(visited == 1);
+            CHECK(tree_glob(tree, path, count_match, &matched) == 0);
+            CHECK(matched == 1);
+            join(child, path, "*/");
+            CHECK(tree_glob(tree, child, count_match, &matched) == 0);
+            CHECK(matched == 1);
+            TreeSnapshot *snapshot = tree_snapshot(tree, path);
+            CHECK(snapshot);
+            listing = tree_snapshot_list(snapshot, "/");
+            CHECK(listing && strcmp(listing, "") == 0);
+            free(listing);
+            tree_snapshot_free(snapshot);
+        }
+        check_compact(tree, &before, FOLDERS);
+
+        // Removing the last child makes the parent compact again.
+        for (size_t i = 0; i < FOLDERS; ++i) {
+            folder_path(i, path);
+            join(child, path, "x/");
+            CHECK(tree_create(tree, child) == 0);
+            CHECK(tree_remove(tree, child) == 0);
+            CHECK(tree_remove(tree, child) == ENOENT);
+        }
+        check_compact(tree, &before, FOLDERS);
+
+        // So do recursive removes, moves and batches.
+        for (size_t i = 0; i + 1 < FOLDERS; i += 2) {
+            folder_path(i, path);
+            folder_path(i + 1, other);
+            join(child, path, "x/");
+            CHECK(tree_create(tree, child) == 0);
+            join(child, path, "x/y/");
+            CHECK(tree_create(tree, child) == 0);
+            join(child, path, "x/");
+            CHECK(tree_remove_recursive(tree, child) == 0);
+
+            CHECK(tree_create(tree, child) == 0);
+            char target[32];
+            join(target, other, "x/");
+            CHECK(tree_move(tree, child, target) == 0);
+            CHECK(tree_move(tree, target, child) == 0);
+            TreeMove moves[] = { { child, target } };
+            int results[3];
+            tree_move_many(tree, moves, 1, results);
+            CHECK(results[0] == 0);
+            TreeOp ops[] = { { TREE_OP_CREATE, child }, { TREE_OP_REMOVE, child },
+                             { TREE_OP_REMOVE, target } };
+            tree_batch(tree, ops, 3, results);
+            CHECK(results[0] == 0 && results[1] == 0 && results[2] == 0);
+        }
+        check_compact(tree, &before, FOLDERS);
+
+        // A folder with a handle keeps its vertex.
+        folder_path(0, path);
+        TreeHandle *handle = tree_open(tree, path);
+        CHECK(handle);
+        check_compact(tree, &before, FOLDERS - 1);
+        CHECK(tree_create_at(handle, "/x/") == 0);
+        CHECK(tree_remove_at(handle, "/x/") == 0);
+        join(child, path, "x/");
+        CHECK(tree_create(tree, child) == 0);
+        CHECK(tree_remove(tree, child) == 0);
+        check_compact(tree, &before, FOLDERS - 1);
+        tree_close(handle);
+        CHECK(tree_create(tree, child) == 0);
+        CHECK(tree_remove(tree, child) == 0);
+        check_compact(tree, &before, FOLDERS);
+        tree_free(tree);
+    }
+    return 0;
+}
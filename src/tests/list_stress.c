@@ -0,0 +1,149 @@
+#include "check.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Lists of a folder taken without locks, while writers move, create and
+// remove its children, have to show one state of the folder. Every writer
+// keeps exactly one of its two folders "x?" and "y?" at any moment, moving
+// one into the other, so a listing which mixes states shows both or none.
+
+#define WRITERS 4
+#define READERS 4
+#define ROUNDS 20000
+
+typedef struct {
+    Tree *tree;
+    const char *base;
+    int index;
+    bool *done;
+} Thread;
+
+
+static void name_path(char *buf, const char *base, char kind, int index,
+                      const char *rest) {
+    sprintf(buf, "%s%c%c/%s", base, kind, 'a' + index, rest);
+}
+
+
+static void *writer(void *arg) {
+    Thread *t = arg;
+    char from[64], to[64], path[64];
+    bool in_x = true;
+    for (int i = 0; i < ROUNDS; ++i) {
+        name_path(from, t->base, in_x ? 'x' : 'y', t->index, "");
+        name_path(to, t->base, in_x ? 'y' : 'x', t->index, "");
+        switch (i % 3) {
+            case 0:
+                CHECK(tree_move(t->tree, from, to) == 0);
+                in_x = !in_x;
+                break;
+            case 1:
+                name_path(path, t->base, 'z', t->index, "");
+                CHECK(tree_create(t->tree, path) == 0);
+                CHECK(tree_remove(t->tree, path) == 0);
+                break;
+            default:
+                name_path(path, t->base, in_x ? 'x' : 'y', t->index, "q/");
+                CHECK(tree_create(t->tree, path) == 0);
+                CHECK(tree_remove(t->tree, path) == 0);
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+// Checks a listing of the base folder: sorted names of writers' folders,
+// with exactly one of "x?" and "y?" for every writer.
+static void check_listing(const char *listing) {
+    int seen[WRITERS] = { 0 };
+    char previous[8] = "";
+    const char *name = listing;
+    while (*name) {
+        const char *end = strchr(name, ',');
+        size_t length = end ? (size_t) (end - name) : strlen(name);
+        CHECK(length == 2 && strchr("xyz", name[0]) && name[1] >= 'a'
+              && name[1] < 'a' + WRITERS);
+        char current[8] = { name[0], name[1], '\0' };
+        CHECK(strcmp(previous, current) < 0);
+        strcpy(previous, current);
+        if (name[0] != 'z')
+            seen[name[1] - 'a']++;
+        name = end ? end + 1 : name + length;
+    }
+    for (int k = 0; k < WRITERS; ++k)
+        CHECK(seen[k] == 1);
+}
+
+
+static int count_name(void *ctx, const char *name, size_t length) {
+    (void) name;
+    CHECK(length == 2);
+    ++*(int *) ctx;
+    return 0;
+}
+
+
+static void *reader(void *arg) {
+    Thread *t = arg;
+    char path[64];
+    for (int i = 0; !__atomic_load_n(t->done, __ATOMIC_ACQUIRE); ++i) {
+        char *listing = tree_list(t->tree, t->base);
+        CHECK(listing);
+        check_listing(listing);
+        free(listing);
+
+        int names = 0;
+        CHECK(tree_list_foreach(t->tree, t->base, count_name, &names) == 0);
+        CHECK(names >= WRITERS && names <= 2 * WRITERS);
+
+        name_path(path, t->base, i % 2 ? 'x' : 'y', i % WRITERS, "");
+        listing = tree_list(t->tree, path);
+        CHECK(!listing || strcmp(listing, "") == 0 || strcmp(listing, "q") == 0);
+        free(listing);
+    }
+    return NULL;
+}
+
+
+static void *run_writers(void *arg) {
+    Thread *threads = arg;
+    run_threads(WRITERS, writer, threads, sizeof(Thread));
+    __atomic_store_n(threads[0].done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+int main(void) {
+    const char *bases[] = { "/", "/d/" };
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        for (int b = 0; b < 2; ++b) {
+            Tree *tree = tree_new_with(&test_configs[c]);
+            if (strcmp(bases[b], "/") != 0)
+                CHECK(tree_create(tree, bases[b]) == 0);
+            bool done = false;
+            Thread writers[WRITERS], readers[READERS];
+            char path[64];
+            for (int k = 0; k < WRITERS; ++k) {
+                writers[k] = (Thread) { tree, bases[b], k, &done };
+                name_path(path, bases[b], 'x', k, "");
+                CHECK(tree_create(tree, path) == 0);
+            }
+            for (int k = 0; k < READERS; ++k)
+                readers[k] = (Thread) { tree, bases[b], k, &done };
+
+            pthread_t writers_thread;
+            CHECK(pthread_create(&writers_thread, NULL, run_writers, writers) == 0);
+            run_threads(READERS, reader, readers, sizeof(Thread));
+            CHECK(pthread_join(writers_thread, NULL) == 0);
+
+            char *listing = tree_list(tree, bases[b]);
+            check_listing(listing);
+            free(listing);
+            tree_free(tree);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "check.h"
+
+#include <errno.h>
+#include <string.h>
+
+// Pages of tree_list_range() give the names tree_list() would, also when the
+// cursor names no child or is past the end, and so does tree_list_into(),
+// which reports the size it needs when the buffer is too small.
+
+static void check_range(Tree *tree, const char *path, const char *after_name,
+                        size_t limit, const char *expected) {
+    char *page = tree_list_range(tree, path, after_name, limit);
+    CHECK(page && strcmp(page, expected) == 0);
+    free(page);
+}
+
+
+// Checks tree_list_into() with buffers of every size up to one more than
+// needed, and without a buffer.
+static void check_into(Tree *tree, const char *path, const char *expected) {
+    size_t length = strlen(expected);
+    char buf[64];
+    for (size_t cap = 0; cap <= length + 1; ++cap) {
+        size_t needed = 0;
+        memset(buf, 'z', sizeof(buf));
+        int err = tree_list_into(tree, path, buf, cap, &needed);
+        CHECK(needed == length + 1);
+        if (cap < length + 1) {
+            // Nothing is written then.
+            CHECK(err == ERANGE && buf[0] == 'z');
+        }
+        else {
+            CHECK(err == 0 && strcmp(buf, expected) == 0);
+        }
+        CHECK(tree_list_into(tree, path, buf, cap, NULL) == err);
+    }
+    size_t needed = 0;
+    int err = tree_list_into(tree, path, NULL, 0, &needed);
+    CHECK(needed == length + 1);
+    CHECK(err == ERANGE);
+}
+
+
+int main(void) {
+    static const char *names[] = { "/b/", "/ba/", "/d/", "/f/", "/fa/", "/h/" };
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        // Children of the root may be in different shards, those of "/x/"
+        // are in one vertex.
+        CHECK(tree_create(tree, "/x/") == 0);
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+            char path[16];
+            CHECK(tree_create(tree, names[i]) == 0);
+            sprintf(path, "/x%s", names[i]);
+            CHECK(tree_create(tree, path) == 0);
+        }
+        const char *folders[] = { "/", "/x/" };
+        for (int f = 0; f < 2; ++f) {
+            const char *path = folders[f];
+            const char *all = f == 0 ? "b,ba,d,f,fa,h,x" : "b,ba,d,f,fa,h";
+
+            // Pages, each starting after the last name of the previous one.
+            check_range(tree, path, NULL, 2, "b,ba");
+            check_range(tree, path, "ba", 2, "d,f");
+            check_range(tree, path, "f", 2, "fa,h");
+            check_range(tree, path, NULL, 100, all);
+
+            // A cursor which names no child starts at the next name.
+            check_range(tree, path, "a", 1, "b");
+            check_range(tree, path, "bb", 2, "d,f");
+            check_range(tree, path, "e", 1, "f");
+            check_range(tree, path, "", 2, "b,ba");
+
+            // Past the end, and with no names asked for.
+            check_range(tree, path, "z", 3, "");
+            check_range(tree, path, NULL, 0, "");
+            check_range(tree, path, "b", 0, "");
+            check_into(tree, path, all);
+        }
+        check_range(tree, "/", "h", 5, "x");
+        check_range(tree, "/x/", "h", 5, "");
+        check_range(tree, "/b/", NULL, 5, "");
+        check_into(tree, "/b/", "");
+
+        // Missing folders and invalid paths.
+        CHECK(!tree_list_range(tree, "/c/", NULL, 5));
+        CHECK(!tree_list_range(tree, "/b/c/", NULL, 5));
+        CHECK(!tree_list_range(tree, "/b", NULL, 5));
+        char buf[8];
+        size_t needed = 0;
+        CHECK(tree_list_into(tree, "/c/", buf, sizeof(buf), &needed) == ENOENT);
+        CHECK(tree_list_into(tree, "/b/c/", NULL, 0, NULL) == ENOENT);
+        CHECK(tree_list_into(tree, "/b", buf, sizeof(buf), &needed) == EINVAL);
+        tree_free(tree);
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include "check.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Every process owns a folder "/p?/" and applies random operations inside
+// it, checking each result against a sequential model of the folder:
+// nobody else changes it, so results must be exact no matter what happens
+// around it. Meanwhile others change "/s/" at random and walk, glob and take
+// snapshots of the whole tree. In the end every folder is compared with its
+// model.
+
+#define MODELED 4
+#define CHAOS 2
+#define STEPS 20000
+#define MAX_PATHS 1024
+#define MAX_LISTING 4096
+
+typedef struct {
+    char *paths[MAX_PATHS];
+    size_t n;
+} Model;
+
+typedef struct {
+    Tree *tree;
+    uint64_t seed;
+    char base[8];
+    Model model;
+    bool *done;
+} Thread;
+
+
+static bool is_inside(const char *path, const char *folder) {
+    return strncmp(path, folder, strlen(folder)) == 0;
+}
+
+
+static bool has(const Model *m, const char *path) {
+    for (size_t i = 0; i < m->n; ++i)
+        if (strcmp(m->paths[i], path) == 0)
+            return true;
+    return false;
+}
+
+
+static void add(Model *m, const char *path) {
+    CHECK(m->n < MAX_PATHS);
+    m->paths[m->n] = strdup(path);
+    CHECK(m->paths[m->n]);
+    m->n++;
+}
+
+
+// Removes the folder with everything inside it.
+static void remove_all(Model *m, const char *folder) {
+    for (size_t i = 0; i < m->n;) {
+        if (is_inside(m->paths[i], folder)) {
+            free(m->paths[i]);
+            m->paths[i] = m->paths[--m->n];
+        } else {
+            ++i;
+        }
+    }
+}
+
+
+static size_t count_below(const Model *m, const char *folder) {
+    size_t count = 0;
+    for (size_t i = 0; i < m->n; ++i)
+        count += is_inside(m->paths[i], folder) && strcmp(m->paths[i], folder) != 0;
+    return count;
+}
+
+
+static void parent_of(const char *path, char *parent) {
+    size_t length = strlen(path) - 1;
+    while (path[length - 1] != '/')
+        --length;
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+}
+
+
+static int compare_names(const void *n1, const void *n2) {
+    return strcmp(*(char *const *) n1, *(char *const *) n2);
+}
+
+
+// Makes the listing tree_list() should return.
+static void model_list(const Model *m, const char *folder, char *listing) {
+    size_t length = strlen(folder), n = 0;
+    char *names[MAX_PATHS];
+    for (size_t i = 0; i < m->n; ++i) {
+        const char *rest = m->paths[i] + length;
+        if (is_inside(m->paths[i], folder) && *rest && strchr(rest, '/')[1] == '\0')
+            names[n++] = strndup(rest, strlen(rest) - 1);
+    }
+    qsort(names, n, sizeof(char *), compare_names);
+    listing[0] = '\0';
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0)
+            strcat(listing, ",");
+        strcat(listing, names[i]);
+        free(names[i]);
+    }
+}
+
+
+static int model_create(Model *m, const char *path) {
+    char parent[256];
+    parent_of(path, parent);
+    if (!has(m, parent))
+        return ENOENT;
+    if (has(m, path))
+        return EEXIST;
+    add(m, path);
+    return 0;
+}
+
+
+static int model_remove(Model *m, const char *path) {
+    if (!has(m, path))
+        return ENOENT;
+    if (count_below(m, path) > 0)
+        return ENOTEMPTY;
+    remove_all(m, path);
+    return 0;
+}
+
+
+// Returns whether a move is not one into its own subfolder.
+static bool move_allowed(const char *source, const char *target) {
+    return strlen(source) >= strlen(target) || !is_inside(target, source);
+}
+
+
+static int model_move(Model *m, const char *source, const char *target) {
+    char source_parent[256], target_parent[256];
+    parent_of(source, source_parent);
+    parent_of(target, target_parent);
+    if (!move_allowed(source, target))
+        return -1;
+    if (!has(m, target_parent))
+        return ENOENT;
+    if (has(m, target))
+        return EEXIST;
+    if (!has(m, source_parent) || !has(m, source))
+        return ENOENT;
+    size_t length = strlen(source);
+    for (size_t i = 0; i < m->n; ++i) {
+        if (is_inside(m->paths[i], source)) {
+            char moved[256];
+            snprintf(moved, sizeof(moved), "%s%s", target, m->paths[i] + length);
+            free(m->paths[i]);
+            m->paths[i] = strdup(moved);
+            CHECK(m->paths[i]);
+        }
+    }
+    return 0;
+}
+
+
+static bool paths_related(const char *path1, const char *path2) {
+    return is_inside(path1, path2) || is_inside(path2, path1);
+}
+
+
+// Makes a random path of depth 1 to 4 below `base`, with letters "a" to "c".
+static void random_path(uint64_t *seed, const char *base, char *buf) {
+    uint64_t r = next_random(seed);
+    char *p = buf + sprintf(buf, "%s", base);
+    int depth = 1 + r % 4;
+    for (int i = 0; i < depth; ++i) {
+        *p++ = 'a' + (r >> (2 + 2 * i)) % 3;
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+
+static void *modeled(void *arg) {
+    Thread *t = arg;
+    Model *m = &t->model;
+    char path[64], other[64], listing[MAX_LISTING];
+    for (int i = 0; i < STEPS; ++i) {
+        random_path(&t->seed, t->base, path);
+        random_path(&t->seed, t->base, other);
+        size_t count;
+        switch (next_random(&t->seed) % 8) {
+            case 0:
+            case 1:
+            case 2:
+                CHECK(tree_create(t->tree, path) == model_create(m, path));
+                break;
+            case 3:
+                CHECK(tree_remove(t->tree, path) == model_remove(m, path));
+                break;
+            case 4:
+                CHECK(tree_move(t->tree, path, other) == model_move(m, path, other));
+                break;
+            case 5: {
+                // Moves which don't conflict give the results of applying
+                // them one by one.
+                char third[64], fourth[64];
+                random_path(&t->seed, t->base, third);
+                random_path(&t->seed, t->base, fourth);
+                TreeMove moves[2] = { { path, other }, { third, fourth } };
+                int results[2];
+                tree_move_many(t->tree, moves, 2, results);
+                CHECK(results[0] == model_move(m, path, other));
+                bool conflict = move_allowed(path, other) && move_allowed(third, fourth)
+                                && (paths_related(third, path) || paths_related(third, other)
+                                    || paths_related(fourth, path)
+                                    || paths_related(fourth, other));
+                CHECK(results[1] == (conflict ? EINVAL : model_move(m, third, fourth)));
+                break;
+            }
+            case 6: {
+                char *actual = tree_list(t->tree, path);
+                if (!has(m, path)) {
+                    CHECK(!actual);
+                    CHECK(tree_count(t->tree, path, &count) == ENOENT);
+                    break;
+                }
+                model_list(m, path, listing);
+                CHECK(actual && strcmp(actual, listing) == 0);
+                free(actual);
+                CHECK(tree_count(t->tree, path, &count) == 0);
+                CHECK(count == count_below(m, path));
+                break;
+            }
+            default: {
+                int expected = has(m, path) ? 0 : ENOENT;
+                CHECK(tree_remove_recursive(t->tree, path) == expected);
+                remove_all(m, path);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static void *chaos(void *arg) {
+    Thread *t = arg;
+    char path[64], other[64];
+    while (!__atomic_load_n(t->done, __ATOMIC_ACQUIRE)) {
+        random_path(&t->seed, "/s/", path);
+        random_path(&t->seed, "/s/", other);
+        int err;
+        switch (next_random(&t->seed) % 4) {
+            case 0:
+            case 1:
+                err = tree_create(t->tree, path);
+                CHECK(err == 0 || err == EEXIST || err == ENOENT);
+                break;
+            case 2:
+                err = tree_move(t->tree, path, other);
+                CHECK(err == 0 || err == EEXIST || err == ENOENT || err == -1);
+                break;
+            default:
+                err = tree_remove_recursive(t->tree, path);
+                CHECK(err == 0 || err == ENOENT);
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+static int ignore(void *ctx, const char *path, size_t depth) {
+    (void) ctx, (void) path, (void) depth;
+    return 0;
+}
+
+
+static int ignore_match(void *ctx, const char *path) {
+    (void) ctx, (void) path;
+    return 0;
+}
+
+
+static void *observer(void *arg) {
+    Thread *t = arg;
+    while (!__atomic_load_n(t->done, __ATOMIC_ACQUIRE)) {
+        CHECK(tree_walk(t->tree, "/", TREE_WALK_BREADTH_FIRST, ignore, NULL) == 0);
+        CHECK(tree_glob(t->tree, "/p*/a*/*/", ignore_match, NULL) == 0);
+        TreeSnapshot *snapshot = tree_snapshot(t->tree, "/");
+        CHECK(snapshot);
+        CHECK(tree_snapshot_walk(snapshot, "/", TREE_WALK_DEPTH_FIRST, ignore, NULL) == 0);
+        tree_snapshot_free(snapshot);
+    }
+    return NULL;
+}
+
+
+static int check_visit(void *ctx, const char *path, size_t depth) {
+    (void) depth;
+    CHECK(has(ctx, path));
+    return 0;
+}
+
+
+int main(void) {
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        CHECK(tree_create(tree, "/s/") == 0);
+        bool done = false;
+        static Thread threads[MODELED + CHAOS + 1];
+        for (int i = 0; i < MODELED + CHAOS + 1; ++i) {
+            threads[i] = (Thread) { .tree = tree, .seed = (uint64_t) c * 100 + i + 1,
+                                    .done = &done };
+            sprintf(threads[i].base, "/p%c/", 'a' + i);
+            threads[i].model.n = 0;
+            if (i < MODELED) {
+                CHECK(tree_create(tree, threads[i].base) == 0);
+                add(&threads[i].model, threads[i].base);
+            }
+        }
+        pthread_t others[CHAOS + 1];
+        for (int i = 0; i < CHAOS; ++i)
+            CHECK(pthread_create(&others[i], NULL, chaos, &threads[MODELED + i]) == 0);
+        CHECK(pthread_create(&others[CHAOS], NULL, observer, &threads[MODELED + CHAOS]) == 0);
+        run_threads(MODELED, modeled, threads, sizeof(Thread));
+        __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+        for (int i = 0; i < CHAOS + 1; ++i)
+            CHECK(pthread_join(others[i], NULL) == 0);
+
+        for (int i = 0; i < MODELED; ++i) {
+            Model *m = &threads[i].model;
+            size_t count;
+            CHECK(tree_count(tree, threads[i].base, &count) == 0);
+            CHECK(count + 1 == m->n);
+            CHECK(tree_walk(tree, threads[i].base, TREE_WALK_DEPTH_FIRST, check_visit, m) == 0);
+            for (size_t j = 0; j < m->n; ++j)
+                free(m->paths[j]);
+        }
+        tree_free(tree);
+    }
+    return 0;
+}
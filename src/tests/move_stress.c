@@ -0,0 +1,146 @@
+#include "check.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+// A fixed set of items is moved between bins by tree_move() and
+// tree_move_many(), while one bin itself moves in and out of another. A
+// checker takes snapshots of the tree: each must hold every item exactly
+// once and the right number of folders.
+
+#define ITEMS 16
+#define BINS 6
+#define MOVERS 4
+#define STEPS 20000
+
+// "/c/" and "/ba/c/" are the same bin, which is in one place at a time.
+static const char *bins[BINS] = { "/ba/", "/bb/", "/ba/x/", "/bb/y/", "/c/", "/ba/c/" };
+
+// Bins but "/ba/c/", and items.
+#define FOLDERS (BINS - 1 + ITEMS)
+
+typedef struct {
+    Tree *tree;
+    uint64_t seed;
+    bool *done;
+} Thread;
+
+
+static void item_path(char *buf, const char *bin, int item) {
+    sprintf(buf, "%si%c/", bin, 'a' + item);
+}
+
+
+static void random_move(uint64_t *seed, char *source, char *target) {
+    uint64_t r = next_random(seed);
+    int item = r % ITEMS;
+    int from = (r >> 8) % BINS;
+    int to = (from + 1 + (r >> 16) % (BINS - 1)) % BINS;
+    item_path(source, bins[from], item);
+    item_path(target, bins[to], item);
+}
+
+
+static void *mover(void *arg) {
+    Thread *t = arg;
+    char sources[3][32], targets[3][32];
+    for (int i = 0; i < STEPS; ++i) {
+        if (next_random(&t->seed) % 4) {
+            random_move(&t->seed, sources[0], targets[0]);
+            int err = tree_move(t->tree, sources[0], targets[0]);
+            CHECK(err == 0 || err == ENOENT || err == EEXIST);
+            continue;
+        }
+        TreeMove moves[3];
+        int results[3];
+        for (int j = 0; j < 3; ++j) {
+            random_move(&t->seed, sources[j], targets[j]);
+            moves[j] = (TreeMove) { sources[j], targets[j] };
+        }
+        tree_move_many(t->tree, moves, 3, results);
+        for (int j = 0; j < 3; ++j)
+            CHECK(results[j] == 0 || results[j] == ENOENT || results[j] == EEXIST ||
+                  results[j] == EINVAL);
+    }
+    return NULL;
+}
+
+
+static void *bin_mover(void *arg) {
+    Thread *t = arg;
+    while (!__atomic_load_n(t->done, __ATOMIC_ACQUIRE)) {
+        int err = tree_move(t->tree, "/c/", "/ba/c/");
+        CHECK(err == 0 || err == ENOENT);
+        err = tree_move(t->tree, "/ba/c/", "/c/");
+        CHECK(err == 0 || err == ENOENT);
+    }
+    return NULL;
+}
+
+
+typedef struct {
+    int seen[ITEMS];
+    size_t folders;
+} Census;
+
+
+static int count_item(void *ctx, const char *path, size_t depth) {
+    (void) depth;
+    Census *census = ctx;
+    size_t length = strlen(path);
+    if (length > 1)
+        census->folders++;
+    if (length >= 4 && path[length - 3] == 'i' && path[length - 4] == '/')
+        census->seen[path[length - 2] - 'a']++;
+    return 0;
+}
+
+
+static void *checker(void *arg) {
+    Thread *t = arg;
+    while (!__atomic_load_n(t->done, __ATOMIC_ACQUIRE)) {
+        TreeSnapshot *snapshot = tree_snapshot(t->tree, "/");
+        CHECK(snapshot);
+        Census census = { .folders = 0 };
+        CHECK(tree_snapshot_walk(snapshot, "/", TREE_WALK_BREADTH_FIRST, count_item,
+                                 &census) == 0);
+        CHECK(census.folders == FOLDERS);
+        for (int i = 0; i < ITEMS; ++i)
+            CHECK(census.seen[i] == 1);
+        tree_snapshot_free(snapshot);
+    }
+    return NULL;
+}
+
+
+int main(void) {
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        for (int i = 0; i < BINS - 1; ++i)
+            CHECK(tree_create(tree, bins[i]) == 0);
+        char path[32];
+        for (int i = 0; i < ITEMS; ++i) {
+            item_path(path, bins[i % (BINS - 1)], i);
+            CHECK(tree_create(tree, path) == 0);
+        }
+
+        bool done = false;
+        Thread threads[MOVERS + 2];
+        for (int i = 0; i < MOVERS + 2; ++i)
+            threads[i] = (Thread) { tree, (uint64_t) c * 100 + i + 1, &done };
+        pthread_t others[2];
+        CHECK(pthread_create(&others[0], NULL, bin_mover, &threads[MOVERS]) == 0);
+        CHECK(pthread_create(&others[1], NULL, checker, &threads[MOVERS + 1]) == 0);
+        run_threads(MOVERS, mover, threads, sizeof(Thread));
+        __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+        for (int i = 0; i < 2; ++i)
+            CHECK(pthread_join(others[i], NULL) == 0);
+
+        size_t count;
+        CHECK(tree_count(tree, "/", &count) == 0);
+        CHECK(count == FOLDERS);
+        tree_free(tree);
+    }
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include "check.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Processes work deep below "/a/" and "/e/", and walk the tree, while others
+// remove those folders recursively, recreate them and move one into the
+// other, so removals and moves keep waiting for processes below. A folder
+// with an open handle below it, or being walked or globbed, can't be removed.
+// Walks and globs also change the folders they visit. Between rounds, counts
+// of descendants and listings are checked against a walk of the whole tree.
+
+#define WORKERS 4
+#define DESTROYERS 2
+#define ROUNDS 8
+#define STEPS 4000
+#define MAX_FOLDERS 4096
+
+typedef struct {
+    Tree *tree;
+    uint64_t seed;
+} Thread;
+
+
+// Makes a random path of depth 1 to 4 with letters "b" and "c" below "/a/"
+// or "/e/".
+static void random_path(uint64_t *seed, char *buf) {
+    uint64_t r = next_random(seed);
+    char *p = buf;
+    *p++ = '/';
+    *p++ = r % 2 ? 'a' : 'e';
+    *p++ = '/';
+    int depth = (r >> 1) % 4;
+    for (int i = 0; i < depth; ++i) {
+        *p++ = (r >> (3 + i)) % 2 ? 'b' : 'c';
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+
+// Visits a folder which may be removed meanwhile, like other processes do.
+static int count_visited(void *ctx, const char *path, size_t depth) {
+    (void) depth;
+    size_t count;
+    int err = tree_count(ctx, path, &count);
+    CHECK(err == 0 || err == ENOENT);
+    return 0;
+}
+
+
+typedef struct {
+    Tree *tree;
+    const char *path; // The walked folder.
+    bool removed;
+} Walk;
+
+
+// Changes the tree during a walk of a folder below "/a/" or "/e/". The
+// folder and its ancestors can't be moved or removed meanwhile, unless it is
+// empty, as it is just visited then.
+static int change_visited(void *ctx, const char *path, size_t depth) {
+    Walk *walk = ctx;
+    CHECK(!walk->removed);
+    char top[4] = { '/', walk->path[1], '/', '\0' };
+    int err = tree_remove_recursive(walk->tree, walk->path);
+    CHECK(err == EBUSY || (depth == 0 && (err == 0 || err == ENOENT)));
+    walk->removed = err != EBUSY;
+    if (depth > 0) {
+        CHECK(tree_move(walk->tree, walk->path, "/f/") == EBUSY);
+        CHECK(tree_move(walk->tree, top, "/f/") == EBUSY);
+    }
+
+    char full[128];
+    snprintf(full, sizeof(full), "%s%s", walk->path, path + 1);
+    if (depth == 0 && !walk->removed) {
+        strcat(full, "b/");
+        // Only an empty folder, not pinned, could be removed meanwhile.
+        err = tree_create(walk->tree, full);
+        CHECK(err == 0 || err == EEXIST || err == ENOENT);
+    }
+    else if (depth == 1) {
+        err = tree_remove_recursive(walk->tree, full);
+        CHECK(err == 0 || err == ENOENT || err == EBUSY);
+    }
+    else {
+        free(tree_list(walk->tree, full));
+    }
+    return 0;
+}
+
+
+// Changes the tree while globbing children of a folder, which is pinned
+// like the folder of a walk, as it has children to match.
+static int change_matched(void *ctx, const char *path) {
+    Walk *walk = ctx;
+    CHECK(tree_remove_recursive(walk->tree, walk->path) == EBUSY);
+    int err = tree_remove_recursive(walk->tree, path);
+    CHECK(err == 0 || err == ENOENT || err == EBUSY);
+    return 0;
+}
+
+
+static void *worker(void *arg) {
+    Thread *t = arg;
+    char path[64];
+    for (int i = 0; i < STEPS; ++i) {
+        random_path(&t->seed, path);
+        int err;
+        size_t count;
+        switch (next_random(&t->seed) % 8) {
+            case 0:
+            case 1:
+                err = tree_create(t->tree, path);
+                CHECK(err == 0 || err == EEXIST || err == ENOENT);
+                break;
+            case 2:
+                err = tree_remove(t->tree, path);
+                CHECK(err == 0 || err == ENOENT || err == ENOTEMPTY || err == EBUSY);
+                break;
+            case 3:
+                free(tree_list(t->tree, path));
+                err = tree_count(t->tree, path, &count);
+                CHECK(err == 0 || err == ENOENT);
+                break;
+            case 4:
+                CHECK(tree_walk(t->tree, "/", TREE_WALK_BREADTH_FIRST, count_visited,
+                                t->tree) == 0);
+                break;
+            case 5: {
+                Walk walk = { t->tree, path, false };
+                err = tree_walk(t->tree, path, TREE_WALK_DEPTH_FIRST, change_visited,
+                                &walk);
+                CHECK(err == 0 || err == ENOENT);
+                break;
+            }
+            case 6: {
+                Walk walk = { t->tree, path, false };
+                char pattern[sizeof(path) + 2];
+                snprintf(pattern, sizeof(pattern), "%s*/", path);
+                CHECK(tree_glob(t->tree, pattern, change_matched, &walk) == 0);
+                break;
+            }
+            default: {
+                TreeHandle *handle = tree_open(t->tree, path);
+                if (!handle)
+                    break;
+                // Nobody can remove or move the folder while it is open.
+                char *listing = tree_list_at(handle, "/");
+                CHECK(listing);
+                free(listing);
+                err = tree_create_at(handle, "/b/");
+                CHECK(err == 0 || err == EEXIST);
+                CHECK(tree_remove_recursive(t->tree, path) == EBUSY);
+                tree_close(handle);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static void *destroyer(void *arg) {
+    Thread *t = arg;
+    for (int i = 0; i < STEPS / 4; ++i) {
+        int err;
+        switch (next_random(&t->seed) % 4) {
+            case 0:
+                err = tree_remove_recursive(t->tree, "/a/");
+                CHECK(err == 0 || err == ENOENT || err == EBUSY);
+                err = tree_create(t->tree, "/a/");
+                CHECK(err == 0 || err == EEXIST);
+                break;
+            case 1:
+                err = tree_move(t->tree, "/a/", "/e/");
+                CHECK(err == 0 || err == ENOENT || err == EEXIST || err == EBUSY);
+                break;
+            case 2:
+                err = tree_move(t->tree, "/e/", "/a/");
+                CHECK(err == 0 || err == ENOENT || err == EEXIST || err == EBUSY);
+                break;
+            default:
+                err = tree_remove_recursive(t->tree, "/e/b/");
+                CHECK(err == 0 || err == ENOENT || err == EBUSY);
+                err = tree_create(t->tree, "/e/");
+                CHECK(err == 0 || err == EEXIST);
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+typedef struct {
+    char *paths[MAX_FOLDERS];
+    size_t count;
+} Folders;
+
+
+static int collect(void *ctx, const char *path, size_t depth) {
+    (void) depth;
+    Folders *folders = ctx;
+    CHECK(folders->count < MAX_FOLDERS);
+    folders->paths[folders->count] = strdup(path);
+    CHECK(folders->paths[folders->count]);
+    folders->count++;
+    return 0;
+}
+
+
+// Checks the number of descendants and the listing of every folder against
+// the folders found by a walk. Nothing changes meanwhile.
+static void check_tree(Tree *tree) {
+    Folders folders = { .count = 0 };
+    CHECK(tree_walk(tree, "/", TREE_WALK_DEPTH_FIRST, collect, &folders) == 0);
+    for (size_t i = 0; i < folders.count; ++i) {
+        const char *path = folders.paths[i];
+        size_t length = strlen(path);
+        size_t below = 0;
+        char expected[1024] = "";
+        for (size_t j = 0; j < folders.count; ++j) {
+            const char *other = folders.paths[j];
+            if (j == i || strncmp(other, path, length) != 0)
+                continue;
+            below++;
+            // A child has one more slash.
+            const char *rest = other + length;
+            if (strchr(rest, '/') == rest + strlen(rest) - 1) {
+                if (expected[0])
+                    strcat(expected, ",");
+                strncat(expected, rest, strlen(rest) - 1);
+            }
+        }
+        size_t count;
+        CHECK(tree_count(tree, path, &count) == 0);
+        CHECK(count == below);
+        // Depth-first order visits children in sorted order.
+        char *listing = tree_list(tree, path);
+        CHECK(listing && strcmp(listing, expected) == 0);
+        free(listing);
+    }
+    for (size_t i = 0; i < folders.count; ++i)
+        free(folders.paths[i]);
+}
+
+
+int main(void) {
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        CHECK(tree_create(tree, "/a/") == 0);
+        Thread threads[WORKERS + DESTROYERS];
+        for (int i = 0; i < WORKERS + DESTROYERS; ++i)
+            threads[i] = (Thread) { tree, (uint64_t) c * 100 + i + 1 };
+        for (int round = 0; round < ROUNDS; ++round) {
+            pthread_t destroyers[DESTROYERS];
+            for (int i = 0; i < DESTROYERS; ++i)
+                CHECK(pthread_create(&destroyers[i], NULL, destroyer,
+                                     &threads[WORKERS + i]) == 0);
+            run_threads(WORKERS, worker, threads, sizeof(Thread));
+            for (int i = 0; i < DESTROYERS; ++i)
+                CHECK(pthread_join(destroyers[i], NULL) == 0);
+            check_tree(tree);
+        }
+        tree_free(tree);
+    }
+    return 0;
+}
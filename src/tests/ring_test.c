@@ -0,0 +1,143 @@
+#include "check.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Operations submitted to a ring complete with their own results and
+// user_data, the descriptor of the ring is readable exactly while there
+// are completions to reap, a full ring refuses more operations until
+// completions are reaped, and freeing a ring frees completions nobody
+// reaped.
+
+#define ENTRIES 8
+#define WORKERS 2
+
+// Expected completion of an operation whose user_data is its index.
+typedef struct {
+    TreeRingOp op;
+    int result;
+    const char *listing; // NULL if there should be none.
+} Expected;
+
+
+static bool is_readable(TreeRing *ring, int timeout) {
+    struct pollfd fd = { .fd = tree_ring_fd(ring), .events = POLLIN };
+    int n = poll(&fd, 1, timeout);
+    CHECK(n >= 0);
+    return n > 0 && (fd.revents & POLLIN);
+}
+
+
+// Submits operations which may run in any order, reaps them one at a time
+// whenever the descriptor becomes readable, and checks their completions.
+static void run_ops(TreeRing *ring, Expected *expected, size_t n) {
+    CHECK(n <= ENTRIES);
+    CHECK(!is_readable(ring, 0));
+    for (size_t i = 0; i < n; ++i) {
+        expected[i].op.user_data = i;
+        CHECK(tree_submit(ring, &expected[i].op) == 0);
+    }
+    bool reaped[ENTRIES] = { false };
+    for (size_t left = n; left > 0; --left) {
+        CHECK(is_readable(ring, 10000));
+        TreeCompletion completion;
+        // Asking for nothing takes nothing.
+        CHECK(tree_reap(ring, &completion, 0) == 0);
+        CHECK(is_readable(ring, 0));
+        CHECK(tree_reap(ring, &completion, 1) == 1);
+        CHECK(completion.user_data < n && !reaped[completion.user_data]);
+        reaped[completion.user_data] = true;
+        const Expected *e = &expected[completion.user_data];
+        CHECK(completion.result == e->result);
+        if (e->listing)
+            CHECK(completion.listing && strcmp(completion.listing, e->listing) == 0);
+        else
+            CHECK(!completion.listing);
+        free(completion.listing);
+    }
+    CHECK(!is_readable(ring, 0));
+}
+
+
+static void check_list(Tree *tree, const char *path, const char *expected) {
+    char *listing = tree_list(tree, path);
+    CHECK(listing && strcmp(listing, expected) == 0);
+    free(listing);
+}
+
+
+int main(void) {
+    CHECK(!tree_ring_new(NULL, 0, 1));
+    CHECK(!tree_ring_new(NULL, 1, 0));
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+        TreeRing *ring = tree_ring_new(tree, ENTRIES, WORKERS);
+        CHECK(ring);
+
+        Expected first[] = {
+            { { TREE_RING_CREATE, "/a/", NULL, 0 }, 0, NULL },
+            { { TREE_RING_CREATE, "/c/", NULL, 0 }, 0, NULL },
+        };
+        run_ops(ring, first, 2);
+
+        // Operations in the ring together may run in any order, so they
+        // don't depend on each other.
+        Expected second[] = {
+            { { TREE_RING_CREATE, "/b/", NULL, 0 }, 0, NULL },
+            { { TREE_RING_CREATE, "/a/", NULL, 0 }, EEXIST, NULL },
+            { { TREE_RING_CREATE, "/a/x/", NULL, 0 }, 0, NULL },
+            { { TREE_RING_LIST, "/c/", NULL, 0 }, 0, "" },
+            { { TREE_RING_LIST, "/z/", NULL, 0 }, ENOENT, NULL },
+            { { TREE_RING_LIST, "z", NULL, 0 }, EINVAL, NULL },
+            { { TREE_RING_REMOVE, "/q/", NULL, 0 }, ENOENT, NULL },
+            { { TREE_RING_REMOVE_RECURSIVE, "/", NULL, 0 }, EBUSY, NULL },
+        };
+        run_ops(ring, second, 8);
+        check_list(tree, "/", "a,b,c");
+
+        Expected third[] = {
+            { { TREE_RING_MOVE, "/b/", "/a/b/", 0 }, 0, NULL },
+            { { TREE_RING_REMOVE_RECURSIVE, "/c/", NULL, 0 }, 0, NULL },
+            { { TREE_RING_LIST, "/a/x/", NULL, 0 }, 0, "" },
+            { { TREE_RING_MOVE, "/q/", "/r/", 0 }, ENOENT, NULL },
+        };
+        run_ops(ring, third, 4);
+        check_list(tree, "/", "a");
+        check_list(tree, "/a/", "b,x");
+
+        Expected fourth[] = {
+            { { TREE_RING_LIST, "/a/", NULL, 0 }, 0, "b,x" },
+            { { TREE_RING_REMOVE, "/a/x/", NULL, 0 }, 0, NULL },
+        };
+        run_ops(ring, fourth, 1);
+        run_ops(ring, fourth + 1, 1);
+        check_list(tree, "/a/", "b");
+
+        // Completed operations take their entries until they are reaped.
+        TreeRingOp list = { TREE_RING_LIST, "/a/", NULL, 0 };
+        for (size_t i = 0; i < ENTRIES; ++i)
+            CHECK(tree_submit(ring, &list) == 0);
+        CHECK(tree_submit(ring, &list) == EAGAIN);
+        TreeCompletion completions[ENTRIES];
+        size_t reaped = 0;
+        while (reaped < 2) {
+            CHECK(is_readable(ring, 10000));
+            reaped += tree_reap(ring, completions + reaped, 2 - reaped);
+        }
+        for (size_t i = 0; i < reaped; ++i) {
+            CHECK(completions[i].result == 0);
+            CHECK(strcmp(completions[i].listing, "b") == 0);
+            free(completions[i].listing);
+        }
+        CHECK(tree_submit(ring, &list) == 0);
+        CHECK(tree_submit(ring, &list) == 0);
+        CHECK(tree_submit(ring, &list) == EAGAIN);
+
+        // The ring waits for those and frees their listings.
+        tree_ring_free(ring);
+        tree_free(tree);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "check.h"
+#include "rwlock.h"
+
+#include <stdbool.h>
+
+// Readers and writers of one lock check that nobody else is inside with
+// a writer, and writers increment a counter without atomics, which ends up
+// exact only if they never overlap. Runs with every policy.
+
+#define THREADS 8
+#define ROUNDS 50000
+
+typedef struct {
+    RWLock lock;
+    unsigned readers, writers; // Threads inside, changed atomically.
+    uint64_t counter; // Changed only by writers.
+} Shared;
+
+typedef struct {
+    Shared *shared;
+    uint64_t seed;
+    uint64_t writes;
+} Thread;
+
+
+static void inside(Shared *shared, bool writer) {
+    if (writer) {
+        CHECK(__atomic_add_fetch(&shared->writers, 1, __ATOMIC_SEQ_CST) == 1);
+        CHECK(__atomic_load_n(&shared->readers, __ATOMIC_SEQ_CST) == 0);
+        shared->counter++;
+        CHECK(__atomic_sub_fetch(&shared->writers, 1, __ATOMIC_SEQ_CST) == 0);
+    }
+    else {
+        __atomic_add_fetch(&shared->readers, 1, __ATOMIC_SEQ_CST);
+        CHECK(__atomic_load_n(&shared->writers, __ATOMIC_SEQ_CST) == 0);
+        __atomic_sub_fetch(&shared->readers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+static void *worker(void *arg) {
+    Thread *t = arg;
+    Shared *shared = t->shared;
+    RWLockQueue queue = { 0, 0 };
+    for (int i = 0; i < ROUNDS; ++i) {
+        uint64_t r = next_random(&t->seed);
+        bool writer = r % 4 == 0;
+        bool try = (r >> 8) % 8 == 0;
+        if (writer) {
+            if (try) {
+                if (!rwlock_writer_try_entry(&shared->lock))
+                    continue;
+            }
+            else {
+                rwlock_writer_entry(&shared->lock, (r >> 16) % 2 ? &queue : NULL);
+            }
+            inside(shared, true);
+            t->writes++;
+            rwlock_writer_exit(&shared->lock);
+        }
+        else {
+            if (try) {
+                if (!rwlock_reader_try_entry(&shared->lock))
+                    continue;
+            }
+            else {
+                rwlock_reader_entry(&shared->lock, (r >> 16) % 2 ? &queue : NULL);
+            }
+            inside(shared, false);
+            rwlock_reader_exit(&shared->lock);
+        }
+    }
+    CHECK(queue.readers < THREADS && queue.writers < THREADS);
+    return NULL;
+}
+
+
+int main(void) {
+    const struct {
+        RWLockPolicy policy;
+        unsigned reader_batch;
+    } configs[] = {
+        { RWLOCK_PHASE_FAIR, 0 },
+        { RWLOCK_PHASE_FAIR, 2 },
+        { RWLOCK_PREFER_READERS, 0 },
+        { RWLOCK_PREFER_WRITERS, 0 },
+    };
+    for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); ++c) {
+        Shared shared = { .readers = 0, .writers = 0, .counter = 0 };
+        rwlock_init(&shared.lock);
+        rwlock_set_policy(&shared.lock, configs[c].policy, configs[c].reader_batch);
+        Thread threads[THREADS];
+        for (int i = 0; i < THREADS; ++i)
+            threads[i] = (Thread) { &shared, i + 1, 0 };
+        run_threads(THREADS, worker, threads, sizeof(Thread));
+
+        uint64_t writes = 0;
+        for (int i = 0; i < THREADS; ++i)
+            writes += threads[i].writes;
+        CHECK(shared.counter == writes);
+        // Nobody is inside, so both kinds of entries succeed at once.
+        CHECK(rwlock_writer_try_entry(&shared.lock));
+        rwlock_writer_exit(&shared.lock);
+        CHECK(rwlock_reader_try_entry(&shared.lock));
+        rwlock_reader_exit(&shared.lock);
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "check.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+// A saved tree loads back with the same folders, from a file or a pipe, and
+// loading rejects every truncation of a saved tree and random damage to it
+// without crashing (the sanitizer builds check memory errors too).
+
+#define FLIPS 3000
+
+typedef struct {
+    char **paths;
+    size_t count, capacity;
+} Paths;
+
+
+static int collect(void *ctx, const char *path, size_t depth) {
+    (void) depth;
+    Paths *paths = ctx;
+    if (paths->count == paths->capacity) {
+        paths->capacity = paths->capacity ? 2 * paths->capacity : 64;
+        paths->paths = realloc(paths->paths, paths->capacity * sizeof(char *));
+        CHECK(paths->paths);
+    }
+    paths->paths[paths->count] = strdup(path);
+    CHECK(paths->paths[paths->count]);
+    paths->count++;
+    return 0;
+}
+
+
+// Checks that both trees have the same folders, and the same numbers of
+// folders below them.
+static void check_same(Tree *tree1, Tree *tree2) {
+    Paths paths1 = { NULL, 0, 0 }, paths2 = { NULL, 0, 0 };
+    CHECK(tree_walk(tree1, "/", TREE_WALK_DEPTH_FIRST, collect, &paths1) == 0);
+    CHECK(tree_walk(tree2, "/", TREE_WALK_DEPTH_FIRST, collect, &paths2) == 0);
+    CHECK(paths1.count == paths2.count);
+    for (size_t i = 0; i < paths1.count; ++i) {
+        CHECK(strcmp(paths1.paths[i], paths2.paths[i]) == 0);
+        size_t count1, count2;
+        CHECK(tree_count(tree1, paths1.paths[i], &count1) == 0);
+        CHECK(tree_count(tree2, paths2.paths[i], &count2) == 0);
+        CHECK(count1 == count2);
+        free(paths1.paths[i]);
+        free(paths2.paths[i]);
+    }
+    free(paths1.paths);
+    free(paths2.paths);
+}
+
+
+// Replaces the content of file `fd` with given bytes and rewinds it.
+static void rewrite(int fd, const unsigned char *bytes, size_t size) {
+    CHECK(ftruncate(fd, 0) == 0);
+    CHECK(pwrite(fd, bytes, size, 0) == (ssize_t) size);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+}
+
+
+// Saves the tree and returns the saved bytes.
+static unsigned char *save(Tree *tree, int fd, size_t *size) {
+    CHECK(ftruncate(fd, 0) == 0);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    CHECK(tree_save(tree, fd) == 0);
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    CHECK(end > 0);
+    *size = end;
+    unsigned char *bytes = malloc(*size);
+    CHECK(bytes);
+    CHECK(pread(fd, bytes, *size, 0) == (ssize_t) *size);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    return bytes;
+}
+
+
+static void make_tree(Tree *tree) {
+    static const char *paths[] = {
+        "/a/", "/a/b/", "/a/b/c/", "/a/b/c/d/", "/a/b/c/d/e/", "/a/ba/",
+        "/a/bab/", "/a/babc/", "/a/c/", "/abc/", "/abd/", "/abcdefghijklmnop/",
+        "/abcdefghijklmnop/q/", "/z/", "/z/y/", "/z/y/x/", "/z/yy/",
+    };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+        CHECK(tree_create(tree, paths[i]) == 0);
+}
+
+
+int main(void) {
+    FILE *file = tmpfile();
+    CHECK(file);
+    int fd = fileno(file);
+    for (int c = 0; c < TEST_CONFIGS; ++c) {
+        Tree *tree = tree_new_with(&test_configs[c]);
+
+        // An empty tree.
+        size_t size;
+        unsigned char *bytes = save(tree, fd, &size);
+        Tree *loaded = tree_load(fd);
+        CHECK(loaded);
+        check_same(tree, loaded);
+        tree_free(loaded);
+        free(bytes);
+
+        make_tree(tree);
+        bytes = save(tree, fd, &size);
+        loaded = tree_load(fd);
+        CHECK(loaded);
+        check_same(tree, loaded);
+        // A loaded tree is an ordinary one.
+        CHECK(tree_create(loaded, "/a/b/c/d/e/f/") == 0);
+        CHECK(tree_move(loaded, "/z/", "/a/z/") == 0);
+        CHECK(tree_remove_recursive(loaded, "/a/b/") == 0);
+        tree_free(loaded);
+
+        // Saved bytes don't depend on the tree's options.
+        Tree *plain = tree_new();
+        make_tree(plain);
+        size_t plain_size;
+        unsigned char *plain_bytes = save(plain, fd, &plain_size);
+        CHECK(plain_size == size && memcmp(plain_bytes, bytes, size) == 0);
+        free(plain_bytes);
+        tree_free(plain);
+
+        // Pipes are read instead of being mapped.
+        int pipe_fds[2];
+        CHECK(pipe(pipe_fds) == 0);
+        CHECK(write(pipe_fds[1], bytes, size) == (ssize_t) size);
+        CHECK(close(pipe_fds[1]) == 0);
+        loaded = tree_load(pipe_fds[0]);
+        CHECK(loaded);
+        check_same(tree, loaded);
+        tree_free(loaded);
+        CHECK(close(pipe_fds[0]) == 0);
+
+        // Loading starts at the current offset.
+        unsigned char *shifted = malloc(size + 3);
+        CHECK(shifted);
+        memcpy(shifted, "abc", 3);
+        memcpy(shifted + 3, bytes, size);
+        rewrite(fd, shifted, size + 3);
+        CHECK(lseek(fd, 3, SEEK_SET) == 3);
+        loaded = tree_load(fd);
+        CHECK(loaded);
+        check_same(tree, loaded);
+        tree_free(loaded);
+
+        // Every truncation, and extra bytes at the end, are rejected.
+        for (size_t length = 0; length < size; ++length) {
+            rewrite(fd, bytes, length);
+            CHECK(!tree_load(fd));
+        }
+        memcpy(shifted, bytes, size);
+        shifted[size] = 0;
+        rewrite(fd, shifted, size + 1);
+        CHECK(!tree_load(fd));
+        free(shifted);
+
+        // Damaged bytes either load as some valid tree or are rejected.
+        unsigned char *damaged = malloc(size);
+        CHECK(damaged);
+        uint64_t seed = c + 1;
+        for (int i = 0; i < FLIPS; ++i) {
+            memcpy(damaged, bytes, size);
+            uint64_t r = next_random(&seed);
+            damaged[r % size] ^= 1 << (r >> 32) % 8;
+            rewrite(fd, damaged, size);
+            loaded = tree_load(fd);
+            if (loaded) {
+                Paths paths = { NULL, 0, 0 };
+                CHECK(tree_walk(loaded, "/", TREE_WALK_DEPTH_FIRST, collect,
+                                &paths) == 0);
+                size_t count;
+                CHECK(tree_count(loaded, "/", &count) == 0);
+                CHECK(count + 1 == paths.count);
+                for (size_t j = 0; j < paths.count; ++j)
+                    free(paths.paths[j]);
+                free(paths.paths);
+                tree_free(loaded);
+            }
+        }
+        free(damaged);
+        free(bytes);
+        tree_free(tree);
+    }
+    fclose(file);
+    return 0;
+}
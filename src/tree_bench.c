@@ -0,0 +1,441 @@
+#include "Tree.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures throughput and latency of a mix of tree operations on a tree of
+// given shape, against the number of threads. Meaningful only in an
+// optimized build (-DCMAKE_BUILD_TYPE=Release).
+//
+// The tree is full: every folder up to `depth` has `fan_out` subfolders.
+// Operations pick such folders with a Zipfian distribution (so some are
+// much hotter than others) and then:
+//  list   - lists the folder,
+//  create - creates a leaf folder in it, from a small set of names,
+//  remove - removes such a leaf folder,
+//  move   - moves such a leaf folder into another picked folder.
+// So the shape of the tree stays the same during runs.
+
+#define MAX_FOLDERS 2000000
+#define MAX_THREADS 256
+#define LEAF_NAMES 16
+
+// Latencies are kept in buckets 16 per power of two, so percentiles are
+// accurate to about 6%.
+#define SUB_BUCKETS 16
+#define BUCKETS (64 * SUB_BUCKETS)
+
+typedef enum { OP_LIST, OP_CREATE, OP_REMOVE, OP_MOVE, OP_KINDS } OpKind;
+
+static const char* op_names[OP_KINDS] = { "list", "create", "remove", "move" };
+
+typedef struct {
+    size_t threads[MAX_THREADS];
+    size_t n_threads;
+    size_t depth;
+    size_t fan_out;
+    double skew; // Zipf exponent, 0 means uniform.
+    unsigned weights[OP_KINDS];
+    double seconds;
+    size_t path_cache;
+    size_t root_shards;
+    TreeLockPolicy lock_policy;
+    unsigned lock_reader_batch;
+} Config;
+
+typedef struct {
+    uint64_t ops[OP_KINDS];
+    uint64_t latencies[BUCKETS];
+} Result;
+
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    Result result;
+} Worker;
+
+static Config config;
+static Tree* tree;
+static char** folders; // Paths of all folders but the root.
+static size_t n_folders;
+static double* zipf_cdf; // zipf_cdf[i] - probability of ranks 0..i.
+static size_t* rank_folder; // Folder with given popularity rank.
+static bool running;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static double random_unit(uint64_t* state)
+{
+    return (next_random(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+// Name of i-th child, in base 26.
+static char* append_name(char* p, size_t i)
+{
+    char name[16];
+    size_t length = 0;
+    do {
+        name[length++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    while (length > 0)
+        *p++ = name[--length];
+    *p++ = '/';
+    *p = '\0';
+    return p;
+}
+
+static void add_folders(const char* parent, size_t depth)
+{
+    if (depth == config.depth)
+        return;
+    size_t length = strlen(parent);
+    for (size_t i = 0; i < config.fan_out; ++i) {
+        char* path = malloc(length + 16);
+        memcpy(path, parent, length);
+        append_name(path + length, i);
+        folders[n_folders++] = path;
+        add_folders(path, depth + 1);
+    }
+}
+
+static void build_shape(void)
+{
+    size_t total = 0, level = 1;
+    for (size_t d = 0; d < config.depth; ++d) {
+        level *= config.fan_out;
+        total += level;
+        if (total > MAX_FOLDERS) {
+            fprintf(stderr, "Tree with more than %d folders requested.\n",
+                    MAX_FOLDERS);
+            exit(1);
+        }
+    }
+    folders = malloc(total * sizeof(char*));
+    add_folders("/", 0);
+
+    zipf_cdf = malloc(n_folders * sizeof(double));
+    double sum = 0;
+    for (size_t i = 0; i < n_folders; ++i) {
+        sum += 1.0 / pow(i + 1, config.skew);
+        zipf_cdf[i] = sum;
+    }
+    for (size_t i = 0; i < n_folders; ++i)
+        zipf_cdf[i] /= sum;
+
+    // Popular folders are scattered over the whole tree.
+    uint64_t seed = 42;
+    rank_folder = malloc(n_folders * sizeof(size_t));
+    for (size_t i = 0; i < n_folders; ++i)
+        rank_folder[i] = i;
+    for (size_t i = n_folders - 1; i > 0; --i) {
+        size_t j = next_random(&seed) % (i + 1);
+        size_t t = rank_folder[i];
+        rank_folder[i] = rank_folder[j];
+        rank_folder[j] = t;
+    }
+}
+
+static const char* pick_folder(uint64_t* seed)
+{
+    double u = random_unit(seed);
+    size_t low = 0, high = n_folders - 1;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return folders[rank_folder[low]];
+}
+
+static void leaf_path(char* path, const char* folder, uint64_t* seed)
+{
+    size_t length = strlen(folder);
+    memcpy(path, folder, length);
+    path[length] = 'a'; // Names of tree folders have no leading 'a' (zero).
+    append_name(path + length + 1, next_random(seed) % LEAF_NAMES);
+}
+
+static OpKind pick_op(uint64_t* seed)
+{
+    unsigned total = 0;
+    for (int k = 0; k < OP_KINDS; ++k)
+        total += config.weights[k];
+    unsigned r = next_random(seed) % total;
+    int k = 0;
+    while (r >= config.weights[k])
+        r -= config.weights[k++];
+    return k;
+}
+
+static void record_latency(Result* result, uint64_t ns)
+{
+    size_t bucket;
+    if (ns < SUB_BUCKETS) {
+        bucket = ns;
+    } else {
+        int log = 63 - __builtin_clzll(ns);
+        size_t sub = (ns >> (log - 4)) & (SUB_BUCKETS - 1);
+        bucket = (log - 3) * SUB_BUCKETS + sub;
+    }
+    result->latencies[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+}
+
+// Upper bound of latencies in given bucket.
+static uint64_t bucket_limit(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    int log = bucket / SUB_BUCKETS + 3;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (log - 4)) - 1;
+}
+
+static void* work(void* arg)
+{
+    Worker* worker = arg;
+    Result* result = &worker->result;
+    char source[1024], target[1024];
+    pthread_barrier_wait(&start_barrier);
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        OpKind op = pick_op(&worker->seed);
+        const char* folder = pick_folder(&worker->seed);
+        if (op != OP_LIST)
+            leaf_path(source, folder, &worker->seed);
+        if (op == OP_MOVE)
+            leaf_path(target, pick_folder(&worker->seed), &worker->seed);
+
+        uint64_t start = now_ns();
+        switch (op) {
+        case OP_LIST:
+            free(tree_list(tree, folder));
+            break;
+        case OP_CREATE:
+            tree_create(tree, source);
+            break;
+        case OP_REMOVE:
+            tree_remove(tree, source);
+            break;
+        default:
+            tree_move(tree, source, target);
+            break;
+        }
+        record_latency(result, now_ns() - start);
+        result->ops[op]++;
+    }
+    return NULL;
+}
+
+static uint64_t percentile(const Result* total, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t) ceil(count * p);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS; ++b) {
+        seen += total->latencies[b];
+        if (seen >= rank && seen > 0)
+            return bucket_limit(b);
+    }
+    return bucket_limit(BUCKETS - 1);
+}
+
+// Runs the mix with `n` threads and returns total operations per second.
+static double run(size_t n, double base)
+{
+    TreeOptions options = { .path_cache_entries = config.path_cache,
+                            .root_shards = config.root_shards,
+                            .lock_policy = config.lock_policy,
+                            .lock_reader_batch = config.lock_reader_batch };
+    tree = tree_new_with(&options);
+    for (size_t i = 0; i < n_folders; ++i)
+        tree_create(tree, folders[i]);
+
+    Worker* workers = calloc(n, sizeof(Worker));
+    pthread_barrier_init(&start_barrier, NULL, n + 1);
+    running = true;
+    for (size_t i = 0; i < n; ++i) {
+        workers[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    usleep((useconds_t) (config.seconds * 1e6));
+    __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < n; ++i)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (now_ns() - start) * 1e-9;
+    pthread_barrier_destroy(&start_barrier);
+
+    Result total;
+    memset(&total, 0, sizeof(total));
+    uint64_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (int k = 0; k < OP_KINDS; ++k) {
+            total.ops[k] += workers[i].result.ops[k];
+            count += workers[i].result.ops[k];
+        }
+        for (size_t b = 0; b < BUCKETS; ++b)
+            total.latencies[b] += workers[i].result.latencies[b];
+    }
+    free(workers);
+    tree_free(tree);
+
+    double throughput = count / elapsed;
+    // Efficiency is throughput per thread relative to the first run.
+    double per_thread = base > 0 ? base : throughput / n;
+    printf("%8zu %14.0f %10.2f %10.2f %10.2f %10.2f\n", n, throughput,
+           throughput / n / per_thread, percentile(&total, count, 0.5) * 1e-3,
+           percentile(&total, count, 0.99) * 1e-3,
+           percentile(&total, count, 0.999) * 1e-3);
+    return throughput / n;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads,...] [-d depth] [-f fan-out] [-s skew]\n"
+            "          [-m list:create:remove:move] [-n seconds] [-c cache]\n"
+            "          [-r shards] [-l fair|readers|writers[:batch]]\n"
+            "  -t  thread counts to run with (default 1,2,4,8)\n"
+            "  -d  depth of the tree (default 3)\n"
+            "  -f  subfolders of every folder (default 10)\n"
+            "  -s  Zipf exponent of folder popularity, 0 for uniform (default 0.99)\n"
+            "  -m  weights of operations (default 80:8:8:4)\n"
+            "  -n  seconds per thread count (default 1)\n"
+            "  -c  path cache entries, see TreeOptions (default 0)\n"
+            "  -r  shards of the root, see TreeOptions (default 0)\n"
+            "  -l  lock policy and reader batch, see TreeOptions (default fair:0)\n",
+            name);
+    exit(1);
+}
+
+static void parse_threads(const char* list)
+{
+    config.n_threads = 0;
+    while (*list && config.n_threads < MAX_THREADS) {
+        char* end;
+        long n = strtol(list, &end, 10);
+        if (n <= 0 || end == list)
+            usage("tree_bench");
+        config.threads[config.n_threads++] = n;
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void parse_lock_policy(const char* arg)
+{
+    static const char* names[] = { "fair", "readers", "writers" };
+    static const TreeLockPolicy policies[] = { TREE_LOCK_PHASE_FAIR,
+                                               TREE_LOCK_PREFER_READERS,
+                                               TREE_LOCK_PREFER_WRITERS };
+    size_t length = strcspn(arg, ":");
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strlen(names[i]) == length && strncmp(arg, names[i], length) == 0) {
+            config.lock_policy = policies[i];
+            if (arg[length] == ':')
+                config.lock_reader_batch = strtoul(arg + length + 1, NULL, 10);
+            return;
+        }
+    }
+    usage("tree_bench");
+}
+
+int main(int argc, char** argv)
+{
+    static const unsigned default_weights[OP_KINDS] = { 80, 8, 8, 4 };
+    parse_threads("1,2,4,8");
+    config.depth = 3;
+    config.fan_out = 10;
+    config.skew = 0.99;
+    memcpy(config.weights, default_weights, sizeof(default_weights));
+    config.seconds = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:f:s:m:n:c:r:l:")) != -1) {
+        switch (opt) {
+        case 't':
+            parse_threads(optarg);
+            break;
+        case 'd':
+            config.depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            config.fan_out = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.skew = strtod(optarg, NULL);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%u:%u:%u:%u", &config.weights[OP_LIST],
+                       &config.weights[OP_CREATE], &config.weights[OP_REMOVE],
+                       &config.weights[OP_MOVE]) != OP_KINDS)
+                usage(argv[0]);
+            break;
+        case 'n':
+            config.seconds = strtod(optarg, NULL);
+            break;
+        case 'c':
+            config.path_cache = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            config.root_shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            parse_lock_policy(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    unsigned total_weight = 0;
+    for (int k = 0; k < OP_KINDS; ++k)
+        total_weight += config.weights[k];
+    if (config.depth == 0 || config.fan_out == 0 || total_weight == 0
+        || config.n_threads == 0)
+        usage(argv[0]);
+
+    build_shape();
+    printf("%zu folders, depth %zu, fan-out %zu, skew %.2f, mix", n_folders,
+           config.depth, config.fan_out, config.skew);
+    for (int k = 0; k < OP_KINDS; ++k)
+        printf(" %s %u", op_names[k], config.weights[k]);
+    printf("\n%8s %14s %10s %10s %10s %10s\n", "threads", "ops/s",
+           "efficiency", "p50 us", "p99 us", "p999 us");
+    double base = 0;
+    for (size_t i = 0; i < config.n_threads; ++i) {
+        double per_thread = run(config.threads[i], base);
+        if (i == 0)
+            base = per_thread;
+    }
+
+    for (size_t i = 0; i < n_folders; ++i)
+        free(folders[i]);
+    free(folders);
+    free(zipf_cdf);
+    free(rank_folder);
+    return 0;
+}
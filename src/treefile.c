@@ -0,0 +1,201 @@
+#include "treefile.h"
+#include "Tree.h"
+#include "snapshot.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bytes read at once from descriptors which can't be mapped.
+#define READ_CHUNK (1 << 16)
+
+
+void treefile_writer_init(TreeFileWriter *writer, int fd) {
+    writer->fd = fd;
+    writer->error = 0;
+    writer->used = 0;
+}
+
+
+static void flush(TreeFileWriter *writer) {
+    size_t done = 0;
+    while (!writer->error && done < writer->used) {
+        ssize_t n = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (n >= 0)
+            done += n;
+        else if (errno != EINTR)
+            writer->error = errno;
+    }
+    writer->used = 0;
+}
+
+
+void treefile_put_bytes(TreeFileWriter *writer, const void *bytes, size_t length) {
+    const unsigned char *next = bytes;
+    while (length > 0) {
+        if (writer->used == sizeof(writer->buffer))
+            flush(writer);
+        size_t n = sizeof(writer->buffer) - writer->used;
+        if (n > length)
+            n = length;
+        memcpy(writer->buffer + writer->used, next, n);
+        writer->used += n;
+        next += n;
+        length -= n;
+    }
+}
+
+
+void treefile_put_varint(TreeFileWriter *writer, uint64_t value) {
+    unsigned char bytes[10];
+    size_t length = 0;
+    do {
+        bytes[length] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            bytes[length] |= 0x80;
+        length++;
+    } while (value);
+    treefile_put_bytes(writer, bytes, length);
+}
+
+
+int treefile_writer_finish(TreeFileWriter *writer) {
+    flush(writer);
+    return writer->error;
+}
+
+
+int treefile_reader_open(TreeFileReader *reader, int fd) {
+    reader->mapping = NULL;
+    reader->position = 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return errno;
+    off_t offset = S_ISREG(st.st_mode) ? lseek(fd, 0, SEEK_CUR) : -1;
+    if (offset >= 0 && offset < st.st_size) {
+        // The whole file is mapped, as mappings start at page boundaries.
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            reader->mapping = mapping;
+            reader->mapping_size = st.st_size;
+            reader->data = (const unsigned char *) mapping + offset;
+            reader->size = st.st_size - offset;
+            return 0;
+        }
+    }
+
+    size_t size = 0, capacity = 0;
+    unsigned char *data = NULL;
+    while (true) {
+        if (capacity - size < READ_CHUNK) {
+            capacity = capacity ? capacity * 2 : READ_CHUNK;
+            unsigned char *grown = realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                return ENOMEM;
+            }
+            data = grown;
+        }
+        ssize_t n = read(fd, data + size, capacity - size);
+        if (n == 0)
+            break;
+        if (n > 0)
+            size += n;
+        else if (errno != EINTR) {
+            int error = errno;
+            free(data);
+            return error;
+        }
+    }
+    reader->data = data;
+    reader->size = size;
+    return 0;
+}
+
+
+void treefile_reader_close(TreeFileReader *reader) {
+    if (reader->mapping)
+        munmap(reader->mapping, reader->mapping_size);
+    else
+        free((void *) reader->data);
+}
+
+
+bool treefile_get_varint(TreeFileReader *reader, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (reader->position == reader->size)
+            return false;
+        unsigned char byte = reader->data[reader->position++];
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool treefile_get_bytes(TreeFileReader *reader, size_t length,
+                        const unsigned char **bytes) {
+    if (length > reader->size - reader->position)
+        return false;
+    *bytes = reader->data + reader->position;
+    reader->position += length;
+    return true;
+}
+
+
+static void save_folder(TreeFileWriter *writer, const SnapNode *node) {
+    const Listing *listing = node->listing;
+    treefile_put_varint(writer, listing->count);
+    if (listing->count == 0)
+        return;
+    treefile_put_varint(writer, listing->length);
+    const char *previous = NULL;
+    size_t previous_length = 0;
+    for (size_t i = 0; i < listing->count; ++i) {
+        const char *name = listing->string + listing->starts[i];
+        size_t length = listing->starts[i + 1] - listing->starts[i] - 1;
+        size_t shared = 0;
+        while (shared < length && shared < previous_length
+               && name[shared] == previous[shared])
+            shared++;
+        treefile_put_varint(writer, shared);
+        treefile_put_varint(writer, length - shared);
+        treefile_put_bytes(writer, name + shared, length - shared);
+        previous = name;
+        previous_length = length;
+    }
+    for (size_t i = 0; i < listing->count; ++i)
+        save_folder(writer, node->children[i]);
+}
+
+
+int treefile_save(const TreeSnapshot *snapshot, int fd) {
+    TreeFileWriter *writer = safe_malloc(sizeof(TreeFileWriter));
+    treefile_writer_init(writer, fd);
+    treefile_put_bytes(writer, TREEFILE_MAGIC, TREEFILE_MAGIC_LENGTH);
+    treefile_put_varint(writer, snapshot_sequence(snapshot));
+    save_folder(writer, snapshot_root(snapshot));
+    int result = treefile_writer_finish(writer);
+    free(writer);
+    return result;
+}
+
+
+// The tree is saved from a snapshot, so it is consistent and writing it out
+// doesn't hold any locks.
+int tree_save(Tree *tree, int fd) {
+    TreeSnapshot *snapshot = tree_snapshot(tree, "/");
+    int result = treefile_save(snapshot, fd);
+    tree_snapshot_free(snapshot);
+    return result;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Tree.h"
+
+// Format of trees saved by tree_save(). After the magic bytes comes the
+// number of the first change not included (see journal.h), and then the
+// folders in preorder, starting with the root. A folder is the number of its
+// children and, if it has any, the length of its listing (names separated by
+// commas), followed by the names in sorted order and then the folders of the
+// children in the same order. Each name is stored as the length of the prefix
+// it shares with the previous name, the length of the rest and the rest.
+// Numbers are unsigned LEB128 varints.
+#define TREEFILE_MAGIC "FSTREE\0\2"
+#define TREEFILE_MAGIC_LENGTH 8
+
+// Buffered writes to a file descriptor. After the first error nothing more
+// is written and `error` keeps the errno value.
+typedef struct {
+    int fd;
+    int error;
+    size_t used;
+    unsigned char buffer[1 << 16];
+} TreeFileWriter;
+
+void treefile_writer_init(TreeFileWriter *writer, int fd);
+
+void treefile_put_varint(TreeFileWriter *writer, uint64_t value);
+
+void treefile_put_bytes(TreeFileWriter *writer, const void *bytes, size_t length);
+
+// Writes out buffered bytes. Returns 0 or the error of the first failed write.
+int treefile_writer_finish(TreeFileWriter *writer);
+
+// Bytes of a saved tree, mapped into memory if the descriptor refers to
+// a regular file, read into a buffer otherwise.
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t position;
+    void *mapping; // Start of the mapping, NULL if the bytes were read.
+    size_t mapping_size;
+} TreeFileReader;
+
+// Makes all bytes from the current offset of `fd` to its end available.
+// Returns 0 or an errno value.
+int treefile_reader_open(TreeFileReader *reader, int fd);
+
+void treefile_reader_close(TreeFileReader *reader);
+
+// Both return false if the data ends too early (or the varint is too long).
+bool treefile_get_varint(TreeFileReader *reader, uint64_t *value);
+
+bool treefile_get_bytes(TreeFileReader *reader, size_t length,
+                        const unsigned char **bytes);
+
+// Writes a snapshot of the whole tree to `fd`, like tree_save() does.
+int treefile_save(const TreeSnapshot *snapshot, int fd);
@@ -1,8 +1,12 @@
 #include "utils.h"
 #include "err.h"
 
+#include <errno.h>
+#include <linux/futex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 void* safe_malloc(size_t n) {
     void *ptr = malloc(n);
@@ -59,6 +63,18 @@ void safe_signal(pthread_cond_t *cond) {
         syserr (err, "Cond signal failed.");
 }
 
+void safe_futex_wait(uint32_t *futex, uint32_t expected, uint32_t mask) {
+    if (syscall(SYS_futex, futex, FUTEX_WAIT_BITSET_PRIVATE, expected,
+                NULL, NULL, mask) != 0 && errno != EAGAIN && errno != EINTR)
+        syserr("Futex wait failed.");
+}
+
+void safe_futex_wake(uint32_t *futex, int count, uint32_t mask) {
+    if (syscall(SYS_futex, futex, FUTEX_WAKE_BITSET_PRIVATE, count,
+                NULL, NULL, mask) < 0)
+        syserr("Futex wake failed.");
+}
+
 bool is_root(const char *path) {
     return strcmp(path, "/") == 0;
 }
@@ -2,6 +2,7 @@
 #define MIMUW_FORK_UTILS_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <stdbool.h>
 
@@ -32,6 +33,14 @@ void safe_wait(pthread_cond_t*, pthread_mutex_t*);
 // Tries to make signal on condition, reports error if needed.
 void safe_signal(pthread_cond_t*);
 
+// Sleeps until woken up if futex word still equals given value, reports
+// error if needed. Only wake ups with a common bit in mask concern caller.
+void safe_futex_wait(uint32_t*, uint32_t, uint32_t);
+
+// Wakes up at most given number of threads sleeping on futex word with
+// a common bit in mask, reports error if needed.
+void safe_futex_wake(uint32_t*, int, uint32_t);
+
 // Checks if path is equal to root path.
 bool is_root(const char*);
 